@@ -73,15 +73,124 @@ namespace TextGun
         std::string("I")
     };
 
+    /* CounterArray */
+
+    //Largest value held exactly by a 2 byte counter. Past it, 2 byte counters hold values with 12 significant bits
+    const int CounterArray::EXACT_16=0x7FFF;
+
     /* FrecLink */
 
     std::default_random_engine FrecLink::re(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));//Random engine
 
+    //Lists with more words than this keep a dictionary with their positions. Shorter ones are searched
+    const int FrecLink::DICT_MIN=16;
+
+    //Lists with up to this many words are sampled by counting the cumulative frecuencies below the drawn number, all at once. Longer ones are searched
+    const int FrecLink::SMALL_DEGREE=64;
+
+    //Word returned when there's nothing to pick
+    const Word FrecLink::END_WORD(WordType::END);
+
+    /* WordGraph */
+
+    std::default_random_engine WordGraph::re(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));//Random engine
+
+    //Magic number closing the index of a model file
+    const char WordGraph::INDEX_MAGIC[8]={'T','G','U','N','I','D','X','2'};
+
+    //Number of nodes on each chunk of a model file. Chunks are encoded and decoded in parallel
+    const int WordGraph::CHUNK_NODES=4096;
+
+    //Fewest links in a batch for it to be added by several threads
+    const std::size_t WordGraph::PARALLEL_LINKS=1<<14;
+
+    /* TokenCache */
+
+    //Default number of slots
+    const int TokenCache::DEF_SLOTS=1<<16;
+
     /* ITextStream */
 
     //Word to be returned if an error arises during reading
     const Word ITextStream::DEF_ERR_WORD(WordType::END);
 
+    /* BigramBatch */
+
+    //Default number of links held before the batch is full
+    const int BigramBatch::DEF_MAX_LINKS=1<<22;
+
+    /* LineCounter */
+
+    //Default number of distinct lines held before the counter is full
+    const int LineCounter::DEF_MAX_LINES=1<<16;
+
+    /* CorpusGenerator */
+
+    //Default number of distinct words
+    const int CorpusGenerator::DEF_VOCAB=50000;
+
+    //Default exponent of the distribution, the classic Zipf's law
+    const double CorpusGenerator::DEF_EXPONENT=1.0;
+
+    //Binary digits of the exponent kept after the point. Each one costs a square root per word of the vocabulary
+    const int CorpusGenerator::EXPONENT_BITS=20;
+
+    //Minimum and maximum number of words in a sentence
+    const int CorpusGenerator::MIN_WORDS=3;
+    const int CorpusGenerator::MAX_WORDS=16;
+
+    /* LiveModel */
+
+    //Default number of lines learned between versions
+    const int LiveModel::DEF_PUBLISH_LINES=1024;
+
+    //A version doesn't start until this many times as long as the last one took to build has passed. Building takes at most a quarter of the time
+    const int LiveModel::PUBLISH_SPACING=3;
+
+    /* LearnPipeline */
+
+    //Default size of the blocks read, in bytes. Links repeated within a block are learned once, so larger blocks mean less work for the graph
+    const std::size_t LearnPipeline::DEF_BLOCK=1<<23;
+
+    //Default number of bytes read but not learned yet before the reader waits. Bounds the blocks and batches of every stage together, however many tokenizers there are
+    const std::size_t LearnPipeline::DEF_IN_FLIGHT=1<<25;
+
+    /* WordModel */
+
+    //Links a background snapshot copies while holding the lock, about. Copying them takes well under a millisecond
+    const int WordModel::SNAPSHOT_LINKS=1<<12;
+
+    //Fraction of the vocabulary cap freed when it's hit, so learning doesn't prune on every new word
+    const double WordModel::PRUNE_SLACK=0.1;
+
+    //Nodes checked for reclaiming after each line learned, once frecuencies decay
+    const int WordModel::RECLAIM_STEP=8;
+
+    //Counters on each row of the sketch used while streaming
+    const int WordModel::SKETCH_WIDTH=1<<20;
+
+    //Rows of the sketch used while streaming
+    const int WordModel::SKETCH_DEPTH=4;
+
+    /* LazyWordModel */
+
+    //Default number of decoded nodes kept in memory
+    const std::size_t LazyWordModel::DEF_CACHE=1<<16;
+    /* LatencyHistogram */
+
+    //Bits kept after the highest one. Each power of 2 is split in 2^SUB_BITS buckets
+    const int LatencyHistogram::SUB_BITS=4;
+
+    //Number of buckets, enough for any 64 bit value
+    const int LatencyHistogram::BUCKETS=(65-SUB_BITS)<<SUB_BITS;
+
+    /* Stats */
+
+    std::mutex Stats::threads_lock;//Guards the list and the totals
+    std::vector<Stats::Local*> Stats::threads;//Counters of the running threads
+    Stats Stats::finished;//Totals of the finished threads
+    Stats Stats::base;//Totals on the last reset
+
     /*
             Functions
     */
@@ -165,6 +274,15 @@ namespace TextGun
         }
     }
 
+    /* Threads */
+
+    //Number of threads to use when 0 is requested: one per core
+    unsigned default_threads()
+    {
+        unsigned rv=std::thread::hardware_concurrency();
+        return rv?rv:1;//May be unknown
+    }
+
     /*
         Word
     */
@@ -212,6 +330,14 @@ namespace TextGun
         return !operator==(w);
     }
 
+    /*Hashing*/
+
+    //Hash of the text and type
+    std::size_t Word::hash() const
+    {
+        return std::hash<std::string>()(s)^(static_cast<std::size_t>(t)*0x9E3779B97F4A7C15ULL);
+    }
+
     /* Methods */
 
     /*Read/write to file*/
@@ -223,7 +349,7 @@ namespace TextGun
         o.write(reinterpret_cast<const char *>(&t),sizeof(char));
 
         //Write the number of bytes of the string
-        std::string::size_type sz=s.size();
+        int sz=s.size();
         o.write(reinterpret_cast<const char *>(&sz),sizeof(int));
 
         //Write the string
@@ -236,9 +362,9 @@ namespace TextGun
         //Read the type of the word
         i.read(reinterpret_cast<char *>(&t),sizeof(char));
 
-        //Read the number of bytes
-        std::string::size_type sz;
-        i.read(reinterpret_cast<char *>(&sz),sizeof(std::string::size_type));
+        //Read the number of bytes. Stored as an int, same as it's written
+        int sz=0;
+        i.read(reinterpret_cast<char *>(&sz),sizeof(int));
 
         //Create a buffer
         char *str=new char[sz+1];
@@ -330,964 +456,4629 @@ namespace TextGun
     }
 
     /*
-        FrecLink
+        WordPool
     */
 
     /* Constructors, copy control */
 
     /*Constructors*/
 
-    //Default constructors
-    FrecLink::FrecLink()
-    :words(),dict(),f(0),n(0)
+    //Default constructor
+    WordPool::WordPool()
+    :arena(),pool(&arena),words(&pool),lock()
     {}
 
     /* Methods */
 
-    /*Add/delete*/
+    /*Words*/
 
-    //Add a word to the list
-    void FrecLink::add_word(const Word &w)
+    //Get the stored copy of a word, adding it if needed. Can be called from several threads
+    const Word* WordPool::intern(const Word &w)
     {
-        ++f;//Increase the frecuency of total links
+        std::lock_guard<std::mutex> guard(lock);
 
-        //Check if the word is on the list
-        if (dict.find(w)==dict.end())//Not found
-        {
-            //Insert it at the end of the list with frec=1 (since it's the first time this word's been seen)
-            words.emplace_back(1,w);
-            //Add the word to the dictionary
-            dict[w]=std::prev(words.end());//Save the iterator to the last element of the list, where the word is now saved
+        return &*words.emplace(w).first;
+    }
 
-            ++n;//A new node on the list
-        }
-        else//Found
-        {
-            std::list< std::pair< int,Word > >::iterator pos=dict[w];//Get the position of the pair
-            ++(pos->first);//Increment the frecuency by one
+    //Get the stored copy of a word, nullptr if it isn't stored
+    const Word* WordPool::find(const Word &w) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
 
-            //Find the new position on the list for this element
-            std::list< std::pair< int,Word > >::iterator new_pos=keep_sorted_swap(pos);
+        auto it=words.find(Entry(w));
+        return it==words.end()?nullptr:&*it;
+    }
 
-            //Swap positions, only if they're different
-            if (pos!=new_pos) words.splice(new_pos,words,pos);
-        }
+    //Drop a word. Nothing can point to it anymore
+    void WordPool::release(const Word *w)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        words.erase(static_cast<const Entry&>(*w));
     }
 
-    //Take an iterator to a word on the list, and return another word to swap them so that the list is still sorted. Return the same iterator if no swap is needed
-    std::list< std::pair< int,Word > >::iterator FrecLink::keep_sorted_swap(const std::list< std::pair< int,Word > >::iterator &pos) const
+    //Number of words
+    int WordPool::size() const
     {
-        std::reverse_iterator< std::list< std::pair< int,Word > >::iterator > rev_it(pos);//Reverse operator to start looking at one upper from this one
-        /*
-          std::advance(rev_it,1);//Advance the iterator by one, no longer looking at the same element, but at the upper one. Iterator's valid because pos!=begin()
-          No need to do this! Given the way reverse iterators work, rev_it is using pos as its base(), so it's alredy pointing at the next value
-        */
+        std::lock_guard<std::mutex> guard(lock);
 
-        while (rev_it!=words.rend())//Look while there are still elemets to iterate
-        {
-            if((rev_it->first) >= (pos->first))//Find one to switch for
-                break;//Stop the search
-            ++rev_it;//If nothing was found, continue searching
-        }
+        return words.size();
+    }
 
-        /*
-            Swap the position between pos and the new found one (rev_it).
-            Get the forward iterator, which points to the previous element, using base().
-            If no value was found, rev_it==rend(), which means rev_it.base()==begin(),
-            so it'll be swapped to the top where it belongs (since no value being found means this is the biggest one).
-            If a value was found, then base() contains the previous value,
-            so it'll be swapped right before the value found, keeping things sorted.
-            NOTE: getting base() from a reverse iterator will always be valid if the reverse iterator was valid,
-            keeping in mind that base() of rbegin() is end(), which is a valid iterator that cannot be dereferenced.
-        */
+    //Drop every word, returning all the memory at once. Nothing can point to them anymore
+    void WordPool::clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
 
-        return rev_it.base();
+        //The buckets live on the arena too, swap them out with an empty table so they're freed before releasing it
+        std::pmr::unordered_set< Entry,WordHash >(&pool).swap(words);
+        pool.release();
+        arena.release();
     }
 
-    /*Links*/
+    /*
+        CounterArray
+    */
 
-    //Get a random word based on frecuency
-    Word FrecLink::get_rand() const
-    {
-        //Create the RNG to use it with the engine
-        std::uniform_int_distribution<> dt(0,f-1);
+    /* Constructors, copy control */
 
-        //Random number generated
-        int n=dt(re);
+    /*Constructors*/
 
-        //Navigate through the links until the goal number is met
-        for (std::pair< int,Word > w : words)
-        {
-            n-=w.first;//Decrease the goal by this word's frecuency
+    //Default constructor, 1 byte counters allocated from the given memory
+    CounterArray::CounterArray(std::pmr::memory_resource *mr)
+    :data(mr),width(1)
+    {}
 
-            if(n<0)//If the goal is met, return this word
-                return w.second;
-        }
+    //Copy constructor, allocating from the given memory
+    CounterArray::CounterArray(const CounterArray &ca,std::pmr::memory_resource *mr)
+    :data(ca.data,mr),width(ca.width)
+    {}
 
-        //If no word is found, an error just happened
-        return Word(WordType::END);//Should throw an exception, by the time being the END world will be returned. Note that the word END is valid
-    }
+    /* Methods */
 
-    /*Read/write to file*/
+    /*Get/set*/
 
-    //Write word to stream
-    void FrecLink::write(std::ostream &o) const
+    //Get the value of a counter
+    int CounterArray::get(int k) const
     {
-        //Write the number of entries
-        o.write(reinterpret_cast<const char *>(&n),sizeof(int));
-        //Write the sum of the frecuencies
-        o.write(reinterpret_cast<const char *>(&f),sizeof(int));
+        const std::uint8_t *p=&data[static_cast<std::size_t>(k)*width];
 
-        //Write the list
-        for(const std::pair< int,Word > &p : words)
+        switch (width)
         {
-            //Write the frec
-            o.write(reinterpret_cast<const char *>(&p.first),sizeof(int));
-
-            //Write the word
-            p.second.write(o);
+            case 1:
+                return *p;
+            case 2:
+            {
+                std::uint16_t c;
+                std::memcpy(&c,p,sizeof(c));
+                return decode(c,2);
+            }
+            default:
+            {
+                std::uint32_t c;
+                std::memcpy(&c,p,sizeof(c));
+                return static_cast<int>(c);
+            }
         }
     }
 
-    //Read word to stream
-    void FrecLink::read(std::istream &i)
+    //Set the value of a counter, widening every counter if it doesn't fit
+    void CounterArray::set(int k,int v)
     {
-        //Read number of entries
-        n=0;//Set to zero in case of fail reading
-        i.read(reinterpret_cast<char *>(&n),sizeof(int));
-        //Read the sum of the frecuencies
-        i.read(reinterpret_cast<char *>(&f),sizeof(int));
+        int w=width_for(v);
+        if (w>width)
+            rewiden(w);
 
-        //Iterator to insert
-        auto it=words.begin()==words.end()?words.begin():std::prev(words.end());//This list should always be empty, just to make sure, start at the end
+        std::uint8_t *p=&data[static_cast<std::size_t>(k)*width];
+        std::uint32_t c=encode(v,width);
 
-        //Read the list
-        int iters=n;
-        while(iters-->0)//Read all the entries
+        switch (width)
         {
-            //Read the frec
-            int word_frec=0;
-            i.read(reinterpret_cast<char *>(&word_frec),sizeof(int));
-
-            //Read the word
-            Word w("");
-            w.read(i);
-
-            //Insert the word on the list
-            it=words.emplace(it,word_frec,w);
-
-            //Insert the word on the map
-            dict[w]=it++;//Increment the iterator after inserting, as to keep inserting after the end
+            case 1:
+                *p=static_cast<std::uint8_t>(c);
+                break;
+            case 2:
+            {
+                std::uint16_t c16=static_cast<std::uint16_t>(c);
+                std::memcpy(p,&c16,sizeof(c16));
+                break;
+            }
+            default:
+                std::memcpy(p,&c,sizeof(c));
         }
     }
 
-    /*
-        WordNode
-    */
-
-    /* Constructors, copy control */
+    /*Add/delete*/
 
-    /*Constructors*/
+    //Add a counter at the end
+    void CounterArray::push_back(int v)
+    {
+        data.resize(data.size()+width);
+        set(size()-1,v);
+    }
 
-    //Complete constructor
-    WordNode::WordNode(const Word &nw)
-    :prev(),next(),w(nw),f(1)
-    {}
+    //Remove the last counter
+    void CounterArray::pop_back()
+    {
+        data.resize(data.size()-width);
+    }
 
-    /* Methods */
+    //Add count counters of another array at the end, starting from its counter from
+    void CounterArray::append(const CounterArray &ca,int from,int count)
+    {
+        if (data.empty())
+            width=ca.width;
 
-    /*Links*/
+        //Same width, the encoded counters are copied as they are
+        if (width==ca.width)
+            data.insert(data.end(),ca.data.begin()+static_cast<std::ptrdiff_t>(from)*width,ca.data.begin()+static_cast<std::ptrdiff_t>(from+count)*width);
+        else
+        {
+            for (int k=from;k<from+count;++k)
+                push_back(ca.get(k));
+        }
+    }
 
-    //Add a link
+    //Swap two counters
+    void CounterArray::swap(int a,int b)
+    {
+        std::swap_ranges(data.begin()+static_cast<std::ptrdiff_t>(a)*width,data.begin()+static_cast<std::ptrdiff_t>(a+1)*width,data.begin()+static_cast<std::ptrdiff_t>(b)*width);
+    }
 
-    //Add a link to a previous word
-    void WordNode::add_prev(const Word &w)
+    //Remove every counter
+    void CounterArray::clear()
     {
-        prev.add_word(w);
+        data.clear();
+        width=1;
     }
 
-    //Add a link to a next word
-    void WordNode::add_next(const Word &w)
+    //Use the narrowest counters that hold every value
+    void CounterArray::shrink()
     {
-        next.add_word(w);
+        int w=1;
+        for (int k=0;k<size()&&w<width;++k)
+            w=std::max(w,width_for(get(k)));
+
+        if (w<width)
+            rewiden(w);
     }
 
-    //Get a random word
+    /*Values*/
 
-    //Get a random previous word
-    Word WordNode::get_prev() const
+    //Gap between a value and the next one a 2 byte counter holds. Counting by this gap with a probability of 1/gap (Morris counting) keeps hot links on 2 bytes
+    int CounterArray::step(int v)
     {
-        return prev.get_rand();
+        if (v<=EXACT_16)
+            return 1;
+
+        //12 significant bits
+        int s=0;
+        while ((v>>s)>=4096)
+            ++s;
+
+        return 1<<s;
     }
 
-    //Get a random next word
-    Word WordNode::get_next() const
+    //Narrowest counter that holds a value
+    int CounterArray::width_for(int v)
     {
-        return next.get_rand();
-    }
+        if (v<=0xFF)
+            return 1;
 
-    /*Word*/
+        if (v<=EXACT_16)
+            return 2;
 
-    //Increase frecuency
-    void WordNode::inc_frec()
-    {
-        ++f;
-    }
+        //Past the exact range, 2 bytes hold 12 significant bits
+        int s=0;
+        while ((v>>s)>=4096)
+            ++s;
 
-    /*Read/write to file*/
+        if (s<=19&&!(v&((1<<s)-1)))
+            return 2;
 
-    //Write to file
-    void WordNode::write(std::ostream &o) const
-    {
-        //Write the word of the node
-        w.write(o);
+        return 4;
+    }
 
-        //Write the frecuency
-        o.write(reinterpret_cast<const char *>(&f),sizeof(int));
+    //Encode a value for a counter of width bytes. It must fit
+    std::uint32_t CounterArray::encode(int v,int w)
+    {
+        if (w!=2||v<=EXACT_16)
+            return static_cast<std::uint32_t>(v);
 
-        //Write the links to previous words
-        prev.write(o);
+        //Top bit set, 4 bits of exponent, 11 bits of mantissa (the leading 1 isn't stored)
+        int s=0;
+        while ((v>>s)>=4096)
+            ++s;
 
-        //Write the links to next words
-        next.write(o);
+        return 0x8000u|(static_cast<std::uint32_t>(s-4)<<11)|(static_cast<std::uint32_t>(v>>s)&0x7FFu);
     }
 
-    //Read from file
-    void WordNode::read(std::istream &i)
+    //Decode a counter of width bytes
+    int CounterArray::decode(std::uint32_t c,int w)
     {
-        //Read the word of the node
-        w.read(i);
+        if (w!=2||!(c&0x8000u))
+            return static_cast<int>(c);
 
-        //Read the frecuency
-        i.read(reinterpret_cast<char *>(&f),sizeof(int));
+        return static_cast<int>((0x800u|(c&0x7FFu))<<(((c>>11)&0xFu)+4));
+    }
 
-        //Read the links to previous words
-        prev.read(i);
+    //Re-encode every counter with a new width
+    void CounterArray::rewiden(int w)
+    {
+        CounterArray cpy(data.get_allocator().resource());
+        cpy.width=w;
+        cpy.data.resize(static_cast<std::size_t>(size())*w);
 
-        //Read the links to next words
-        next.read(i);
+        for (int k=0;k<size();++k)
+            cpy.set(k,get(k));
+
+        *this=std::move(cpy);
     }
 
     /*
-        WordGraph
+        FrecLink
     */
 
     /* Constructors, copy control */
 
     /*Constructors*/
 
-    //Default constructor
-    WordGraph::WordGraph()
-    :nodes(),n(0)
+    //Default constructors, allocating from the given memory
+    FrecLink::FrecLink(std::pmr::memory_resource *mr)
+    :words(mr),frecs(mr),dict(),f(0),sums()
     {}
 
-    /* Methods */
+    /*Copy control*/
 
-    /*Nodes*/
+    //Copy constructor
+    FrecLink::FrecLink(const FrecLink &fl)
+    :words(fl.words),frecs(fl.frecs),dict(fl.dict?new std::pmr::map< const Word*,int >(*fl.dict):nullptr),f(fl.f),sums()
+    {}
 
-    //Check if a word exists (as a node in the graph)
-    bool WordGraph::check_word(const Word &w)
+    //Copy constructor, allocating from the given memory
+    FrecLink::FrecLink(const FrecLink &fl,std::pmr::memory_resource *mr)
+    :words(fl.words,mr),frecs(fl.frecs,mr),dict(fl.dict?new std::pmr::map< const Word*,int >(*fl.dict,mr):nullptr),f(fl.f),sums()
+    {}
+
+    //Copy assignment
+    FrecLink& FrecLink::operator=(const FrecLink &fl)
     {
-        return nodes.find(w)!=nodes.end();
+        if (this!=&fl)
+        {
+            FrecLink cpy(fl);
+            *this=std::move(cpy);
+        }
+
+        return *this;
     }
 
-    //Add a word to the node, increase its frecuency if it exists
-    void WordGraph::add_word(const Word &w)
+    /* Methods */
+
+    /*Add/delete*/
+
+    //Add a word to the list, count times
+    void FrecLink::add_word(const Word *w,int count)
     {
-        auto it=nodes.find(w);
+        sums.reset();
+        Stats::add(Counter::LINKS_ADDED);
 
-        if (it==nodes.end())//Add if not found
+        //Check if the word is on the list
+        int k=find(w);
+        if (k<0)//Not found
         {
-            nodes.emplace(w,w);
-            ++n;
+            Stats::add(Counter::LINKS_INSERTED);
+
+            //Insert it at the end of the list with frec=0, it'll be raised to its place
+            words.push_back(w);
+            frecs.push_back(0);
+            k=get_size()-1;
+
+            if (dict)
+                place(k);
+            else
+                update_dict();
         }
-        else//If found, increase
-            it->second.inc_frec();
+
+        raise(k,count);
     }
 
-    //Get a node by pointer, nullptr if not found
-    WordNode* WordGraph::get_node(const Word &w)
+    //Remove a word from the list. Return false if it wasn't on it
+    bool FrecLink::remove_word(const Word *w)
     {
-        if(check_word(w))
+        int k=find(w);
+        if (k<0)
+            return false;
+
+        sums.reset();
+        f-=frecs.get(k);
+
+        if (dict)
+            dict->erase(w);
+
+        //Fill the gap with the last word of its run, then the gap left there with the last word of the next run, and so on. Only one word per distinct frecuency moves
+        int hole=k;
+        while (true)
         {
-            WordNode &node=nodes.at(w);
-            return &node;
+            int last=run_end(hole)-1;
+            if (last!=hole)
+            {
+                words[hole]=words[last];
+                frecs.set(hole,frecs.get(last));
+                place(hole);
+                hole=last;
+            }
+
+            if (hole==get_size()-1)
+                break;
+
+            //Move the gap to the end of the next run
+            int next_last=run_end(hole+1)-1;
+            words[hole]=words[next_last];
+            frecs.set(hole,frecs.get(next_last));
+            place(hole);
+            hole=next_last;
+
+            if (hole==get_size()-1)
+                break;
         }
-        return nullptr;
-    }
 
-    /*Links*/
+        words.pop_back();
+        frecs.pop_back();
 
-    //Add a link between two nodes
-    void WordGraph::add_link(const Word &prev, const Word &next)
-    {
-        //Assuming both nodes alredy exist
+        update_dict();
+
+        return true;
+    }
 
-        //Add link prev -> next
-        nodes.at(prev).add_next(next);
-        nodes.at(next).add_prev(prev);
+    //Remove the words seen fewer than min_count times, and those past the top_k most frecuent (0 for no limit). Store the removed words
+    void FrecLink::prune(int min_count,int top_k,std::vector<const Word*> &removed)
+    {
+        sums.reset();
+
+        //The list is sorted, so the words to remove are all at the end
+        while
+        (
+            !words.empty()
+            &&
+            (
+                least_frec()<min_count//Too rare
+                ||
+                (top_k>0&&get_size()>top_k)//Too many
+            )
+        )
+            pop_back(removed);
+
+        frecs.shrink();
+        update_dict();
     }
 
-    /*Read/write to file*/
+    //Check if prune would remove any word, without changing the list
+    bool FrecLink::would_prune(int min_count,int top_k) const
+    {
+        //The list is sorted, so only the last word has to be checked
+        return !words.empty()&&(least_frec()<min_count||(top_k>0&&get_size()>top_k));
+    }
 
-    //Write to file
-    void WordGraph::write(std::ostream &o) const
+    //Remove every word, storing them
+    void FrecLink::clear(std::vector<const Word*> &removed)
     {
-        //Write the number of words
-        o.write(reinterpret_cast<const char *>(&n),sizeof(int));
+        removed.insert(removed.end(),words.begin(),words.end());
 
-        //Write all the nodes
-        for(const std::pair< const Word, const WordNode > &n : nodes)
-            n.second.write(o);
+        words.clear();
+        frecs.clear();
+        dict.reset();
+        sums.reset();
+        f=0;
     }
 
-    //Read from file
-    void WordGraph::read(std::istream &i)
+    //Add count words of another list at the end, starting from its position from, with their frecuencies. The copy takes the total of the other list and has no dictionary: it's only meant to be written, like the copies snapshots take
+    void FrecLink::append(const FrecLink &fl,int from,int count)
     {
-        //Read the number of words
-        n=0;
-        i.read(reinterpret_cast<char *>(&n),sizeof(int));
+        words.insert(words.end(),fl.words.begin()+from,fl.words.begin()+from+count);
+        frecs.append(fl.frecs,from,count);
+        f=fl.f;
+        sums.reset();
+    }
 
-        //Read the words
-        int iters=n;
-        while(iters-->0)//Read all the words
-        {
-            //Node to read
-            WordNode wn(Word(""));
+    /*Decay*/
+
+    //Divide every frecuency by 2^shift, removing the words that reach zero. Store the removed words
+    void FrecLink::decay(unsigned int shift,std::vector<const Word*> &removed)
+    {
+        if (!shift)
+            return;
 
-            //Read the node
-            wn.read(i);
+        sums.reset();
 
-            //Insert the node on the map, indexed by its word
-            nodes.insert(std::pair< Word,WordNode >(wn.get_word(),wn));
+        //Dividing keeps the list sorted
+        f=0;
+        for (int k=0;k<frecs.size();++k)
+        {
+            int c=decayed(frecs.get(k),shift);
+            frecs.set(k,c);
+            f+=c;
         }
+
+        //The words that reached zero are all at the end
+        while (!words.empty()&&least_frec()==0)
+            pop_back(removed);
+
+        frecs.shrink();
+        update_dict();
     }
 
-    /*
-        ITextStream
-    */
+    //Position of a word on the list, -1 if it isn't on it
+    int FrecLink::find(const Word *w) const
+    {
+        if (dict)
+        {
+            auto it=dict->find(w);
+            return it==dict->end()?-1:it->second;
+        }
 
-    /* Constructors, copy control */
+        //Words are stored once, comparing the addresses is enough
+        for (int k=0;k<get_size();++k)
+            if (words[k]==w)
+                return k;
 
-    /*Constructors*/
+        return -1;
+    }
 
-    //Complete constructor
-    ITextStream::ITextStream(std::istream &nis)
-    :is(nis),status(StreamState::START),nw()
-    {}
+    //End of the run of words with the same frecuency as the one at k
+    int FrecLink::run_end(int k) const
+    {
+        int c=frecs.get(k);
 
-    /* Methods */
+        //The list is sorted, so search it
+        int lo=k+1,hi=get_size();
+        while (lo<hi)
+        {
+            int mid=(lo+hi)/2;
+            if (frecs.get(mid)>=c)
+                lo=mid+1;
+            else
+                hi=mid;
+        }
 
-    /*Stream*/
+        return lo;
+    }
 
-    //Loads the next words from the stream, returns if the stream is ready. Must be called after every read
-    bool ITextStream::has_words()
+    //Update the dictionary with the position of a word
+    void FrecLink::place(int k)
     {
-        switch(status)
-        {
-            //Load the start word, switch to text
-            case StreamState::START:
-            {
-                nw.push_back(Word(WordType::START));
-                status=StreamState::TEXT;
-                return true;
-            }
+        if (dict)
+            (*dict)[words[k]]=k;
+    }
 
-            //Load a text word, if it fails, switch to the end
-            case StreamState::TEXT:
+    //Increase the frecuency of a word, moving it up so that the list is still sorted
+    void FrecLink::raise(int k,int count)
+    {
+        int old=frecs.get(k);
+        int nf=old>0x7FFFFFFF-count?0x7FFFFFFF:old+count;//Saturate
+        f+=nf-old;
+
+        //First position with a lower frecuency than the new one. The list is sorted, so search it
+        int lo=0,hi=k;
+        while (lo<hi)
+        {
+            int mid=(lo+hi)/2;
+            if (frecs.get(mid)>=nf)
+                lo=mid+1;
+            else
+                hi=mid;
+        }
+
+        Stats::add(Counter::REORDER_DISTANCE,k-lo);
+
+        //Hop over the runs in between: swapping with the first word of each run keeps it sorted, and moves one word per distinct frecuency instead of every word
+        while (lo<k)
+        {
+            Stats::add(Counter::REORDER_SWAPS);
+
+            //First word of the run right above
+            int u=frecs.get(k-1);
+            int h=lo,e=k-1;
+            while (h<e)
             {
-                std::string s;//String to read
-                if (!nw.empty())//If the buffer isn't empty
-                    return true;//It has words
-                else if (is>>s)//Or it can be filled again
-                {
-                    read_word(s);//Fill it again
-                    return true;//It still has words
-                }
+                int mid=(h+e)/2;
+                if (frecs.get(mid)>u)
+                    h=mid+1;
                 else
-                {
-                    //If the word could not be read, let the flow reach to the next case. Do not break or return
-                    status=StreamState::END;
-                }
+                    e=mid;
             }
 
-            //End of text, stream is now empty
-            case StreamState::END:
-            {
-                nw.push_back(Word(WordType::END));
-                status=StreamState::EMPTY;
-                return true;
-            }
+            std::swap(words[h],words[k]);
+            frecs.swap(h,k);
+            place(k);
 
-            //When the stream is empty or on a invalid state, it has no word
-            case StreamState::EMPTY:
-            default:
-                return false;
+            k=h;
         }
+
+        frecs.set(k,nf);
+        place(k);
     }
 
-    //Return the last word read from the stream
-    Word ITextStream::read()
+    //Remove the last word, storing it
+    void FrecLink::pop_back(std::vector<const Word*> &removed)
     {
-        if (nw.empty())//If it's empty, error
-            return DEF_ERR_WORD;
-        else//Return the front, and pop it
+        f-=least_frec();
+
+        if (dict)
+            dict->erase(words.back());
+
+        removed.push_back(words.back());
+        words.pop_back();
+        frecs.pop_back();
+    }
+
+    //Create or drop the dictionary, depending on the length of the list
+    void FrecLink::update_dict()
+    {
+        if (!dict&&get_size()>DICT_MIN)
         {
-            auto rv=nw.front();
-            nw.pop_front();
-            return rv;
+            dict.reset(new std::pmr::map< const Word*,int >(words.get_allocator()));
+            for (int k=0;k<get_size();++k)
+                place(k);
         }
+        else if (dict&&get_size()<=DICT_MIN/2)//Half the limit, so a list around it doesn't keep creating and dropping it
+            dict.reset();
     }
 
-    /*Parsing*/
+    /*Links*/
 
-    //Fill the queue with words from a text separated by whitespce
-    bool ITextStream::read_word(std::string s)
+    //Get a random word based on frecuency, as if they had been divided by 2^shift
+    const Word& FrecLink::get_rand(unsigned int shift) const
     {
-        Word rv("");//Values returned from the functions
+        const Word *w=pick(shift);
 
-        std::list<Word> words;//All words extracted from the string
-        auto it=s.cbegin();//Iterator, start at begin
-        auto e=s.cend();//End
+        //Nothing to pick, pruning or decay may leave a node without links
+        if (!w)
+            return END_WORD;
 
-        //Try to read all L_STOP. May be none
-        while(read_L_STOP(it,e,rv))
-            words.push_back(rv);
+        return *w;
+    }
 
-        //Try to read all L_DELIM. May be none
-        while(read_L_DELIM(it,e,rv))
-            words.push_back(rv);
+    //Get a random word based on frecuency, as if they had been divided by 2^shift, as stored on its pool. nullptr if there's nothing to pick. Not thread safe: the first pick after a change computes the cumulative frecuencies
+    const Word* FrecLink::pick(unsigned int shift) const
+    {
+        return pick(shift,re);
+    }
 
-        //Try to read a content word. If this fails, the whole string is turned into a symbol
-        if (read_CONTENT(it,e,rv))//Text was found, check that it wasn't a symbol
+    //Get a random word based on frecuency, as if they had been divided by 2^shift, drawn with the given engine. nullptr if there's nothing to pick
+    const Word* FrecLink::pick(unsigned int shift,std::default_random_engine &eng) const
+    {
+        if (words.empty())
+            return nullptr;
+
+        const Sums &s=get_sums(shift);
+        int size=get_size();
+
+        //Nothing to pick, decay may leave every frecuency at zero
+        int total=s.cum[size-1];
+        if (total<=0)
+            return nullptr;
+
+        //Create the RNG to use it with the engine
+        std::uniform_int_distribution<> dt(0,total-1);
+
+        //Random number generated
+        int n=dt(eng);
+
+        //The word picked is the first whose cumulative frecuency is above the number
+        int k;
+        if (size<=SMALL_DEGREE)
+            k=count_not_above(s.cum.data(),s.cum.size(),n);
+        else
+            k=std::upper_bound(s.cum.begin(),s.cum.begin()+size,n)-s.cum.begin();
+
+        Stats::add(Counter::PICKS);
+        Stats::add(Counter::PICK_DEPTH,k+1);
+
+        return words[k];
+    }
+
+    /*Sampling*/
+
+    //Cumulative frecuencies, as if they had been divided by 2^shift, computing them if needed
+    const FrecLink::Sums& FrecLink::get_sums(unsigned int shift) const
+    {
+        if (sums&&sums->shift==shift)
+            return *sums;
+
+        if (!sums)
+            sums.reset(new Sums(words.get_allocator().resource()));
+
+        Stats::add(Counter::SUM_REBUILDS);
+
+        //Padded, so they can be compared 8 at a time
+        int size=get_size();
+        sums->cum.assign((size+7)/8*8,INT_MAX);
+        sums->shift=shift;
+
+        int total=0;
+        for (int k=0;k<size;++k)
         {
-            if (rv.get_type()!=WordType::SYMBOL)
-            {
-                //Correct word
-                words.push_back(rv);
-            }
-            else
+            total+=decayed(frecs.get(k),shift);
+            sums->cum[k]=total;
+        }
+
+        return *sums;
+    }
+
+    //Number of cumulative frecuencies not above x, from a list padded to a multiple of 8. Compares several at once where the CPU can
+    int FrecLink::count_not_above(const int *cum,int size,int x)
+    {
+        //They're sorted, so counting stops at the first block with one above x
+        int count=0;
+
+#if defined(__AVX2__)
+        const __m256i vx=_mm256_set1_epi32(x);
+        for (int k=0;k<size;k+=8)
+        {
+            __m256i above=_mm256_cmpgt_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cum+k)),vx);
+            int mask=_mm256_movemask_ps(_mm256_castsi256_ps(above));
+            count+=8-static_cast<int>(std::bitset<8>(mask).count());
+            if (mask)
+                break;
+        }
+#elif defined(__SSE2__)
+        const __m128i vx=_mm_set1_epi32(x);
+        for (int k=0;k<size;k+=4)
+        {
+            __m128i above=_mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cum+k)),vx);
+            int mask=_mm_movemask_ps(_mm_castsi128_ps(above));
+            count+=4-static_cast<int>(std::bitset<4>(mask).count());
+            if (mask)
+                break;
+        }
+#else
+        while (count<size&&cum[count]<=x)
+            ++count;
+#endif
+
+        return count;
+    }
+
+    //Frecuency of a word, 0 if it isn't on the list
+    int FrecLink::get_frec(const Word *w) const
+    {
+        int k=find(w);
+        return k<0?0:frecs.get(k);
+    }
+
+    /*Read/write to file*/
+
+    //Write word to stream, as if the frecuencies had been divided by 2^shift
+    void FrecLink::write(std::ostream &o,unsigned int shift) const
+    {
+        //Count the entries and the frecuencies left after decaying. The ones that reach zero aren't written
+        int dn=get_size(),df=f;
+        if (shift)
+        {
+            dn=0;
+            df=0;
+            for (int k=0;k<frecs.size();++k)
             {
-                //Symbol
-                nw.push_back(Word(s,WordType::SYMBOL));
-                return false;//Indicate that it's a symbol
+                int c=decayed(frecs.get(k),shift);
+                if (!c)//Sorted, the rest are zero too
+                    break;
+                ++dn;
+                df+=c;
             }
         }
-        //If no text was found, go on without problems
 
-        //Try to read all R_DELIM. May be none
-        while(read_R_DELIM(it,e,rv))
-            words.push_back(rv);
+        //Write the number of entries
+        o.write(reinterpret_cast<const char *>(&dn),sizeof(int));
+        //Write the sum of the frecuencies
+        o.write(reinterpret_cast<const char *>(&df),sizeof(int));
 
-        //Try to read all R_STOP. May be none
-        while(read_R_STOP(it,e,rv))
-            words.push_back(rv);
+        //Write the list
+        for(int k=0;k<dn;++k)
+        {
+            //Write the frec
+            int c=decayed(frecs.get(k),shift);
+            o.write(reinterpret_cast<const char *>(&c),sizeof(int));
 
-        //All string must be consumed by now. Otherwise, the whole string's a symbol
-        if (it==e)
+            //Write the word
+            words[k]->write(o);
+        }
+    }
+
+    //Read word to stream, storing the words on a pool
+    void FrecLink::read(std::istream &i,WordPool &pool)
+    {
+        //Read number of entries
+        int n=0;//Set to zero in case of fail reading
+        i.read(reinterpret_cast<char *>(&n),sizeof(int));
+        //Read the sum of the frecuencies
+        i.read(reinterpret_cast<char *>(&f),sizeof(int));
+
+        sums.reset();
+
+        //This list should always be empty, just to make sure, add at the end
+        words.reserve(words.size()+std::max(n,0));
+
+        //Read the list, alredy sorted
+        while(n-->0&&i)//Read all the entries
         {
-            //String consumed
+            //Read the frec
+            int word_frec=0;
+            i.read(reinterpret_cast<char *>(&word_frec),sizeof(int));
 
-            //Move all words from this list to the end of the stream's list
-            nw.splice(nw.end(),words);
-            return true;//Reading succesful
+            //Read the word
+            Word w("");
+            w.read(i);
+
+            //Insert the word on the list
+            words.push_back(pool.intern(w));
+            frecs.push_back(word_frec);
+        }
+
+        //Insert the words on the map
+        if (dict)
+            for (int k=0;k<get_size();++k)
+                place(k);
+        else
+            update_dict();
+    }
+
+    /*
+        WordNode
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, the links allocate from the given memory
+    WordNode::WordNode(const Word *nw,std::pmr::memory_resource *mr)
+    :prev(mr),next(mr),w(nw),f(1),born(0),saved(0),stamp(0)
+    {}
+
+    //Copy constructor, the links allocate from the given memory. The next words are allocated first, they're the ones walked
+    WordNode::WordNode(const WordNode &wn,std::pmr::memory_resource *mr)
+    :prev(mr),next(wn.next,mr),w(wn.w),f(wn.f),born(wn.born),saved(wn.saved),stamp(wn.stamp)
+    {
+        prev=FrecLink(wn.prev,mr);//Same memory, the arrays are taken as they are
+    }
+
+    /* Methods */
+
+    /*Links*/
+
+    //Add a link
+
+    //Add a link to a previous word, count times
+    void WordNode::add_prev(const Word *w,int count)
+    {
+        prev.add_word(w,count);
+    }
+
+    //Add a link to a next word, count times
+    void WordNode::add_next(const Word *w,int count)
+    {
+        next.add_word(w,count);
+    }
+
+    //Get a random word
+
+    //Get a random previous word, as if the frecuencies had been divided by 2^shift
+    const Word& WordNode::get_prev(unsigned int shift) const
+    {
+        return prev.get_rand(shift);
+    }
+
+    //Get a random next word, as if the frecuencies had been divided by 2^shift
+    const Word& WordNode::get_next(unsigned int shift) const
+    {
+        return next.get_rand(shift);
+    }
+
+    //Get the node of a random next word, as if the frecuencies had been divided by 2^shift. Follows the link, no lookup needed. nullptr if there's nothing to pick or the word has no node
+    WordNode* WordNode::get_next_node(unsigned int shift) const
+    {
+        const Word *nw=next.pick(shift);
+        return nw?WordPool::get_node(nw):nullptr;
+    }
+
+    //Get the node of a random next word, as if the frecuencies had been divided by 2^shift, drawn with the given engine
+    WordNode* WordNode::get_next_node(unsigned int shift,std::default_random_engine &eng) const
+    {
+        const Word *nw=next.pick(shift,eng);
+        return nw?WordPool::get_node(nw):nullptr;
+    }
+
+    //Remove a link
+
+    //Remove the link to a previous word
+    void WordNode::remove_prev(const Word *w)
+    {
+        prev.remove_word(w);
+    }
+
+    //Remove the link to a next word
+    void WordNode::remove_next(const Word *w)
+    {
+        next.remove_word(w);
+    }
+
+    //Drop the links to next words seen fewer than min_count times, or past the top_k most frecuent (0 for no limit). Store the words dropped
+    void WordNode::prune_next(int min_count,int top_k,std::vector<const Word*> &dropped)
+    {
+        next.prune(min_count,top_k,dropped);
+    }
+
+    //Check if prune_next would drop any link, without changing the node
+    bool WordNode::would_prune_next(int min_count,int top_k) const
+    {
+        return next.would_prune(min_count,top_k);
+    }
+
+    //Drop every link, storing the previous and next words that were linked
+    void WordNode::clear_links(std::vector<const Word*> &prev_words,std::vector<const Word*> &next_words)
+    {
+        prev.clear(prev_words);
+        next.clear(next_words);
+    }
+
+    //Copy up to count links of another node, continuing after the first done ones, previous words first. Return the number copied. Large nodes can be copied a piece at a time, as long as they don't change in between
+    int WordNode::copy_links(const WordNode &wn,int done,int count)
+    {
+        int copied=0;
+
+        int np=wn.prev.get_size();
+        if (done<np)
+        {
+            int c=std::min(count,np-done);
+            prev.append(wn.prev,done,c);
+            copied+=c;
+        }
+
+        int nn=wn.next.get_size(),from=std::max(done+copied-np,0);
+        if (copied<count&&from<nn)
+        {
+            int c=std::min(count-copied,nn-from);
+            next.append(wn.next,from,c);
+            copied+=c;
+        }
+
+        return copied;
+    }
+
+    /*Word*/
+
+    //Increase frecuency
+    void WordNode::inc_frec(int count)
+    {
+        f+=count;
+    }
+
+    //Divide the frecuency of the word and its links by 2^shift. Store the previous and next words whose links reached zero
+    void WordNode::decay(unsigned int shift,std::vector<const Word*> &prev_words,std::vector<const Word*> &next_words)
+    {
+        f=FrecLink::decayed(f,shift);
+
+        prev.decay(shift,prev_words);
+        next.decay(shift,next_words);
+    }
+
+    /*Read/write to file*/
+
+    //Write to file, as if the frecuencies had been divided by 2^shift
+    void WordNode::write(std::ostream &o,unsigned int shift) const
+    {
+        //Write the word of the node
+        w->write(o);
+
+        //Write the frecuency
+        int df=FrecLink::decayed(f,shift);
+        o.write(reinterpret_cast<const char *>(&df),sizeof(int));
+
+        //Write the links to previous words
+        prev.write(o,shift);
+
+        //Write the links to next words
+        next.write(o,shift);
+    }
+
+    //Read from file, storing the words on a pool
+    void WordNode::read(std::istream &i,WordPool &pool)
+    {
+        //Read the word of the node
+        Word rw("");
+        rw.read(i);
+        w=pool.intern(rw);
+
+        //Read the frecuency
+        i.read(reinterpret_cast<char *>(&f),sizeof(int));
+
+        //Read the links to previous words
+        prev.read(i,pool);
+
+        //Read the links to next words
+        next.read(i,pool);
+    }
+
+    /*
+        PrunePolicy
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor, prunes nothing
+    PrunePolicy::PrunePolicy()
+    :min_link(0),min_node(0),top_k(0),max_nodes(0),interval(0)
+    {}
+
+    /*
+        CountMinSketch
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor, counts nothing
+    CountMinSketch::CountMinSketch()
+    :counts(),width(0),depth(0)
+    {}
+
+    //Complete constructor. The width is rounded up to a power of 2
+    CountMinSketch::CountMinSketch(int nwidth,int ndepth)
+    :counts(),width(1),depth(ndepth)
+    {
+        while (width<nwidth)
+            width<<=1;
+
+        counts.assign(static_cast<std::size_t>(width)*depth,0);
+    }
+
+    /* Methods */
+
+    /*Counting*/
+
+    //Count a key, count times. Return its estimated frecuency afterwards
+    int CountMinSketch::add(std::uint64_t key,int count)
+    {
+        //Conservative update: raise only the counters below the new estimate, which keeps the overestimation down
+        std::uint64_t est=static_cast<std::uint64_t>(estimate(key))+count;
+        if (est>0x7FFFFFFF)//Saturate
+            est=0x7FFFFFFF;
+
+        for (int r=0;r<depth;++r)
+        {
+            std::uint32_t &c=counts[slot(key,r)];
+            if (c<est)
+                c=static_cast<std::uint32_t>(est);
+        }
+
+        return static_cast<int>(est);
+    }
+
+    //Estimated frecuency of a key
+    int CountMinSketch::estimate(std::uint64_t key) const
+    {
+        if (counts.empty())
+            return 0;
+
+        //Every counter is an overestimation, the smallest one is the closest
+        std::uint32_t est=0xFFFFFFFF;
+        for (int r=0;r<depth;++r)
+            est=std::min(est,counts[slot(key,r)]);
+
+        return static_cast<int>(est);
+    }
+
+    //Divide every counter by 2^shift
+    void CountMinSketch::decay(unsigned int shift)
+    {
+        for (std::uint32_t &c : counts)
+            c=shift<32?(c>>shift):0;
+    }
+
+    //Position of the counter of a key on a row
+    std::size_t CountMinSketch::slot(std::uint64_t key,int row) const
+    {
+        //Double hashing: both halves of the key give every row its own hash
+        std::uint32_t h1=static_cast<std::uint32_t>(key),h2=static_cast<std::uint32_t>(key>>32)|1;
+
+        return static_cast<std::size_t>(row)*width+((h1+static_cast<std::uint32_t>(row)*h2)&(width-1));
+    }
+
+    /*
+        WorkerPool
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, run jobs on the given number of threads (0 for one per core), counting the one running them
+    WorkerPool::WorkerPool(unsigned int nthreads)
+    :threads(),lock(),wake(),done(),stop(false),job(nullptr),count(0),next(0),round(0),running(0)
+    {
+        if (!nthreads)
+            nthreads=default_threads();
+
+        for (unsigned int t=1;t<nthreads;++t)
+            threads.emplace_back(&WorkerPool::work,this);
+    }
+
+    /*Copy control*/
+
+    //Stop the workers and wait for them
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop=true;
+        }
+        wake.notify_all();
+
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    /* Methods */
+
+    /*Jobs*/
+
+    //Call fn(k) for every k in [0,count), spread over the threads, and wait for it. One job at a time
+    void WorkerPool::run(int ncount,const std::function<void(int)> &fn)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job=&fn;
+            count=ncount;
+            next.store(0,std::memory_order_relaxed);
+            running=static_cast<unsigned int>(threads.size());
+            ++round;
+        }
+        wake.notify_all();
+
+        //This thread works too
+        take_parts();
+
+        //The job can't go away while a worker may still call it
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard,[this]{return !running;});
+        job=nullptr;
+    }
+
+    //Loop of a worker, joining each job as it starts
+    void WorkerPool::work()
+    {
+        std::uint64_t seen=0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard,[&]{return stop||round!=seen;});
+                if (stop)
+                    return;
+                seen=round;
+            }
+
+            take_parts();
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!--running)
+                done.notify_one();
+        }
+    }
+
+    //Do parts of the running job until there are none left
+    void WorkerPool::take_parts()
+    {
+        for (int k=next++;k<count;k=next++)
+            (*job)(k);
+    }
+
+    /*
+        WordGraph
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor
+    WordGraph::WordGraph()
+    :arena(),shared_arena(&arena),pool(&shared_arena),shared_pool(&pool),read_pools(),words(),nodes(&pool),n(0),drops(0),age(0),reclaim_started(false),reclaim_cursor(WordType::START),stream_k(0),sketch(),approx(false),batch_threads(1),batch_pool(),epoch(0),snap_active(false),snap_started(false),snap_cursor(WordType::START),snap_saved(),snap_part(),snap_part_links(0),snap_size(0),snap_age(0),snap_released(),snap_off(0),snap_index()
+    {}
+
+    /* Methods */
+
+    /*Nodes*/
+
+    //Check if a word exists (as a node in the graph)
+    bool WordGraph::check_word(const Word &w)
+    {
+        Stats::add(Counter::LOOKUPS);
+        Stats::Timer timer(Counter::LOOKUP_NS);
+
+        return nodes.find(&w)!=nodes.end();
+    }
+
+    //Add a word to the node, increase its frecuency if it exists. Count times at once
+    void WordGraph::add_word(const Word &w,int count)
+    {
+        add_node(w,count);
+    }
+
+    //Get a node by pointer, nullptr if not found
+    WordNode* WordGraph::get_node(const Word &w)
+    {
+        Stats::add(Counter::LOOKUPS);
+        Stats::Timer timer(Counter::LOOKUP_NS);
+
+        auto it=nodes.find(&w);
+        if(it!=nodes.end())
+            return &it->second;
+        return nullptr;
+    }
+
+    //Add a word to the node, increase its frecuency if it exists. Count times at once. Return its node
+    WordGraph::NodeMap::iterator WordGraph::add_node(const Word &w,int count)
+    {
+        NodeMap::iterator it;
+        {
+            Stats::add(Counter::LOOKUPS);
+            Stats::Timer timer(Counter::LOOKUP_NS);
+
+            it=nodes.find(&w);
+        }
+
+        if (it==nodes.end())//Add if not found
+        {
+            Stats::add(Counter::NODES_ADDED);
+
+            const Word *key=words.intern(w);//Text stored once, shared by the node and every link to it
+            it=nodes.emplace(std::piecewise_construct,std::forward_as_tuple(key),std::forward_as_tuple(key,&shared_pool)).first;
+            WordPool::set_node(key,&it->second);//Links to it reach it directly
+            it->second.born=epoch;//Any snapshot running right now must skip it
+            it->second.stamp=age;
+            it->second.inc_frec(count-1);//Starts at 1
+            ++n;
+        }
+        else//If found, increase
+        {
+            refresh(it);
+            preserve(it);
+            it->second.inc_frec(count);
+        }
+
+        return it;
+    }
+
+    //Drop every node, returning all their memory at once. Return false if a snapshot is running
+    bool WordGraph::clear()
+    {
+        if (snap_active)//The snapshot still has to walk the nodes
+            return false;
+
+        //The nodes live on the pools, they must be gone before releasing them. The map was built on the pool too, swap it out with an empty one
+        NodeMap(&pool).swap(nodes);
+        n=0;
+        ++drops;
+
+        read_pools.clear();
+        pool.release();
+        arena.release();
+        words.clear();
+
+        reclaim_started=false;
+        snap_started=false;
+
+        return true;
+    }
+
+    /*Layout*/
+
+    //Place the nodes in memory in the order a walk from START is most likely to reach them, so the most used part of the graph is contiguous. The nodes go in that order on the pool's chunks and their links in the same order on the arena, so a node isn't next to its own links. Meant for models that are done learning: the memory freed by their links isn't reused until clear. Return false if a snapshot is running
+    bool WordGraph::relayout()
+    {
+        if (snap_active)//The snapshot still has to walk the nodes
+            return false;
+
+        //Take the nodes out of the graph's memory, in their new order
+        std::vector<WordNode> ordered;
+        ordered.reserve(n);
+        for (const WordNode *wn : layout_order())
+            ordered.emplace_back(*wn,std::pmr::get_default_resource());
+
+        //Return all the memory, the words stay where they are
+        NodeMap(&pool).swap(nodes);
+        ++drops;
+        read_pools.clear();
+        pool.release();
+        arena.release();
+
+        //Put them back in order. The map nodes come from the pool, and the links from the arena in the same order, apart from the chunks the pool refills with, instead of being spread by size on the pool
+        for (const WordNode &wn : ordered)
+        {
+            const Word *key=wn.w;
+            auto it=nodes.emplace(std::piecewise_construct,std::forward_as_tuple(key),std::forward_as_tuple(wn,&shared_arena)).first;
+            WordPool::set_node(key,&it->second);
+        }
+
+        return true;
+    }
+
+    //Nodes in the order relayout places them: the most likely to be reached from START first, then the rest by frecuency
+    std::vector<const WordNode*> WordGraph::layout_order() const
+    {
+        std::vector<const WordNode*> order;
+        order.reserve(n);
+
+        std::unordered_set<const WordNode*> placed;
+
+        //Best first from START: each node's chance of being reached is shared among its next words by frecuency
+        std::priority_queue< std::pair< double,const WordNode* > > reach;
+
+        const Word start(WordType::START);
+        auto it=nodes.find(&start);
+        if (it!=nodes.end())
+            reach.emplace(1.0,&it->second);
+
+        while (!reach.empty())
+        {
+            double p=reach.top().first;
+            const WordNode *wn=reach.top().second;
+            reach.pop();
+
+            if (!placed.insert(wn).second)//Alredy reached by a likelier path
+                continue;
+            order.push_back(wn);
+
+            const FrecLink &links=wn->get_next_links();
+            double total=0;
+            for (int k=0;k<links.get_size();++k)
+                total+=links.frec_at(k);
+
+            for (int k=0;k<links.get_size();++k)
+            {
+                const WordNode *nx=WordPool::get_node(links.word_at(k));
+                if (nx&&!placed.count(nx))
+                    reach.emplace(p*links.frec_at(k)/total,nx);
+            }
+        }
+
+        //The ones that can't be reached, the most frecuent first
+        std::size_t reached=order.size();
+        for (const auto &kv : nodes)
+            if (!placed.count(&kv.second))
+                order.push_back(&kv.second);
+
+        std::stable_sort(order.begin()+reached,order.end(),[](const WordNode *a,const WordNode *b)
+        {
+            return a->f>b->f;
+        });
+
+        return order;
+    }
+
+    /*Links*/
+
+    //Add a link between two nodes. Count times at once
+    void WordGraph::add_link(const Word &prev, const Word &next,int count)
+    {
+        //Assuming both nodes alredy exist
+        NodeMap::iterator p,nx;
+        {
+            Stats::add(Counter::LOOKUPS,2);
+            Stats::Timer timer(Counter::LOOKUP_NS);
+
+            p=nodes.find(&prev);
+            nx=nodes.find(&next);
+        }
+
+        link(p,nx,count);
+    }
+
+    //Add a link between two nodes, by their position. Count times at once
+    void WordGraph::link(NodeMap::iterator p,NodeMap::iterator nx,int count)
+    {
+        //Apply any pending decay first
+        refresh(p);
+        refresh(nx);
+
+        //Keep the old versions if a snapshot needs them
+        preserve(p);
+        preserve(nx);
+
+        //Streaming: every link is counted on the sketch, but only the most frecuent next words of each node are kept
+        if (stream_k>0)
+        {
+            int est=sketch.add(link_key(*p->first,*nx->first),count);
+
+            const FrecLink &links=p->second.get_next_links();
+            if (!links.has_word(nx->first)&&links.get_size()>=stream_k)//No room for it
+            {
+                //Take the place of the least frecuent next word, only if the new one's estimated to be more frecuent (Space-Saving)
+                if (est<=links.least_frec())
+                    return;
+
+                const Word *victim=links.least_word();
+                p->second.remove_next(victim);
+
+                auto v=nodes.find(victim);
+                if (v!=nodes.end())
+                {
+                    preserve(v);
+                    v->second.remove_prev(p->first);
+                }
+
+                //Start it at its estimated frecuency
+                p->second.add_next(nx->first,est);
+                nx->second.add_prev(p->first,est);
+                return;
+            }
+        }
+
+        //Approximate counting: past the exact range, count by the gap to the next value a 2 byte counter holds, with a probability of 1/gap. Whole gaps are counted as they are, only the rest is left to chance. Both directions get the same count
+        if (approx)
+        {
+            int f=p->second.get_next_links().get_frec(nx->first),added=0;
+
+            while (count>0)
+            {
+                int gap=CounterArray::step(f+added);
+                if (count>=gap)
+                {
+                    added+=gap;
+                    count-=gap;
+                }
+                else
+                {
+                    if (std::uniform_int_distribution<int>(0,gap-1)(re)<count)
+                        added+=gap;
+                    count=0;
+                }
+            }
+
+            if (!added)
+                return;
+
+            count=added;
+        }
+
+        //Add link prev -> next, pointing to the words stored by the nodes
+        p->second.add_next(nx->first,count);
+        nx->second.add_prev(p->first,count);
+    }
+
+    /*Batch*/
+
+    //Add every word and link counted by a batch. Each distinct one is added once, with all its occurrences
+    void WordGraph::add_batch(const BigramBatch &b)
+    {
+        const std::vector<Word> &vocab=b.get_words();
+        const std::vector<int> &frecs=b.get_frecs();
+
+        //Find every node once. Positions on the map stay valid while others are added
+        std::vector<NodeMap::iterator> its;
+        its.reserve(vocab.size());
+        for (std::size_t k=0;k<vocab.size();++k)
+            its.push_back(add_node(vocab[k],frecs[k]));
+
+        const std::vector< std::pair< std::uint64_t,int > > &links=b.get_links();
+
+        //Streaming, approximate counting and snapshots touch more than the two nodes of a link, add them one by one
+        if (batch_threads<2||links.size()<PARALLEL_LINKS||stream_k>0||approx||snap_active)
+        {
+            //Sorted by previous word, so each node gets all its next words in a row
+            for (const auto &l : links)
+                link(its[l.first>>32],its[l.first&0xFFFFFFFF],l.second);
+            return;
+        }
+
+        //Every node was brought up to date by add_node, so adding links only touches their two nodes
+        const unsigned int shards=batch_threads;
+        std::vector<unsigned int> owner;
+        owner.reserve(its.size());
+        for (NodeMap::iterator it : its)
+            owner.push_back(shard(it->first,shards));
+
+        //Deal both directions of every link to the shard of the node they're added to, in the order of the batch. The lowest bit tells a next link from a previous one
+        std::vector<std::size_t> begin(shards+1,0);
+        for (const auto &l : links)
+        {
+            ++begin[owner[l.first>>32]+1];
+            ++begin[owner[l.first&0xFFFFFFFF]+1];
+        }
+        for (unsigned int s=0;s<shards;++s)
+            begin[s+1]+=begin[s];
+
+        std::vector<std::uint32_t> dealt(begin[shards]);
+        std::vector<std::size_t> end(begin.begin(),begin.end()-1);
+        for (std::uint32_t k=0;k<links.size();++k)
+        {
+            dealt[end[owner[links[k].first>>32]]++]=k<<1|1;
+            dealt[end[owner[links[k].first&0xFFFFFFFF]]++]=k<<1;
+        }
+
+        //Each thread adds the links dealt to its shard, so every node ends up as if they were added one by one
+        if (!batch_pool||batch_pool->get_threads()!=shards)
+            batch_pool.reset(new WorkerPool(shards));
+
+        batch_pool->run(shards,[&](int s)
+        {
+            for (std::size_t d=begin[s];d<begin[s+1];++d)
+            {
+                const auto &l=links[dealt[d]>>1];
+                std::uint32_t p=l.first>>32,nx=l.first&0xFFFFFFFF;
+
+                if (dealt[d]&1)
+                    its[p]->second.add_next(its[nx]->first,l.second);
+                else
+                    its[nx]->second.add_prev(its[p]->first,l.second);
+            }
+        });
+    }
+
+    /*Batch threads*/
+
+    //Add the links of large batches on the given number of threads (0 for one per core). The threads are started by the first batch large enough
+    void WordGraph::set_batch_threads(unsigned int t)
+    {
+        batch_threads=t?t:default_threads();
+
+        if (batch_pool&&batch_pool->get_threads()!=batch_threads)
+            batch_pool.reset();
+    }
+
+    /*Streaming*/
+
+    //Keep at most max_next next words on each node (0 to keep them all), the most frecuent ones. Links that don't fit are counted by a sketch of depth rows of width counters, and replace the least frecuent link once they're estimated to be more frecuent
+    void WordGraph::set_streaming(int max_next,int width,int depth)
+    {
+        stream_k=max_next;
+
+        if (max_next>0)
+        {
+            //Links learned before this aren't on the sketch
+            sketch=CountMinSketch(width,depth);
+
+            //The links alredy learned must fit too
+            PrunePolicy p;
+            p.top_k=max_next;
+            prune(p);
+        }
+        else
+            sketch=CountMinSketch();
+    }
+
+    //Key of a link on the sketch
+    std::uint64_t WordGraph::link_key(const Word &prev,const Word &next)
+    {
+        std::uint64_t h=static_cast<std::uint64_t>(prev.hash())*0x9E3779B97F4A7C15ULL^next.hash();
+
+        //Mix the bits, the sketch uses both halves
+        h^=h>>31;
+        h*=0xBF58476D1CE4E5B9ULL;
+        h^=h>>29;
+
+        return h;
+    }
+
+    /*Pruning*/
+
+    //Drop the words and links below the policy's thresholds, keeping both directions of every link consistent. START and END are never dropped. Return the number of nodes dropped
+    int WordGraph::prune(const PrunePolicy &p)
+    {
+        const Word start_word(WordType::START),end_word(WordType::END);
+
+        //Thresholds apply to the current frecuencies
+        for (auto it=nodes.begin();it!=nodes.end();++it)
+            refresh(it);
+
+        //Find the words to drop
+        std::vector<NodeMap::iterator> doomed,kept;
+        for (auto it=nodes.begin();it!=nodes.end();++it)
+        {
+            if (*it->first==start_word||*it->first==end_word)//Always kept, and they don't count for the cap
+                continue;
+
+            if (it->second.f<p.min_node)//Too rare
+                doomed.push_back(it);
+            else
+                kept.push_back(it);
+        }
+
+        //Cap the vocabulary, dropping the least frecuent words
+        int room=p.max_nodes-(n-static_cast<int>(doomed.size()+kept.size()));//Room left by START and END
+        if (p.max_nodes>0&&static_cast<int>(kept.size())>room)
+        {
+            int excess=kept.size()-std::max(room,0);
+
+            //Move the least frecuent words to the front
+            std::nth_element(kept.begin(),kept.begin()+excess,kept.end(),[](const NodeMap::iterator &a,const NodeMap::iterator &b)
+            {
+                return a->second.f<b->second.f;
+            });
+
+            doomed.insert(doomed.end(),kept.begin(),kept.begin()+excess);
+        }
+
+        //Drop the words, removing their links from the other side first
+        std::vector<const Word*> prev_words,next_words;
+        for (auto it : doomed)
+        {
+            preserve(it);
+
+            prev_words.clear();
+            next_words.clear();
+            it->second.clear_links(prev_words,next_words);
+
+            for (const Word *w : prev_words)//Nodes linking to this one
+            {
+                auto other=nodes.find(w);
+                if (other!=nodes.end()&&other!=it)
+                {
+                    preserve(other);
+                    other->second.remove_next(it->first);
+                }
+            }
+
+            for (const Word *w : next_words)//Nodes this one links to
+            {
+                auto other=nodes.find(w);
+                if (other!=nodes.end()&&other!=it)
+                {
+                    preserve(other);
+                    other->second.remove_prev(it->first);
+                }
+            }
+
+            const Word *key=it->first;
+            nodes.erase(it);
+            ++drops;
+            release_word(key);
+            --n;
+        }
+
+        //Drop the rare links of the words that are left
+        if (p.min_link>1||p.top_k>0)
+        {
+            std::vector<const Word*> dropped;
+            for (auto it=nodes.begin();it!=nodes.end();++it)
+            {
+                //Only nodes that change are copied for a running snapshot
+                if (!it->second.would_prune_next(p.min_link,p.top_k))
+                    continue;
+
+                dropped.clear();
+
+                preserve(it);
+                it->second.prune_next(p.min_link,p.top_k,dropped);
+
+                //Remove the other direction
+                for (const Word *w : dropped)
+                {
+                    auto other=nodes.find(w);
+                    if (other!=nodes.end())
+                    {
+                        preserve(other);
+                        other->second.remove_prev(it->first);
+                    }
+                }
+            }
+        }
+
+        return doomed.size();
+    }
+
+    /*Decay*/
+
+    //Advance the decay epoch, halving every frecuency. Nothing is touched now: each node catches up the next time it's modified
+    void WordGraph::advance_age()
+    {
+        ++age;
+
+        //The sketch is small and fixed, halve it right away
+        if (!sketch.empty())
+            sketch.decay(1);
+    }
+
+    //Bring up to date up to max_nodes nodes, continuing from the last call, and drop the ones that decayed to nothing. Return the number dropped
+    int WordGraph::reclaim(int max_nodes)
+    {
+        const Word start_word(WordType::START),end_word(WordType::END);
+
+        int dropped=0;
+
+        //Continue right after the last node checked
+        auto it=reclaim_started?nodes.upper_bound(&reclaim_cursor):nodes.begin();
+
+        for (int k=0;k<max_nodes&&!nodes.empty();++k)
+        {
+            if (it==nodes.end())//Start over
+                it=nodes.begin();
+
+            refresh(it);
+
+            reclaim_cursor=*it->first;
+            reclaim_started=true;
+
+            //Nothing left of this word. Its links are gone, so nothing points to it
+            if (it->second.f<=0&&it->second.empty()&&*it->first!=start_word&&*it->first!=end_word)
+            {
+                preserve(it);
+                const Word *key=it->first;
+                it=nodes.erase(it);
+                ++drops;
+                release_word(key);
+                --n;
+                ++dropped;
+            }
+            else
+                ++it;
+        }
+
+        return dropped;
+    }
+
+    //Bring the frecuencies of a node up to date with the decay epoch, removing the other direction of every link that reaches zero
+    void WordGraph::refresh(NodeMap::iterator it)
+    {
+        WordNode &node=it->second;
+
+        unsigned int shift=get_shift(node);
+        if (!shift)//Up to date
+            return;
+
+        preserve(it);
+
+        std::vector<const Word*> prev_words,next_words;
+        node.decay(shift,prev_words,next_words);
+        node.stamp=age;
+
+        //The other side of the links that reached zero. They'd reach zero there too, remove them now so nothing points to a word that may be reclaimed
+        for (const Word *w : prev_words)
+        {
+            auto other=nodes.find(w);
+            if (other!=nodes.end()&&other!=it)
+            {
+                preserve(other);
+                other->second.remove_next(it->first);
+            }
+        }
+
+        for (const Word *w : next_words)
+        {
+            auto other=nodes.find(w);
+            if (other!=nodes.end()&&other!=it)
+            {
+                preserve(other);
+                other->second.remove_prev(it->first);
+            }
+        }
+    }
+
+    /*Snapshot*/
+
+    //Start a point-in-time snapshot. Does not depend on the size of the graph. Return false if a snapshot is alredy running
+    bool WordGraph::begin_snapshot()
+    {
+        if (snap_active)//Only one snapshot at a time
+            return false;
+
+        //New epoch: every node that exists now has an older one, nodes created from now on will be skipped
+        ++epoch;
+        snap_active=true;
+        snap_started=false;
+        snap_part.reset();
+        snap_size=n;
+        snap_age=age;
+
+        return true;
+    }
+
+    //Take copies of the next nodes of the running snapshot, as they were when it started, until about max_links links have been copied. Larger nodes are copied over several calls, and only added once complete. Return false once every node has been taken
+    bool WordGraph::take_snapshot(std::vector<WordNode> &batch,int max_links)
+    {
+        if (!snap_active)
+            return false;
+
+        //Continue right after the last node taken
+        auto it=snap_started?nodes.upper_bound(&snap_cursor):nodes.begin();
+
+        /*
+            Walk the live nodes and the preserved ones together, in order.
+            Every preserved node is ahead of the cursor, and it may have been removed from the graph since it was preserved.
+            Every node counts as a link, so the nodes without links are bounded too.
+        */
+        for (int left=max_links;left>0;)
+        {
+            auto saved=snap_saved.begin();
+
+            //Take the preserved node if it comes first, or if it's the same one
+            bool use_saved=saved!=snap_saved.end()&&(it==nodes.end()||!(*it->first<saved->first));
+
+            if (!use_saved&&it==nodes.end())//Nothing left
+                break;
+
+            Word w=use_saved?saved->first:*it->first;//Node to be taken
+
+            //Take the version the node had at the start of the snapshot
+            if (use_saved)//Modified since then, the copy was made then
+            {
+                left-=1+saved->second.get_links();
+                batch.push_back(std::move(saved->second));
+                snap_saved.erase(saved);
+            }
+            else if (it->second.born<epoch)//Untouched, copy it as it is now. Nodes created after the snapshot started aren't part of it
+            {
+                const WordNode &node=it->second;
+                if (!snap_part)
+                {
+                    snap_part.reset(new WordNode(node.w));
+                    snap_part->f=node.f;
+                    snap_part->stamp=node.stamp;
+                    snap_part_links=0;
+                }
+
+                int c=snap_part->copy_links(node,snap_part_links,left);
+                snap_part_links+=c;
+                left-=1+c;
+
+                //Too large for what's left of this call, the rest is copied by the next one. A change before that preserves the node, and the piece is dropped
+                if (snap_part_links<node.get_links())
+                    return true;
+
+                batch.push_back(std::move(*snap_part));
+                snap_part.reset();
+            }
+
+            //Move past it
+            if (it!=nodes.end()&&*it->first==w)
+                ++it;
+
+            //Move the cursor, this node won't need to be preserved anymore
+            snap_cursor=w;
+            snap_started=true;
+        }
+
+        return it!=nodes.end()||!snap_saved.empty();
+    }
+
+    //Close the running snapshot, once every node has been taken
+    void WordGraph::end_snapshot()
+    {
+        snap_active=false;
+        snap_saved.clear();
+        snap_part.reset();
+
+        //Nothing points to the words dropped meanwhile anymore, unless they were added again
+        std::sort(snap_released.begin(),snap_released.end());
+        snap_released.erase(std::unique(snap_released.begin(),snap_released.end()),snap_released.end());
+        for (const Word *w : snap_released)
+        {
+            if (!WordPool::get_node(w))
+                words.release(w);
+        }
+        snap_released.clear();
+    }
+
+    //Preserve the current version of a node that's about to be modified, if the running snapshot still needs it
+    void WordGraph::preserve(NodeMap::iterator it)
+    {
+        WordNode &node=it->second;
+
+        if
+        (
+            snap_active//A snapshot is running
+            &&
+            node.born<epoch//The node is part of it
+            &&
+            node.saved<epoch//It hasn't been preserved yet
+            &&
+            (!snap_started||snap_cursor<*it->first)//The snapshot hasn't taken it yet
+        )
+        {
+            //Copy the links as they are, without encoding them or building a dictionary. The snapshot is written from the copy later, without the lock
+            WordNode cpy(node.w);
+            cpy.f=node.f;
+            cpy.stamp=node.stamp;
+            cpy.copy_links(node,0,node.get_links());
+            snap_saved.emplace(*it->first,std::move(cpy));
+
+            //A piece of this node copied by the snapshot is out of date now
+            if (snap_part&&snap_part->w==it->first)
+                snap_part.reset();
+
+            node.saved=epoch;
+        }
+    }
+
+    //Drop a word whose node was removed. Held until the running snapshot ends, if there's one
+    void WordGraph::release_word(const Word *w)
+    {
+        if (snap_active)
+        {
+            WordPool::set_node(w,nullptr);
+            snap_released.push_back(w);
+        }
+        else
+            words.release(w);
+    }
+
+    /*Snapshot file*/
+
+    //Write the header of the running snapshot's file. Only touches what the thread writing the snapshot owns, so it runs without the lock of the graph
+    void WordGraph::write_snapshot_header(std::ostream &o)
+    {
+        //Write the number of words, which won't change for the snapshot
+        o.write(reinterpret_cast<const char *>(&snap_size),sizeof(int));
+
+        //Start the index
+        snap_off=sizeof(int);
+        snap_index.clear();
+        snap_index.reserve(snap_size);
+    }
+
+    //Write nodes taken from the running snapshot to its file. Runs without the lock of the graph
+    void WordGraph::write_snapshot(std::ostream &o,const std::vector<WordNode> &batch)
+    {
+        for (const WordNode &wn : batch)
+        {
+            std::string s=encode(wn,get_snapshot_shift(wn));
+
+            snap_index.emplace_back(*wn.w,snap_off);
+            o.write(s.data(),s.size());
+            snap_off+=s.size();
+        }
+    }
+
+    //Write the index and the chunk table after every node of the running snapshot. Runs without the lock of the graph, before closing it
+    void WordGraph::write_snapshot_index(std::ostream &o)
+    {
+        write_index(o,snap_index,snap_off);
+        snap_index.clear();
+        snap_index.shrink_to_fit();
+    }
+
+    /*Read/write to file*/
+
+    //Write to file, encoding the chunks on the given number of threads (0 for one per core)
+    void WordGraph::write(std::ostream &o,unsigned threads) const
+    {
+        if (!threads)
+            threads=default_threads();
+
+        std::ostream::pos_type base=o.tellp();//Start of the graph
+
+        //Write the number of words
+        o.write(reinterpret_cast<const char *>(&n),sizeof(int));
+
+        //First node of every chunk, and the end
+        std::vector<NodeMap::const_iterator> starts;
+        int k=0;
+        for (auto it=nodes.begin();it!=nodes.end();++it,++k)
+            if (k%CHUNK_NODES==0)
+                starts.push_back(it);
+        starts.push_back(nodes.end());
+
+        int chunks=starts.size()-1;
+
+        //Position of each node, from the start of the graph
+        std::vector< std::pair< Word,std::uint64_t > > index;
+        index.reserve(n);
+        std::uint64_t off=sizeof(int);
+
+        //Encode the chunks in waves, so only a few of them are held in memory at a time
+        const int wave=2*threads;
+        for (int first=0;first<chunks;first+=wave)
+        {
+            int last=std::min(first+wave,chunks);
+
+            std::vector<std::string> encoded(last-first);//Bytes of each chunk
+            std::vector< std::vector<std::uint64_t> > pos(last-first);//Position of each node within its chunk
+
+            parallel_for(last-first,threads,[&](int c)
+            {
+                std::ostringstream ss;
+                for (auto it=starts[first+c];it!=starts[first+c+1];++it)
+                {
+                    pos[c].push_back(ss.tellp());
+                    it->second.write(ss,get_shift(it->second));
+                }
+                encoded[c]=ss.str();
+            });
+
+            //Write them in order
+            for (int c=0;c<last-first;++c)
+            {
+                auto it=starts[first+c];
+                for (std::uint64_t p : pos[c])
+                    index.emplace_back(*(it++)->first,off+p);
+
+                o.write(encoded[c].data(),encoded[c].size());
+                off+=encoded[c].size();
+            }
+        }
+
+        //Write the index after them
+        write_index(o,index,off);
+
+        if (base!=std::ostream::pos_type(-1)&&o.tellp()!=std::ostream::pos_type(-1))
+            Stats::add(Counter::BYTES_WRITTEN,o.tellp()-base);
+    }
+
+    //Read from file, decoding the chunks on the given number of threads (0 for one per core)
+    void WordGraph::read(std::istream &i,unsigned threads)
+    {
+        if (!threads)
+            threads=default_threads();
+
+        std::istream::pos_type base=i.tellg();//Start of the graph
+
+        //Look for the chunk table
+        std::vector<Chunk> chunks;
+        std::uint64_t end=0;
+        bool chunked=read_chunks(i,chunks,end);
+
+        //Read the number of words
+        n=0;
+        i.read(reinterpret_cast<char *>(&n),sizeof(int));
+
+        //Without a chunk table, read the words one by one
+        if (!chunked)
+        {
+            int iters=n;
+            while(iters-->0)//Read all the words
+            {
+                //Node to read
+                WordNode wn(nullptr,&shared_pool);
+
+                //Read the node
+                wn.read(i,words);
+
+                //Insert the node on the map, indexed by its word
+                wn.born=epoch;
+                wn.stamp=age;
+                const Word *key=wn.w;
+                WordPool::set_node(key,&nodes.emplace(key,std::move(wn)).first->second);
+            }
+
+            if (base!=std::istream::pos_type(-1)&&i.tellg()!=std::istream::pos_type(-1))
+                Stats::add(Counter::BYTES_READ,i.tellg()-base);
+
+            return;
+        }
+
+        //Read the chunks in waves. Reading the bytes is sequential, decoding them is done in parallel
+        const int wave=2*threads;
+        for (int first=0;first<static_cast<int>(chunks.size());first+=wave)
+        {
+            int last=std::min<int>(first+wave,chunks.size());
+
+            //Load the bytes
+            std::vector<std::string> raw(last-first);
+            for (int c=0;c<last-first;++c)
+            {
+                raw[c].resize(chunks[first+c].size);
+                i.seekg(base+static_cast<std::streamoff>(chunks[first+c].off));
+                i.read(&raw[c][0],raw[c].size());
+            }
+
+            //Decode them. Each chunk allocates from its own pool, they're decoded at the same time
+            std::size_t pool0=read_pools.size();
+            for (int c=0;c<last-first;++c)
+                read_pools.emplace_back(new ReadPool());
+
+            std::vector< std::vector<WordNode> > decoded(last-first);
+            parallel_for(last-first,threads,[&](int c)
+            {
+                std::istringstream ss(raw[c]);
+                decoded[c].reserve(chunks[first+c].n);
+
+                for (int k=0;k<chunks[first+c].n;++k)
+                {
+                    decoded[c].emplace_back(nullptr,&read_pools[pool0+c]->shared);
+                    decoded[c].back().read(ss,words);
+                }
+            });
+
+            //Insert them. They're sorted, so they always go at the end
+            for (std::vector<WordNode> &v : decoded)
+            {
+                for (WordNode &wn : v)
+                {
+                    wn.born=epoch;
+                    wn.stamp=age;
+                    const Word *key=wn.w;
+                    WordPool::set_node(key,&nodes.emplace_hint(nodes.end(),key,std::move(wn))->second);
+                }
+            }
+        }
+
+        //Leave the stream after the nodes, as if they had been read one by one
+        i.seekg(base+static_cast<std::streamoff>(end));
+
+        Stats::add(Counter::BYTES_READ,end);
+    }
+
+    /*Index*/
+
+    //Read the index of a model file: the offset of each node from the start of the graph. The stream must start at the graph. Return false if the file has no index
+    bool WordGraph::read_index(std::istream &i,std::vector< std::pair< std::size_t,std::uint64_t > > &index)
+    {
+        std::istream::pos_type base=i.tellg();//Start of the graph
+
+        //Find the index
+        std::uint64_t off=0,chunk_off=0;
+        if (!read_trailer(i,off,chunk_off))
+            return false;
+
+        //Go to the index
+        i.seekg(base+static_cast<std::streamoff>(off));
+
+        //Read the number of entries
+        int entries=0;
+        i.read(reinterpret_cast<char *>(&entries),sizeof(int));
+
+        //Read the entries
+        while (entries-->0&&i)
+        {
+            Word w("");
+            w.read(i);
+
+            std::uint64_t pos=0;
+            i.read(reinterpret_cast<char *>(&pos),sizeof(pos));
+
+            index.emplace_back(w.hash(),pos);
+        }
+
+        std::sort(index.begin(),index.end());
+        return bool(i);
+    }
+
+    //Encode a node, as it's written to file, as if its frecuencies had been divided by 2^shift
+    std::string WordGraph::encode(const WordNode &node,unsigned int shift)
+    {
+        std::ostringstream ss;
+        node.write(ss,shift);
+        return ss.str();
+    }
+
+    //Write the index and the chunk table after the nodes, off being the position of the index from the start of the graph
+    void WordGraph::write_index(std::ostream &o,const std::vector< std::pair< Word,std::uint64_t > > &index,std::uint64_t off)
+    {
+        //Encode the index in memory, the position of the chunk table depends on its size
+        std::ostringstream ss;
+
+        //Write the number of entries
+        int entries=index.size();
+        ss.write(reinterpret_cast<const char *>(&entries),sizeof(int));
+
+        //Write the word and position of every node
+        for (const std::pair< Word,std::uint64_t > &p : index)
+        {
+            p.first.write(ss);
+            ss.write(reinterpret_cast<const char *>(&p.second),sizeof(p.second));
+        }
+
+        const std::string &s=ss.str();
+        o.write(s.data(),s.size());
+        std::uint64_t chunk_off=off+s.size();
+
+        //Write the chunk table: every CHUNK_NODES nodes, the last one may be shorter
+        int chunks=(entries+CHUNK_NODES-1)/CHUNK_NODES;
+        o.write(reinterpret_cast<const char *>(&chunks),sizeof(int));
+
+        for (int c=0;c<chunks;++c)
+        {
+            int first=c*CHUNK_NODES;
+            int last=std::min(first+CHUNK_NODES,entries);
+
+            Chunk ch;
+            ch.off=index[first].second;
+            ch.size=(last<entries?index[last].second:off)-ch.off;
+            ch.n=last-first;
+
+            o.write(reinterpret_cast<const char *>(&ch.off),sizeof(ch.off));
+            o.write(reinterpret_cast<const char *>(&ch.size),sizeof(ch.size));
+            o.write(reinterpret_cast<const char *>(&ch.n),sizeof(ch.n));
+        }
+
+        //Close with the position of the index and the table, and the magic number
+        o.write(reinterpret_cast<const char *>(&off),sizeof(off));
+        o.write(reinterpret_cast<const char *>(&chunk_off),sizeof(chunk_off));
+        o.write(INDEX_MAGIC,sizeof(INDEX_MAGIC));
+    }
+
+    //Read the chunk table of a model file, and the position where the nodes end. The stream must start at the graph, and is left there. Return false if the file has no table
+    bool WordGraph::read_chunks(std::istream &i,std::vector<Chunk> &chunks,std::uint64_t &end)
+    {
+        std::istream::pos_type base=i.tellg();//Start of the graph
+
+        //Find the table
+        std::uint64_t chunk_off=0;
+        if (!read_trailer(i,end,chunk_off))
+            return false;
+
+        i.seekg(base+static_cast<std::streamoff>(chunk_off));
+
+        //Read the number of chunks
+        int count=0;
+        i.read(reinterpret_cast<char *>(&count),sizeof(int));
+
+        //Read the chunks
+        while (count-->0&&i)
+        {
+            Chunk ch;
+            i.read(reinterpret_cast<char *>(&ch.off),sizeof(ch.off));
+            i.read(reinterpret_cast<char *>(&ch.size),sizeof(ch.size));
+            i.read(reinterpret_cast<char *>(&ch.n),sizeof(ch.n));
+            chunks.push_back(ch);
+        }
+
+        //Go back to the start
+        bool rv=bool(i);
+        i.clear();
+        i.seekg(base);
+        return rv;
+    }
+
+    //Read the trailer of a model file: positions of the index and the chunk table. The stream must start at the graph, and is left there. Return false if the file has no trailer
+    bool WordGraph::read_trailer(std::istream &i,std::uint64_t &index_off,std::uint64_t &chunk_off)
+    {
+        std::istream::pos_type base=i.tellg();//Start of the graph
+
+        //The file ends with both positions and the magic number
+        char magic[sizeof(INDEX_MAGIC)]={};
+
+        i.seekg(-static_cast<std::streamoff>(sizeof(index_off)+sizeof(chunk_off)+sizeof(magic)),std::ios::end);
+        i.read(reinterpret_cast<char *>(&index_off),sizeof(index_off));
+        i.read(reinterpret_cast<char *>(&chunk_off),sizeof(chunk_off));
+        i.read(magic,sizeof(magic));
+
+        bool rv=i&&std::equal(magic,magic+sizeof(magic),INDEX_MAGIC);//Can't seek on this stream, or there's no trailer
+
+        i.clear();
+        i.seekg(base);
+        return rv;
+    }
+
+    /*
+        TokenCache
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, set the number of slots. Rounded up to a power of 2
+    TokenCache::TokenCache(int nslots)
+    :slots(),hits(0),misses(0)
+    {
+        std::size_t size=1;
+        while (static_cast<int>(size)<nslots)
+            size<<=1;
+
+        slots.resize(size);
+        clear();
+    }
+
+    /* Methods */
+
+    /*Lookup*/
+
+    //Get the words a token was split into, nullptr if it isn't cached. Set ok to the result of parsing it
+    const std::vector<Word>* TokenCache::find(const std::string &raw,bool &ok)
+    {
+        Slot &sl=slot(raw);
+
+        if (!sl.used||sl.raw!=raw)
+        {
+            ++misses;
+            return nullptr;
+        }
+
+        ++hits;
+        ok=sl.ok;
+        return &sl.words;
+    }
+
+    //Store the words a token was split into
+    void TokenCache::store(const std::string &raw,std::vector<Word> words,bool ok)
+    {
+        Slot &sl=slot(raw);
+
+        sl.raw=raw;
+        sl.words=std::move(words);
+        sl.ok=ok;
+        sl.used=true;
+    }
+
+    //Forget every token
+    void TokenCache::clear()
+    {
+        for (Slot &sl : slots)
+        {
+            sl.raw.clear();
+            sl.words.clear();
+            sl.ok=false;
+            sl.used=false;
+        }
+
+        hits=0;
+        misses=0;
+    }
+
+    //Slot of a token
+    TokenCache::Slot& TokenCache::slot(const std::string &raw)
+    {
+        return slots[std::hash<std::string>()(raw)&(slots.size()-1)];
+    }
+
+    /*
+        ITextStream
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, optionally with a cache of parsed tokens that can be shared by many streams
+    ITextStream::ITextStream(std::istream &nis,TokenCache *ncache)
+    :is(nis),status(StreamState::START),nw(),cache(ncache)
+    {}
+
+    /* Methods */
+
+    /*Stream*/
+
+    //Loads the next words from the stream, returns if the stream is ready. Must be called after every read
+    bool ITextStream::has_words()
+    {
+        switch(status)
+        {
+            //Load the start word, switch to text
+            case StreamState::START:
+            {
+                nw.push_back(Word(WordType::START));
+                status=StreamState::TEXT;
+                return true;
+            }
+
+            //Load a text word, if it fails, switch to the end
+            case StreamState::TEXT:
+            {
+                std::string s;//String to read
+                if (!nw.empty())//If the buffer isn't empty
+                    return true;//It has words
+                else if (is>>s)//Or it can be filled again
+                {
+                    read_word(s);//Fill it again
+                    return true;//It still has words
+                }
+                else
+                {
+                    //If the word could not be read, let the flow reach to the next case. Do not break or return
+                    status=StreamState::END;
+                }
+            }
+
+            //End of text, stream is now empty
+            case StreamState::END:
+            {
+                nw.push_back(Word(WordType::END));
+                status=StreamState::EMPTY;
+                return true;
+            }
+
+            //When the stream is empty or on a invalid state, it has no word
+            case StreamState::EMPTY:
+            default:
+                return false;
+        }
+    }
+
+    //Return the last word read from the stream
+    Word ITextStream::read()
+    {
+        if (nw.empty())//If it's empty, error
+            return DEF_ERR_WORD;
+        else//Return the front, and pop it
+        {
+            auto rv=nw.front();
+            nw.pop_front();
+            return rv;
+        }
+    }
+
+    /*Parsing*/
+
+    //Fill the queue with words from a text separated by whitespce, from the cache if it's there
+    bool ITextStream::read_word(std::string s)
+    {
+        Stats::add(Counter::TOKENS);
+        Stats::Timer timer(Counter::TOKENIZE_NS);
+
+        if (!cache)
+            return parse_word(s);
+
+        //Seen before, skip the parser
+        bool ok=false;
+        const std::vector<Word> *hit=cache->find(s,ok);
+        if (hit)
+        {
+            nw.insert(nw.end(),hit->begin(),hit->end());
+            return ok;
+        }
+
+        //Parse it, and remember the words it was split into
+        std::size_t before=nw.size();
+        ok=parse_word(s);
+        cache->store(s,std::vector<Word>(std::next(nw.begin(),before),nw.end()),ok);
+
+        return ok;
+    }
+
+    //Fill the queue with words from a text separated by whitespace, always parsing it
+    bool ITextStream::parse_word(const std::string &s)
+    {
+        Word rv("");//Values returned from the functions
+
+        std::list<Word> words;//All words extracted from the string
+        auto it=s.cbegin();//Iterator, start at begin
+        auto e=s.cend();//End
+
+        //Try to read all L_STOP. May be none
+        while(read_L_STOP(it,e,rv))
+            words.push_back(rv);
+
+        //Try to read all L_DELIM. May be none
+        while(read_L_DELIM(it,e,rv))
+            words.push_back(rv);
+
+        //Try to read a content word. If this fails, the whole string is turned into a symbol
+        if (read_CONTENT(it,e,rv))//Text was found, check that it wasn't a symbol
+        {
+            if (rv.get_type()!=WordType::SYMBOL)
+            {
+                //Correct word
+                words.push_back(rv);
+            }
+            else
+            {
+                //Symbol
+                nw.push_back(Word(s,WordType::SYMBOL));
+                return false;//Indicate that it's a symbol
+            }
+        }
+        //If no text was found, go on without problems
+
+        //Try to read all R_DELIM. May be none
+        while(read_R_DELIM(it,e,rv))
+            words.push_back(rv);
+
+        //Try to read all R_STOP. May be none
+        while(read_R_STOP(it,e,rv))
+            words.push_back(rv);
+
+        //All string must be consumed by now. Otherwise, the whole string's a symbol
+        if (it==e)
+        {
+            //String consumed
+
+            //Move all words from this list to the end of the stream's list
+            nw.splice(nw.end(),words);
+            return true;//Reading succesful
+        }
+        else
+        {
+            //All reading is done, but there's still string left
+            nw.push_back(Word(s,WordType::SYMBOL));
+            return false;//Indicate that it's a symbol
+
+        }
+    }
+
+
+    //Read whitespace (omit, do not return)
+    bool ITextStream::read_WS(std::string::const_iterator &it,std::string::const_iterator e,Word &)
+    {
+        bool rv=false;//True if any ws was read
+        std::string::const_iterator cpy=it;//Copy the start iterator
+
+        while (it!=e)//Until the end is reached
+        {
+            std::string c=read_utf8_character(it,e);//Read a character string
+
+            if (c==" "||c=="\t")//Space or tab
+            {
+                rv=true;//At least one is read
+            }
+            else//If it wasn't
+            {
+                return_utf8_string(c,it,cpy);//Return the last character string
+                break;//Stop reading
+            }
+        }
+
+        return rv;
+    }
+
+    //Read a left stop
+    bool ITextStream::read_L_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    {
+        std::string::const_iterator cpy=it;//Copy the start iterator
+
+        if (it!=e)//If not at the end
+        {
+            std::string c=read_utf8_character(it,e);//Read a one character string
+            auto item=Word::SPEC_CHAR.find(c);//Look for the chararcter
+            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::L_STOP)//If the character was found, and it was a L_STOP
+            {
+                w.set_all(c,WordType::L_STOP);//Set the word
+                return true;//Read a word
+            }
+            else//Character not detected, return it
+            {
+                return_utf8_string(c,it,cpy);
+            }
+        }
+
+        return false;//Did not read a word
+    }
+
+    //Read a left delimiter
+    bool ITextStream::read_L_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    {
+        std::string::const_iterator cpy=it;//Copy the start iterator
+
+        if (it!=e)//If not at the end
+        {
+            std::string c=read_utf8_character(it,e);//Read a one character string
+            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
+            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::L_DELIM)//If the character was found, and it was a L_DELIM
+            {
+                w.set_all(c,WordType::L_DELIM);//Set the word
+                return true;//Read a word
+            }
+            else//Character not detected, return it
+            {
+                return_utf8_string(c,it,cpy);
+            }
+        }
+        return false;//Did not read a word
+    }
+
+    //Read content
+    bool ITextStream::read_CONTENT(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    {
+        //Text to read
+        std::string word;
+
+        //Word to be returned by auxiliary functions
+        Word rv("");
+
+        //Type of the word currently been set
+        WordType t=WordType::START;
+        bool trans=false;//Transitioning between states
+
+        //Until the end has been reached
+        while(it!=e)
+        {
+            //Check if it's the end of the word
+            std::string::const_iterator cpy=it;//Make a copy of the iterator, as to not modify it
+            if (read_R_DELIM(cpy,e,rv)||read_R_STOP(cpy,e,rv))//If you find a right stop or delimiter, stop reading words
+                break;
+
+            //Try to read a character
+            std::string c=read_utf8_character(it,e);
+            if (c.empty())//Is it empty? Some error must've happened
+            {
+                w.set_all(word+std::string(it,e),WordType::SYMBOL);//Everything's a symbol
+                return true;
+            }
+            else//A character was read, try to parse it
+            {
+                switch(t)//Switch based on type
+                {
+                    case WordType::START:
+                    {
+                        //Try to detect the type of word
+
+                        if//Text word
+                        (
+                            (Word::TXT_SEP.find(c)!=Word::TXT_SEP.end())//Text separator
+                            ||
+                            (//Character is a letter
+                                (c.size()==1)
+                                &&
+                                (std::isalpha(c[0]))
+                            )
+                        )
+                            t=WordType::WORD;//Detect it as a word
+
+                        else if(c.size()==1&&std::isdigit(c[0]))//Integer
+                            t=WordType::INT;
+
+                        break;
+                    }
+
+                    case WordType::WORD://Reading a word
+                    {
+                        if
+                        (
+                            !//Not a valid character
+                            (
+                                (Word::TXT_SEP.find(c)!=Word::TXT_SEP.end())//Text separator
+                                ||
+                                (//Character is a letter
+                                    (c.size()==1)
+                                    &&
+                                    (std::isalpha(c[0]))
+                                )
+                            )
+                        )
+                            t=WordType::SYMBOL;//Turn the word into a symbol
+                        break;
+                    }
+
+                    case WordType::INT://Integer
+                    {
+                        if (Word::NUM_SEP.find(c)!=Word::NUM_SEP.end())//Number separator
+                        {
+                            trans=true;//Transition to decimal. If this flag is on at the end, we know the transition didn't end
+                            t=WordType::DECIMAL;
+                        }
+                        else if (!(c.size()==1&&std::isdigit(c[0])))//If not a digit
+                            t=WordType::SYMBOL;
+                        break;
+                    }
+
+                    case WordType::DECIMAL://Decimal number
+                    {
+                        if (c.size()==1&&std::isdigit(c[0]))//If it's a digit
+                        {
+                            //No longer transitioning
+                            trans=false;
+                        }
+                        else//Not a digit, turn to symbol
+                        {
+                            t=WordType::SYMBOL;
+                        }
+
+                        break;
+                    }
+
+                    default://No need to do anything specific for a symbol
+                        break;
+                }
+                word+=c;//Add the character to the word
+            }
+        }
+
+        //We're done. Check the type
+        if(trans)//If caught midtransitioning, degenerate to symbol
+            t=WordType::SYMBOL;
+
+        //Check if anything's been read
+        if(t==WordType::START)
+            return false;//Report it
+
+        //All set. Return the word
+        w.set_all(word,t);
+        return true;
+    }
+
+    //Read a left stop
+    bool ITextStream::read_R_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    {
+        std::string::const_iterator cpy=it;//Copy the start iterator
+
+        if (it!=e)//If not at the end
+        {
+            std::string c=read_utf8_character(it,e);//Read a one character string
+            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
+            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::R_DELIM)//If the character was found, and it was a L_DELIM
+            {
+                w.set_all(c,WordType::R_DELIM);//Set the word
+                return true;//Read a word
+            }
+            else//Character not detected, return it
+            {
+                return_utf8_string(c,it,cpy);
+            }
+        }
+        return false;//Did not read a word
+    }
+
+    //Read a left stop
+    bool ITextStream::read_R_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    {
+        std::string::const_iterator cpy=it;//Copy the start iterator
+
+        if (it!=e)//If not at the end
+        {
+            std::string c=read_utf8_character(it,e);//Read a one character string
+            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
+            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::R_STOP)//If the character was found, and it was a L_DELIM
+            {
+                w.set_all(c,WordType::R_STOP);//Set the word
+                return true;//Read a word
+            }
+            else//Character not detected, return it
+            {
+                return_utf8_string(c,it,cpy);
+            }
+        }
+        return false;//Did not read a word
+    }
+
+    /*
+        BigramBatch
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, set the number of links held before the batch is full
+    BigramBatch::BigramBatch(int nmax_links)
+    :ids(),vocab(),frecs(),links(),counted(true),max_links(nmax_links),lines(0)
+    {}
+
+    /* Methods */
+
+    /*Fill*/
+
+    //Add the words and links of a text stream, as a line seen count times
+    void BigramBatch::add(ITextStream &ts,int count)
+    {
+        //Load the first word
+        if (ts.has_words())
+        {
+            std::uint32_t prev=id(ts.read(),count);
+
+            //Every other word links to the one before it
+            while (ts.has_words())
+            {
+                std::uint32_t w=id(ts.read(),count);
+
+                links.emplace_back((static_cast<std::uint64_t>(prev)<<32)|w,count);
+                prev=w;
+            }
+
+            counted=false;
+            lines+=count;
+        }
+    }
+
+    //Merge the repeated links, adding up their frecuencies, and sort them. Done before learning
+    void BigramBatch::count()
+    {
+        if (counted)
+            return;
+
+        std::sort(links.begin(),links.end());
+
+        //Merge runs of the same link
+        std::size_t k=0;
+        for (std::size_t j=0;j<links.size();++j)
+        {
+            if (k&&links[k-1].first==links[j].first)
+                links[k-1].second+=links[j].second;
+            else
+                links[k++]=links[j];
+        }
+        links.resize(k);
+
+        counted=true;
+    }
+
+    //Drop every word and link
+    void BigramBatch::clear()
+    {
+        ids.clear();
+        vocab.clear();
+        frecs.clear();
+        links.clear();
+        counted=true;
+        lines=0;
+    }
+
+    //Id of a word, adding it if needed, and count it
+    std::uint32_t BigramBatch::id(const Word &w,int count)
+    {
+        auto it=ids.find(w);
+
+        if (it==ids.end())//New word
+        {
+            it=ids.emplace(w,static_cast<std::uint32_t>(vocab.size())).first;
+            vocab.push_back(w);
+            frecs.push_back(0);
+        }
+
+        frecs[it->second]+=count;
+        return it->second;
+    }
+
+    /*
+        LineCounter
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, set the number of distinct lines held before the counter is full
+    LineCounter::LineCounter(int nmax_lines)
+    :counts(),max_lines(nmax_lines),total(0)
+    {}
+
+    /* Methods */
+
+    /*Lines*/
+
+    //Count a line
+    void LineCounter::add(const std::string &line)
+    {
+        ++counts[line];
+        ++total;
+    }
+
+    //Add every distinct line to a batch, once, with the times it was seen. Optionally, split it using a cache of parsed tokens
+    void LineCounter::fill(BigramBatch &b,TokenCache *cache) const
+    {
+        for (const auto &c : counts)
+        {
+            std::stringstream ss(c.first);
+            ITextStream ts(ss,cache);
+            b.add(ts,c.second);
+        }
+    }
+
+    //Drop every line
+    void LineCounter::clear()
+    {
+        counts.clear();
+        total=0;
+    }
+
+    /*
+        CorpusGenerator
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, set the seed, the number of distinct words and the exponent of their distribution
+    CorpusGenerator::CorpusGenerator(std::uint64_t nseed,int nvocab,double nexponent)
+    :seed(nseed),state(nseed),vocab(),cum()
+    {
+        nvocab=std::max(nvocab,1);
+        vocab.reserve(nvocab);
+        cum.reserve(nvocab);
+
+        double total=0;
+        for (int k=0;k<nvocab;++k)
+        {
+            vocab.push_back(make_word(k));
+            total+=weight(k+1,nexponent);
+            cum.push_back(total);
+        }
+    }
+
+    /* Methods */
+
+    /*Lines*/
+
+    //Get the next line
+    std::string CorpusGenerator::line()
+    {
+        std::string s;
+        line(s);
+        return s;
+    }
+
+    //Append the next line to a string, without the new line character
+    void CorpusGenerator::line(std::string &s)
+    {
+        //Most lines are a single sentence
+        int sentences=(next()%4)?1:2+static_cast<int>(next()%2);
+        for (int k=0;k<sentences;++k)
+        {
+            if (k)
+                s+=' ';
+            sentence(s);
+        }
+    }
+
+    //Write a number of lines. Return the number of bytes written
+    std::uint64_t CorpusGenerator::write(std::ostream &o,std::uint64_t lines)
+    {
+        std::uint64_t bytes=0;
+        std::string s;
+        for (std::uint64_t k=0;k<lines&&o;++k)
+        {
+            s.clear();
+            line(s);
+            s+='\n';
+            o.write(s.data(),s.size());
+            bytes+=s.size();
+        }
+        return bytes;
+    }
+
+    //Write lines until a number of bytes is reached. Return the number of lines written
+    std::uint64_t CorpusGenerator::write_size(std::ostream &o,std::uint64_t bytes)
+    {
+        std::uint64_t lines=0;
+        std::string s;
+        for (std::uint64_t done=0;done<bytes&&o;++lines)
+        {
+            s.clear();
+            line(s);
+            s+='\n';
+            o.write(s.data(),s.size());
+            done+=s.size();
+        }
+        return lines;
+    }
+
+    /*Generation*/
+
+    //Next random number, splitmix64
+    std::uint64_t CorpusGenerator::next()
+    {
+        std::uint64_t z=(state+=0x9E3779B97F4A7C15ULL);
+        z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+        z=(z^(z>>27))*0x94D049BB133111EBULL;
+        return z^(z>>31);
+    }
+
+    //Next random number in [0,1)
+    double CorpusGenerator::uniform()
+    {
+        return (next()>>11)*(1.0/9007199254740992.0);//53 random bits
+    }
+
+    //Append a sentence
+    void CorpusGenerator::sentence(std::string &s)
+    {
+        //Most sentences are statements. Some are exclamations or questions, half of them opened with the inverted marks
+        const char *open="",*close=".";
+        switch (next()%16)
+        {
+            case 0: open="\u00A1"; close="!"; break;
+            case 1: open="\u00BF"; close="?"; break;
+            case 2: close="!"; break;
+            case 3: close="?"; break;
+            default: break;
+        }
+        s+=open;
+
+        int len=MIN_WORDS+static_cast<int>(next()%(MAX_WORDS-MIN_WORDS+1));
+        int paren_end=-1;//Last word inside parentheses, if they're open
+        for (int k=0;k<len;++k)
+        {
+            if (k)
+                s+=' ';
+
+            //Open parentheses for one or two words, never the last ones
+            if (paren_end<0&&k&&k+2<len&&next()%24==0)
+            {
+                s+='(';
+                paren_end=k+static_cast<int>(next()%2);
+            }
+
+            token(s,k==0);
+
+            if (k==paren_end)
+            {
+                s+=')';
+                paren_end=-1;
+            }
+            else if (paren_end<0&&k+1<len&&next()%10==0)//Clauses, mostly separated by commas
+            {
+                std::uint64_t d=next()%8;
+                s+=(d<6)?',':(d==6)?';':':';
+            }
+        }
+
+        s+=close;
+    }
+
+    //Append a word or number. The first one of a sentence is capitalized
+    void CorpusGenerator::token(std::string &s,bool first)
+    {
+        switch (next()%32)
+        {
+            case 0://INT
+                s+=std::to_string(next()%1000);
+                break;
+
+            case 1://DECIMAL, the separator that doesn't end words
+                s+=std::to_string(next()%100);
+                s+='\'';
+                s+=std::to_string(next()%100);
+                break;
+
+            default://Word
+            {
+                const double u=uniform()*cum.back();
+                std::size_t r=std::upper_bound(cum.begin(),cum.end(),u)-cum.begin();
+                const std::string &w=vocab[std::min(r,vocab.size()-1)];
+
+                if (first)
+                {
+                    s+=static_cast<char>(std::toupper(static_cast<unsigned char>(w[0])));
+                    s.append(w,1,std::string::npos);
+                }
+                else
+                    s+=w;
+                break;
+            }
+        }
+    }
+
+    //Word of a rank. Common ranks give short words, and no two ranks give the same word
+    std::string CorpusGenerator::make_word(int rank)
+    {
+        static const char consonants[]="bcdfghjklmnprstvz";
+        static const char vowels[]="aeiou";
+        const int ncons=sizeof(consonants)-1,nvow=sizeof(vowels)-1,nsyl=ncons*nvow;
+
+        //Bijective base of syllables, so every rank has its own spelling
+        std::string w;
+        for (int r=rank+1;r>0;r=(r-1)/nsyl)
+        {
+            int d=(r-1)%nsyl;
+            w+=consonants[d/nvow];
+            w+=vowels[d%nvow];
+        }
+
+        //Some words have a text separator inside. Syllables never contain it, so they stay distinct
+        if (rank%13==7)
+            w+="'s";
+
+        return w;
+    }
+
+    //Weight of a rank, 1/rank^exponent
+    double CorpusGenerator::weight(int rank,double exponent)
+    {
+        //Built from multiplications, square roots and a division, which IEEE 754 rounds exactly, unlike std::pow, whose last bits change between math libraries
+        const std::uint64_t e=static_cast<std::uint64_t>(std::max(exponent,0.0)*(1<<EXPONENT_BITS)+0.5);//Exponent in fixed point
+
+        //Whole part, by squaring
+        double p=1,x=rank;
+        for (std::uint64_t w=e>>EXPONENT_BITS;w;w>>=1)
+        {
+            if (w&1)
+                p*=x;
+            x*=x;
+        }
+
+        //Each binary digit after the point is a further square root of the rank
+        x=rank;
+        for (int b=EXPONENT_BITS-1;b>=0;--b)
+        {
+            x=std::sqrt(x);
+            if ((e>>b)&1)
+                p*=x;
+        }
+
+        return 1/p;
+    }
+
+    /*
+        OTextStream
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor
+    OTextStream::OTextStream(std::ostream &nos)
+    :os(nos),state(WordType::START)
+    {}
+
+    /* Methods */
+
+    /*Write*/
+
+    //Write a word to the stream
+    bool OTextStream::write(const Word &w)
+    {
+        //Check stream's state
+        if (state==WordType::END)//If the stream's closed
+        {
+            if (!(w.get_type()==WordType::END || w.get_type()==WordType::START))//If we aren't closing, or reopening the stream
+                return false;//Error!
+        }
+
+        std::string s(w.get_text());//Text to be written, if any
+
+        //Format will depend on the word to be written
+        switch(w.get_type())//Switch based on word type
+        {
+            //Start of text
+            case WordType::START:
+            {
+                if (state==WordType::START)//If the stream is also at the start
+                    ;//No need to do a thing
+                else if (state==WordType::END)//If the stream is being reopened
+                    ;//No need to do a thing
+                else//Printing a start without the stream being closed/at the start, error
+                    return false;
+
+                break;
+            }
+
+            //End of text
+            case WordType::END:
+            {
+                //Stream ended, print newline
+                os<<'\n';
+                Stats::add(Counter::LINES_GENERATED);
+
+                break;
+            }
+
+            //Content
+            case WordType::WORD:
+            case WordType::SYMBOL:
+            case WordType::INT:
+            case WordType::DECIMAL:
+            {
+                switch(state)//Print based on previous word
+                {
+                    //Upper+Space
+                    case WordType::R_STOP:
+                    {
+                        os<<' ';
+                        if (!s.empty()&&std::islower(s[0]))
+                            s[0]=std::toupper(s[0]);
+                        break;
+                    }
+
+                    //Upper
+                    case WordType::START:
+                    case WordType::L_STOP:
+                    {
+                        if (!s.empty()&&std::islower(s[0]))
+                            s[0]=std::toupper(s[0]);
+                        break;
+                    }
+
+                    //Space
+                    case WordType::WORD:
+                    case WordType::SYMBOL:
+                    case WordType::INT:
+                    case WordType::DECIMAL:
+                    case WordType::R_DELIM:
+                    {
+                        os<<' ';
+                        break;
+                    }
+
+                    //Nothing (or unknown status)
+                    case WordType::L_DELIM:
+                    default:
+                        break;
+                }
+
+                //Now that the word is ready, print it
+                os<<s;
+
+                break;
+            }
+
+            //Left delimiter
+            case WordType::L_DELIM:
+            case WordType::L_STOP:
+            {
+                switch (state)//Print based on previous word
+                {
+                    //Space
+
+                    //After content
+                    case WordType::WORD:
+                    case WordType::SYMBOL:
+                    case WordType::INT:
+                    case WordType::DECIMAL:
+                    //After right delimiter
+                    case WordType::R_DELIM:
+                    case WordType::R_STOP:
+                    {
+                        os<<' ';
+                        break;
+                    }
+
+                    //Nothing
+
+                    //Other left delimiters
+                    case WordType::L_DELIM:
+                    case WordType::L_STOP:
+                    //Unknown
+                    default:
+                        break;
+                }
+
+                //Now that the word is ready, print it
+                os<<s;
+
+                break;
+            }
+
+            //Right delimiter
+            case WordType::R_DELIM:
+            case WordType::R_STOP:
+            {
+                //No formatting needed, just print it
+                os<<s;
+                break;
+            }
+
+            //By default
+            default:
+            {
+                os<<s;//Just print the word
+                break;
+            }
+        }
+
+        //Update the stream's status
+        state=w.get_type();
+
+        //No error, return true
+        return true;
+    }
+
+    /*
+        WordModel
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor
+    WordModel::WordModel()
+    :graph(),lock(),snap_done(),policy(),lines(0),decay_period(0),decay_lines(0)
+    {}
+
+    /*Copy control*/
+
+    //Wait for a background snapshot to end
+    WordModel::~WordModel()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        snap_done.wait(guard,[this]{return !graph.in_snapshot();});
+    }
+
+    /* Methods */
+
+    /*Learn*/
+
+    //Learn from a text stream, as a line seen count times
+    void WordModel::learn(ITextStream &ts,int count)
+    {
+        Stats::Latency latency(Op::LEARN);//Waiting for the lock included
+        std::lock_guard<std::mutex> guard(lock);
+
+        //Load the first word
+        if (ts.has_words())
+        {
+            Word w=ts.read();//Word to be processed
+            graph.add_word(w,count);//Add it to the graph
+
+            //Read the rest on a loop
+            Word prev=w;//Previous word to be processed
+
+            //While the stream has words
+            while (ts.has_words())
+            {
+                //Read the word
+                w=ts.read();
+
+                //Add the word
+                graph.add_word(w,count);
+
+                //Add the links
+                graph.add_link(prev,w,count);
+
+                //Store the current word on previous
+                prev=w;
+            }
+
+            end_lines(count);
+        }
+    }
+
+    //Learn every line of a batch, adding each distinct word and link once. Lines are aged and pruned as if learned one by one, but only after the whole batch
+    void WordModel::learn(BigramBatch &b)
+    {
+        if (!b.get_lines())
+            return;
+
+        Stats::Latency latency(Op::LEARN_BATCH);//Waiting for the lock included
+        std::lock_guard<std::mutex> guard(lock);
+
+        b.count();
+        graph.add_batch(b);
+
+        end_lines(b.get_lines());
+    }
+
+    //Forget everything learned, returning the memory at once. Return false if a snapshot is being written
+    bool WordModel::clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!graph.clear())
+            return false;
+
+        lines=0;
+        decay_lines=0;
+        return true;
+    }
+
+    /*Layout*/
+
+    //Place the nodes in memory by how likely they're to be reached while thinking, so the most used ones are contiguous. Meant for models that are done learning. Return false if a snapshot is being written
+    bool WordModel::relayout()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        return graph.relayout();
+    }
+
+    /*Pruning*/
+
+    //Set the policy applied while learning
+    void WordModel::set_prune_policy(const PrunePolicy &p)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        policy=p;
+        lines=0;
+    }
+
+    //Prune the model now, with the given policy. Return the number of words dropped
+    int WordModel::prune(const PrunePolicy &p)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        lines=0;
+        return graph.prune(p);
+    }
+
+    /*Decay*/
+
+    //Halve every frecuency each time the given number of lines is learned, so recent text dominates. 0 to only do it on demand
+    void WordModel::set_decay(int period)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        decay_period=period;
+        decay_lines=0;
+    }
+
+    //Start a new decay epoch now, halving every frecuency
+    void WordModel::age()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.advance_age();
+        decay_lines=0;
+    }
+
+    //Check up to max_nodes words, dropping the ones that decayed to nothing. Can be called from a maintenance thread. Return the number of words dropped
+    int WordModel::reclaim(int max_nodes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        return graph.reclaim(max_nodes);
+    }
+
+    /*Counting*/
+
+    //Count very frecuent links approximately, so they fit on 2 byte counters
+    void WordModel::set_approx(bool a)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.set_approx(a);
+    }
+
+    /*Batch threads*/
+
+    //Add the links of large batches on the given number of threads (0 for one per core)
+    void WordModel::set_batch_threads(unsigned int t)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.set_batch_threads(t);
+    }
+
+    /*Streaming*/
+
+    //Keep at most max_next next words on each node (0 to keep them all), so memory doesn't grow with the number of distinct links. The rest are counted approximately, and take the place of a kept one when they become more frecuent
+    void WordModel::set_streaming(int max_next)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.set_streaming(max_next,SKETCH_WIDTH,SKETCH_DEPTH);
+    }
+
+    //Prune if the policy asks for it, after learning some lines. The lock must be held
+    void WordModel::auto_prune(int count)
+    {
+        lines+=count;
+
+        if (policy.interval>0&&lines>=policy.interval)//Periodic prune
+        {
+            lines=0;
+            graph.prune(policy);
+        }
+        else if (policy.max_nodes>0&&graph.get_size()>policy.max_nodes)//Vocabulary cap hit
+        {
+            //Leave some room, so it doesn't prune again on the next new word
+            PrunePolicy p=policy;
+            p.max_nodes-=policy.max_nodes*PRUNE_SLACK;
+
+            lines=0;
+            graph.prune(p);
+        }
+    }
+
+    /*Lines*/
+
+    //Age, reclaim and prune after learning some lines. The lock must be held
+    void WordModel::end_lines(int count)
+    {
+        Stats::add(Counter::LINES_LEARNED,count);
+
+        //Age the model, once per period completed
+        if (decay_period>0)
+        {
+            decay_lines+=count;
+            while (decay_lines>=decay_period)
+            {
+                graph.advance_age();
+                decay_lines-=decay_period;
+            }
+        }
+
+        //Reclaim a few decayed words
+        if (graph.get_age())
+            graph.reclaim(RECLAIM_STEP*count);
+
+        auto_prune(count);
+    }
+
+    /*Speak*/
+
+    //Generate a line using the model
+    void WordModel::think(OTextStream &ots)
+    {
+        Stats::Latency latency(Op::THINK);//Waiting for the lock included
+        std::lock_guard<std::mutex> guard(lock);
+
+        //Make sure the start and end node exist
+
+        if (!graph.check_word(Word(WordType::START)))
+            graph.add_word(Word(WordType::START));
+
+        if (!graph.check_word(Word(WordType::END)))
+            graph.add_word(Word(WordType::END));
+
+        WordNode *node=graph.get_node(Word(WordType::START));//The first node to be processed is the start node
+
+        const Word end_word(WordType::END);
+
+
+        while(node&&node->get_word()!=end_word)//Until the end node is reached
+        {
+            ots.write(node->get_word());//Print this node
+
+            //Advance to next, following the link to its node
+            node=node->get_next_node(graph.get_shift(*node));
+        }
+
+        //Close the stream
+        ots.write(end_word);
+    }
+
+    //Copy the model as it is now into an immutable version, that generates lines on any number of threads without locks
+    std::shared_ptr<const FrozenModel> WordModel::freeze()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        return std::make_shared<const FrozenModel>(graph,0);
+    }
+
+    /*Read/write to file*/
+
+    //Write to file, using the given number of threads (0 for one per core)
+    void WordModel::write(std::ostream &o,unsigned threads) const
+    {
+        Stats::Latency latency(Op::WRITE);
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.write(o,threads);
+    }
+
+    //Read from file, using the given number of threads (0 for one per core)
+    void WordModel::read(std::istream &i,unsigned threads)
+    {
+        Stats::Latency latency(Op::READ);
+        std::lock_guard<std::mutex> guard(lock);
+
+        graph.read(i,threads);
+    }
+
+    //Write a snapshot of the model as it is now on a background thread, while learning goes on. The stream must outlive the returned future, which reports if the snapshot could be written
+    std::future<bool> WordModel::write_async(std::ostream &o)
+    {
+        //Take the snapshot now. Nodes modified from here on are copied first
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (!graph.begin_snapshot())//Another snapshot is running
+                return std::async(std::launch::deferred,[]{return false;});
+        }
+
+        //Copy the nodes in batches of about the same number of links, holding the lock only while copying, and encode them without it so learning can go on
+        return std::async(std::launch::async,[this,&o]
+        {
+            graph.write_snapshot_header(o);
+
+            std::vector<WordNode> batch;
+            for (bool more=true;more;)
+            {
+                batch.clear();
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    more=graph.take_snapshot(batch,SNAPSHOT_LINKS);
+                }
+
+                //Let a thread waiting for the lock run before encoding, even on a single core
+                std::this_thread::yield();
+
+                graph.write_snapshot(o,batch);
+            }
+            batch.clear();
+
+            graph.write_snapshot_index(o);
+            bool ok=bool(o);
+
+            //The model may be destroyed as soon as the snapshot is closed, nothing of it is used past this
+            std::lock_guard<std::mutex> guard(lock);
+            graph.end_snapshot();
+            snap_done.notify_all();
+
+            return ok;
+        });
+    }
+
+    /*
+        WordWalker
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, walk a model with a random engine seeded with the given value
+    WordWalker::WordWalker(WordModel &m,unsigned int seed)
+    :model(m),re(seed),current(WordType::START),node(nullptr),drops(0),started(false),finished(false),spent(0)
+    {}
+
+    /* Methods */
+
+    /*Walk*/
+
+    //Get the next word of the line, START first and END last. Return false once END has been generated
+    bool WordWalker::next(Word &w)
+    {
+        if (finished)
+            return false;
+
+        auto t=std::chrono::steady_clock::now();//Waiting for the lock included
+
+        //Only one step is taken holding the lock, so learning and other walkers can go on between them
+        std::lock_guard<std::mutex> guard(model.lock);
+        WordGraph &graph=model.graph;
+
+        if (!started)
+        {
+            //Make sure the start and end node exist
+            if (!graph.check_word(Word(WordType::START)))
+                graph.add_word(Word(WordType::START));
+
+            if (!graph.check_word(Word(WordType::END)))
+                graph.add_word(Word(WordType::END));
+
+            node=graph.get_node(Word(WordType::START));
+            started=true;
+            spent=std::chrono::steady_clock::duration(0);
+        }
+        else
+        {
+            //The node may be gone, or somewhere else, find it again
+            if (drops!=graph.get_drops())
+                node=graph.get_node(current);
+
+            //Advance to next, following the link to its node
+            node=node?node->get_next_node(graph.get_shift(*node),re):nullptr;
+        }
+
+        drops=graph.get_drops();
+
+        //Nowhere to go, or the end was reached
+        if (!node||node->get_word().get_type()==WordType::END)
+        {
+            //The line took the time spent in every step, not the one the caller spent between them
+            spent+=std::chrono::steady_clock::now()-t;
+            Stats::record(Op::THINK,std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count());
+
+            finished=true;
+            node=nullptr;
+            w=Word(WordType::END);
+            return true;
+        }
+
+        current=node->get_word();
+        w=current;
+
+        spent+=std::chrono::steady_clock::now()-t;
+        return true;
+    }
+
+    //Start a new line
+    void WordWalker::restart()
+    {
+        current=Word(WordType::START);
+        node=nullptr;
+        started=false;
+        finished=false;
+    }
+
+    /*
+        FrozenModel
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor, an empty model
+    FrozenModel::FrozenModel()
+    :words(),first(1,0),start(0),next(),cum(),version(0),keys(),targets()
+    {}
+
+    //Complete constructor, copy the current frecuencies of a graph
+    FrozenModel::FrozenModel(const WordGraph &g,std::uint64_t nversion)
+    :FrozenModel(nversion)
+    {
+        words.reserve(g.nodes.size());
+        first.reserve(g.nodes.size()+1);
+        for (const auto &kv : g.nodes)
+            add_node(kv.second,g.get_shift(kv.second));
+
+        finish();
+    }
+
+    //Empty version, to be built with add_node and finish
+    FrozenModel::FrozenModel(std::uint64_t nversion)
+    :words(),first(),start(0),next(),cum(),version(nversion),keys(),targets()
+    {}
+
+    /* Methods */
+
+    /*Speak*/
+
+    //Generate a line, picking the words with the given random engine
+    void FrozenModel::think(OTextStream &ots,std::default_random_engine &eng) const
+    {
+        Stats::Latency latency(Op::THINK);
+
+        ots.write(Word(WordType::START));
+
+        //Follow the links from START until END, or a node without next words
+        for (std::uint32_t node=start;node<words.size();)
+        {
+            std::uint32_t b=first[node],e=first[node+1];
+            if (b==e)
+                break;
+
+            std::uint64_t r=std::uniform_int_distribution<std::uint64_t>(0,cum[e-1]-1)(eng);
+            std::uint32_t k=std::upper_bound(cum.begin()+b,cum.begin()+e,r)-cum.begin();
+            node=next[k];
+
+            Stats::add(Counter::PICKS);
+            Stats::add(Counter::PICK_DEPTH,k-b+1);
+
+            if (words[node].get_type()==WordType::END)
+                break;
+            ots.write(words[node]);
+        }
+
+        //Close the stream
+        ots.write(Word(WordType::END));
+    }
+
+    /*Building*/
+
+    //Add a node copied from a graph, its frecuencies divided by 2^shift. The words its links reach are numbered by finish
+    void FrozenModel::add_node(const WordNode &wn,unsigned int shift)
+    {
+        first.push_back(static_cast<std::uint32_t>(targets.size()));
+        keys.push_back(wn.w);
+        words.push_back(*wn.w);
+
+        //Next words, decayed, skipping the ones that decayed to nothing
+        const FrecLink &links=wn.get_next_links();
+        std::uint64_t total=0;
+        for (int k=0;k<links.get_size();++k)
+        {
+            int f=FrecLink::decayed(links.frec_at(k),shift);
+            if (f<=0)
+                continue;
+
+            total+=f;
+            targets.push_back(links.word_at(k));
+            cum.push_back(total);
+        }
+    }
+
+    //Number the words the links reach, once every node is added. Links to words without a node are dropped
+    void FrozenModel::finish()
+    {
+        //Number the nodes in the order they were added
+        std::unordered_map< const Word*,std::uint32_t > ids;
+        ids.reserve(keys.size());
+        start=static_cast<std::uint32_t>(words.size());
+        for (std::uint32_t k=0;k<keys.size();++k)
+        {
+            ids.emplace(keys[k],k);
+            if (words[k].get_type()==WordType::START)
+                start=k;
+        }
+
+        //Replace the words reached by their nodes, adding up the frecuencies again where a link is dropped
+        first.push_back(static_cast<std::uint32_t>(targets.size()));
+        next.reserve(targets.size());
+        std::uint32_t out=0;
+        for (std::size_t node=0;node+1<first.size();++node)
+        {
+            std::uint32_t b=first[node],e=first[node+1];
+            first[node]=out;
+
+            std::uint64_t total=0,last=0;
+            for (std::uint32_t k=b;k<e;++k)
+            {
+                std::uint64_t f=cum[k]-last;
+                last=cum[k];
+
+                auto id=ids.find(targets[k]);
+                if (id==ids.end())
+                    continue;
+
+                total+=f;
+                next.push_back(id->second);
+                cum[out++]=total;
+            }
+        }
+        first.back()=out;
+        cum.resize(out);
+
+        //Only needed while building
+        std::vector<const Word*>().swap(keys);
+        std::vector<const Word*>().swap(targets);
+    }
+
+    /*
+        LiveModel
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, publish a new version every given number of lines (0 to only publish on demand)
+    LiveModel::LiveModel(int npublish_lines)
+    :model(),writer(),current(std::make_shared<const FrozenModel>()),versions(0),publish_lines(npublish_lines),pending(0),next_start(),building()
+    {}
+
+    /* Methods */
+
+    /*Learn*/
+
+    //Learn from a text stream, as a line seen count times
+    void LiveModel::learn(ITextStream &ts,int count)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+
+        model.learn(ts,count);
+        end_lines(count);
+    }
+
+    //Learn every line of a batch
+    void LiveModel::learn(BigramBatch &b)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+
+        int lines=b.get_lines();
+        model.learn(b);
+        end_lines(lines);
+    }
+
+    /*Versions*/
+
+    //Publish the model as it is now, waiting for it. Generation goes on with the last version while it's copied
+    void LiveModel::publish()
+    {
+        std::lock_guard<std::mutex> guard(writer);
+
+        wait_version();
+
+        //Copied a batch at a time, unless a snapshot is being written
+        if (start_version())
+            wait_version();
+        else
+            make_version();
+    }
+
+    //Copy the model into a new version at once, and make it the current one. The writer lock must be held
+    void LiveModel::make_version()
+    {
+        wait_version();
+
+        Stats::Latency latency(Op::PUBLISH);
+
+        std::shared_ptr<const FrozenModel> v;
+        {
+            std::lock_guard<std::mutex> guard(model.lock);
+            v=std::make_shared<const FrozenModel>(model.graph,++versions);
         }
-        else
+
+        //Threads holding the last version keep it until they're done
+        std::atomic_store(&current,std::move(v));
+        pending=0;
+    }
+
+    //Start building a new version in the background from a snapshot of the model. Return false if another snapshot is running. The writer lock must be held
+    bool LiveModel::start_version()
+    {
         {
-            //All reading is done, but there's still string left
-            nw.push_back(Word(s,WordType::SYMBOL));
-            return false;//Indicate that it's a symbol
+            std::lock_guard<std::mutex> guard(model.lock);
 
+            if (!model.graph.begin_snapshot())
+                return false;
         }
+
+        pending=0;
+        building=std::async(std::launch::async,&LiveModel::build_version,this,++versions);
+        return true;
     }
 
+    //Wait for the version being built, if there's one. The writer lock must be held
+    void LiveModel::wait_version()
+    {
+        if (!building.valid())
+            return;
+
+        std::chrono::steady_clock::duration took=building.get();
+        next_start=std::chrono::steady_clock::now()+took*PUBLISH_SPACING;
+    }
 
-    //Read whitespace (omit, do not return)
-    bool ITextStream::read_WS(std::string::const_iterator &it,std::string::const_iterator e,Word &)
+    //Build a new version from the running snapshot of the model, and make it the current one. Holds the lock of the model only while copying a batch of nodes. Return how long it took
+    std::chrono::steady_clock::duration LiveModel::build_version(std::uint64_t v)
     {
-        bool rv=false;//True if any ws was read
-        std::string::const_iterator cpy=it;//Copy the start iterator
+        Stats::Latency latency(Op::PUBLISH);
+        auto t=std::chrono::steady_clock::now();
 
-        while (it!=e)//Until the end is reached
-        {
-            std::string c=read_utf8_character(it,e);//Read a character string
+        std::shared_ptr<FrozenModel> fm(new FrozenModel(v));
+        WordGraph &graph=model.graph;
 
-            if (c==" "||c=="\t")//Space or tab
-            {
-                rv=true;//At least one is read
-            }
-            else//If it wasn't
+        std::vector<WordNode> batch;
+        for (bool more=true;more;)
+        {
+            batch.clear();
             {
-                return_utf8_string(c,it,cpy);//Return the last character string
-                break;//Stop reading
+                std::lock_guard<std::mutex> guard(model.lock);
+                more=graph.take_snapshot(batch,WordModel::SNAPSHOT_LINKS);
             }
+
+            //Let the writer run before adding them, even on a single core
+            std::this_thread::yield();
+
+            for (const WordNode &wn : batch)
+                fm->add_node(wn,graph.get_snapshot_shift(wn));
         }
+        batch.clear();
 
-        return rv;
+        //The copies point to words of the graph, they stay until the snapshot is closed
+        fm->finish();
+
+        {
+            std::lock_guard<std::mutex> guard(model.lock);
+            graph.end_snapshot();
+            model.snap_done.notify_all();
+        }
+
+        //Threads holding the last version keep it until they're done
+        std::atomic_store(&current,std::shared_ptr<const FrozenModel>(std::move(fm)));
+
+        return std::chrono::steady_clock::now()-t;
     }
 
-    //Read a left stop
-    bool ITextStream::read_L_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    //Start a new version if enough lines were learned, and the last one is done and far enough behind. The writer lock must be held
+    void LiveModel::end_lines(int count)
     {
-        std::string::const_iterator cpy=it;//Copy the start iterator
+        pending+=count;
+        if (publish_lines<=0||pending<publish_lines)
+            return;
 
-        if (it!=e)//If not at the end
+        //Still building the last one
+        if (building.valid())
         {
-            std::string c=read_utf8_character(it,e);//Read a one character string
-            auto item=Word::SPEC_CHAR.find(c);//Look for the chararcter
-            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::L_STOP)//If the character was found, and it was a L_STOP
-            {
-                w.set_all(c,WordType::L_STOP);//Set the word
-                return true;//Read a word
-            }
-            else//Character not detected, return it
-            {
-                return_utf8_string(c,it,cpy);
-            }
+            if (building.wait_for(std::chrono::seconds(0))!=std::future_status::ready)
+                return;
+            wait_version();
         }
 
-        return false;//Did not read a word
+        //Tried again after the next lines if it's too soon, or a snapshot is being written
+        if (std::chrono::steady_clock::now()>=next_start)
+            start_version();
     }
 
-    //Read a left delimiter
-    bool ITextStream::read_L_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    /*Read/write to file*/
+
+    //Read from file into an empty model, and publish it
+    void LiveModel::read(std::istream &i,unsigned threads)
     {
-        std::string::const_iterator cpy=it;//Copy the start iterator
+        std::lock_guard<std::mutex> guard(writer);
 
-        if (it!=e)//If not at the end
-        {
-            std::string c=read_utf8_character(it,e);//Read a one character string
-            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
-            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::L_DELIM)//If the character was found, and it was a L_DELIM
-            {
-                w.set_all(c,WordType::L_DELIM);//Set the word
-                return true;//Read a word
-            }
-            else//Character not detected, return it
-            {
-                return_utf8_string(c,it,cpy);
-            }
-        }
-        return false;//Did not read a word
+        wait_version();
+        model.read(i,threads);
+        make_version();
     }
 
-    //Read content
-    bool ITextStream::read_CONTENT(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    //Write the model as it is now to file
+    void LiveModel::write(std::ostream &o,unsigned threads)
     {
-        //Text to read
-        std::string word;
+        std::lock_guard<std::mutex> guard(writer);
 
-        //Word to be returned by auxiliary functions
-        Word rv("");
+        wait_version();
+        model.write(o,threads);
+    }
 
-        //Type of the word currently been set
-        WordType t=WordType::START;
-        bool trans=false;//Transitioning between states
+    /*
+        LearnPipeline
+    */
 
-        //Until the end has been reached
-        while(it!=e)
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, learn into a model with the given number of tokenizer threads (0 for one per core)
+    LearnPipeline::LearnPipeline(WordModel &m,unsigned ntokenizers,std::size_t nblock,std::size_t nin_flight)
+    :model(m),tokenizers(ntokenizers?ntokenizers:default_threads()),block(nblock?nblock:DEF_BLOCK),in_flight(nin_flight?nin_flight:DEF_IN_FLIGHT)
+    {}
+
+    /* Methods */
+
+    /*Learn*/
+
+    //Learn every non blank line of a stream. Return the number of lines learned, and add the bytes read
+    std::uint64_t LearnPipeline::learn(std::istream &i,std::uint64_t &bytes)
+    {
+        //Whole lines of the stream, or its end
+        struct Block
         {
-            //Check if it's the end of the word
-            std::string::const_iterator cpy=it;//Make a copy of the iterator, as to not modify it
-            if (read_R_DELIM(cpy,e,rv)||read_R_STOP(cpy,e,rv))//If you find a right stop or delimiter, stop reading words
-                break;
+            std::string text;
+            bool last=false;
+        };
 
-            //Try to read a character
-            std::string c=read_utf8_character(it,e);
-            if (c.empty())//Is it empty? Some error must've happened
+        //Words and links of part of a block, or the end of the stream. A block fills as many batches as it needs, the ones before the last marked with more
+        struct Counted
+        {
+            std::unique_ptr<BigramBatch> batch;
+            std::uint64_t lines=0;
+            std::size_t bytes=0;//Size of the block, on its last batch
+            bool more=false;
+            bool last=false;
+        };
+
+        //Blocks are dealt to the tokenizers in turn, and the batches taken back in the same turn, so they're learned in the order of the stream
+        const unsigned n=tokenizers;
+        std::vector< std::unique_ptr< SPSCQueue<Block> > > blocks;
+        std::vector< std::unique_ptr< SPSCQueue<Counted> > > batches;
+        for (unsigned k=0;k<n;++k)
+        {
+            blocks.emplace_back(new SPSCQueue<Block>(2));
+            batches.emplace_back(new SPSCQueue<Counted>(2));
+        }
+
+        std::uint64_t read=0;//Bytes read, only written by the reader
+
+        //Bytes of the blocks read but not learned yet. The reader adds a block before queuing it and the updater takes it away once its last batch is learned, so the budget holds for every stage and tokenizer at once
+        std::atomic<std::size_t> flight(0);
+
+        //Wait until a block fits in the budget. A block larger than the budget goes alone
+        auto admit=[&](std::size_t size)
+        {
+            for (int spins=0;;++spins)
             {
-                w.set_all(word+std::string(it,e),WordType::SYMBOL);//Everything's a symbol
-                return true;
+                std::size_t f=flight.load(std::memory_order_acquire);
+                if (!f||f+size<=in_flight)
+                    break;
+                if (spins<64)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
             }
-            else//A character was read, try to parse it
+            flight.fetch_add(size,std::memory_order_relaxed);
+        };
+
+        //Reader: cut the stream into blocks that end at a new line
+        std::thread reader([&]
+        {
+            std::vector<char> buf(block);
+            std::string carry;//Start of a line cut by the end of the last read
+            unsigned next=0;
+
+            for (;;)
             {
-                switch(t)//Switch based on type
+                i.read(buf.data(),buf.size());
+                std::size_t got=static_cast<std::size_t>(i.gcount());
+                if (!got)
+                    break;
+                read+=got;
+
+                std::size_t cut=got;
+                while (cut&&buf[cut-1]!='\n')
+                    --cut;
+
+                Block b;
+                b.text.swap(carry);
+                b.text.append(buf.data(),cut);
+                carry.assign(buf.data()+cut,got-cut);
+
+                if (cut)//At least a line is complete
                 {
-                    case WordType::START:
-                    {
-                        //Try to detect the type of word
+                    admit(b.text.size());
+                    blocks[next]->push(std::move(b));
+                    next=(next+1)%n;
+                }
+                else//A line longer than a block, keep reading it
+                    carry.insert(0,b.text);
+            }
 
-                        if//Text word
-                        (
-                            (Word::TXT_SEP.find(c)!=Word::TXT_SEP.end())//Text separator
-                            ||
-                            (//Character is a letter
-                                (c.size()==1)
-                                &&
-                                (std::isalpha(c[0]))
-                            )
-                        )
-                            t=WordType::WORD;//Detect it as a word
+            //The last line may not end with a new line
+            if (!carry.empty())
+            {
+                Block b;
+                b.text.swap(carry);
+                admit(b.text.size());
+                blocks[next]->push(std::move(b));
+                next=(next+1)%n;
+            }
 
-                        else if(c.size()==1&&std::isdigit(c[0]))//Integer
-                            t=WordType::INT;
+            //Every tokenizer gets the end, the first one in turn where the updater expects the next block
+            for (unsigned k=0;k<n;++k)
+            {
+                Block b;
+                b.last=true;
+                blocks[(next+k)%n]->push(std::move(b));
+            }
+        });
 
-                        break;
-                    }
+        //Tokenizers: count the lines of each block into a batch, each with its own cache of parsed tokens
+        std::vector<std::thread> pool;
+        for (unsigned k=0;k<n;++k)
+        {
+            pool.emplace_back([&,k]
+            {
+                TokenCache cache;
+                LineCounter counter;
 
-                    case WordType::WORD://Reading a word
-                    {
-                        if
-                        (
-                            !//Not a valid character
-                            (
-                                (Word::TXT_SEP.find(c)!=Word::TXT_SEP.end())//Text separator
-                                ||
-                                (//Character is a letter
-                                    (c.size()==1)
-                                    &&
-                                    (std::isalpha(c[0]))
-                                )
-                            )
-                        )
-                            t=WordType::SYMBOL;//Turn the word into a symbol
-                        break;
-                    }
+                for (;;)
+                {
+                    Block b=blocks[k]->pop();
 
-                    case WordType::INT://Integer
+                    Counted c;
+                    if (b.last)
                     {
-                        if (Word::NUM_SEP.find(c)!=Word::NUM_SEP.end())//Number separator
-                        {
-                            trans=true;//Transition to decimal. If this flag is on at the end, we know the transition didn't end
-                            t=WordType::DECIMAL;
-                        }
-                        else if (!(c.size()==1&&std::isdigit(c[0])))//If not a digit
-                            t=WordType::SYMBOL;
-                        break;
+                        c.last=true;
+                        batches[k]->push(std::move(c));
+                        return;
                     }
 
-                    case WordType::DECIMAL://Decimal number
+                    c.batch.reset(new BigramBatch());
+                    for (std::size_t p=0,e;p<b.text.size();p=e+1)
                     {
-                        if (c.size()==1&&std::isdigit(c[0]))//If it's a digit
-                        {
-                            //No longer transitioning
-                            trans=false;
-                        }
-                        else//Not a digit, turn to symbol
+                        e=b.text.find('\n',p);
+                        if (e==std::string::npos)
+                            e=b.text.size();
+
+                        if (e>p)//Don't read blank lines
                         {
-                            t=WordType::SYMBOL;
+                            counter.add(b.text.substr(p,e-p));
+                            ++c.lines;
+
+                            if (counter.full())
+                            {
+                                counter.fill(*c.batch,&cache);
+                                counter.clear();
+
+                                //Hand a full batch over and keep counting the block into a new one
+                                if (c.batch->full())
+                                {
+                                    Counted part;
+                                    part.batch.reset(new BigramBatch());
+                                    std::swap(part.batch,c.batch);
+                                    std::swap(part.lines,c.lines);
+                                    part.more=true;
+                                    batches[k]->push(std::move(part));
+                                }
+                            }
                         }
-
-                        break;
                     }
+                    counter.fill(*c.batch,&cache);
+                    counter.clear();
 
-                    default://No need to do anything specific for a symbol
-                        break;
+                    c.bytes=b.text.size();
+                    batches[k]->push(std::move(c));
                 }
-                word+=c;//Add the character to the word
+            });
+        }
+
+        //Updater: this thread learns the batches, the only stage touching the graph
+        std::uint64_t lines=0;
+        for (unsigned next=0;;)
+        {
+            Counted c=batches[next]->pop();
+            if (c.last)
+                break;
+
+            lines+=c.lines;
+            model.learn(*c.batch);
+
+            //The next batch of the stream is the rest of this block, or the next tokenizer's
+            if (!c.more)
+            {
+                c.batch.reset();
+                flight.fetch_sub(c.bytes,std::memory_order_release);
+                next=(next+1)%n;
             }
         }
 
-        //We're done. Check the type
-        if(trans)//If caught midtransitioning, degenerate to symbol
-            t=WordType::SYMBOL;
+        reader.join();
+        for (std::thread &th : pool)
+            th.join();
 
-        //Check if anything's been read
-        if(t==WordType::START)
-            return false;//Report it
+        bytes+=read;
+        return lines;
+    }
 
-        //All set. Return the word
-        w.set_all(word,t);
-        return true;
+    /*
+        LazyWordModel
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, set the number of decoded nodes kept in memory
+    LazyWordModel::LazyWordModel(std::size_t cache_size)
+    :file(),index(),words(),refs(),cache(cache_size)
+    {}
+
+    /* Methods */
+
+    /*File*/
+
+    //Open a model file, reading only its index. Return false if it couldn't be opened
+    bool LazyWordModel::open(const std::string &path)
+    {
+        //Forget the previous file
+        if (file.is_open())
+            file.close();
+        index.clear();
+        cache.clear();
+        refs.clear();
+        words.clear();
+
+        file.open(path,std::ios::in|std::ios::binary);
+        if (!file.is_open())
+            return false;
+
+        //Files written before the index existed are scanned once, keeping only the positions
+        if (!WordGraph::read_index(file,index))
+        {
+            int n=0;
+            file.read(reinterpret_cast<char *>(&n),sizeof(int));
+
+            while (n-->0&&file)
+            {
+                std::uint64_t off=file.tellg();
+
+                WordNode wn(nullptr);
+                wn.read(file,words);
+
+                index.emplace_back(wn.get_word().hash(),off);
+            }
+
+            std::sort(index.begin(),index.end());
+            words.clear();
+        }
+
+        bool rv=bool(file);
+        file.clear();
+        return rv;
     }
 
-    //Read a left stop
-    bool ITextStream::read_R_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    /*Speak*/
+
+    //Generate a line using the model
+    void LazyWordModel::think(OTextStream &ots)
     {
-        std::string::const_iterator cpy=it;//Copy the start iterator
+        Stats::Latency latency(Op::THINK);
 
-        if (it!=e)//If not at the end
+        WordNode *node=get_node(Word(WordType::START));//The first node to be processed is the start node
+
+        const Word end_word(WordType::END);
+
+        while(node&&node->get_word()!=end_word)//Until the end node is reached
         {
-            std::string c=read_utf8_character(it,e);//Read a one character string
-            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
-            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::R_DELIM)//If the character was found, and it was a L_DELIM
+            ots.write(node->get_word());//Print this node
+
+            //Advance to next. The word lives on the pool, the lookup may evict this node
+            node=get_node(node->get_next());
+        }
+
+        //Close the stream
+        ots.write(end_word);
+    }
+
+    /*Nodes*/
+
+    //Get a node, decoding it from file if not cached. nullptr if not found. Valid until the next call
+    WordNode* LazyWordModel::get_node(const Word &w)
+    {
+        //Already decoded
+        WordNode *node=cache.get(w);
+        if (node)
+            return node;
+
+        //The word may be on the pool, and released by an eviction, keep a copy
+        Word key(w);
+
+        //Find it on the file. Words with the same hash are told apart once decoded
+        auto range=std::equal_range(index.begin(),index.end(),std::make_pair(key.hash(),std::uint64_t(0)),[](const std::pair< std::size_t,std::uint64_t > &a,const std::pair< std::size_t,std::uint64_t > &b)
+        {
+            return a.first<b.first;
+        });
+
+        for (auto it=range.first;it!=range.second;++it)
+        {
+            //Decode it
+            file.clear();
+            file.seekg(it->second);
+
+            WordNode wn(nullptr);
+            wn.read(file,words);
+            hold(wn);
+
+            if (!file||wn.get_word()!=key)//Truncated or corrupt file, or another word with the same hash
             {
-                w.set_all(c,WordType::R_DELIM);//Set the word
-                return true;//Read a word
+                drop(wn);
+                if (!file)
+                    return nullptr;
+                continue;
             }
-            else//Character not detected, return it
+
+            //Make room, releasing the words only the evicted node held
+            if (cache.size()>=cache.capacity())
             {
-                return_utf8_string(c,it,cpy);
+                drop(*cache.last());
+                cache.pop();
             }
+
+            return cache.put(key,std::move(wn));
         }
-        return false;//Did not read a word
+
+        return nullptr;
     }
 
-    //Read a left stop
-    bool ITextStream::read_R_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w)
+    //Count the words of a node, and those it links to, as held by it
+    void LazyWordModel::hold(const WordNode &wn)
     {
-        std::string::const_iterator cpy=it;//Copy the start iterator
+        if (wn.w)
+            ++refs[wn.w];
 
-        if (it!=e)//If not at the end
+        for (const FrecLink *fl : {&wn.get_prev_links(),&wn.get_next_links()})
+            for (int k=0;k<fl->get_size();++k)
+                ++refs[fl->word_at(k)];
+    }
+
+    //Stop counting the words of a node as held by it, releasing those no other cached node holds
+    void LazyWordModel::drop(const WordNode &wn)
+    {
+        auto release=[&](const Word *w)
         {
-            std::string c=read_utf8_character(it,e);//Read a one character string
-            auto item=Word::SPEC_CHAR.find(c);//Look for the next chararcter
-            if (item!=Word::SPEC_CHAR.end() && item->second == WordType::R_STOP)//If the character was found, and it was a L_DELIM
-            {
-                w.set_all(c,WordType::R_STOP);//Set the word
-                return true;//Read a word
-            }
-            else//Character not detected, return it
+            auto it=refs.find(w);
+            if (it!=refs.end()&&--it->second==0)
             {
-                return_utf8_string(c,it,cpy);
+                refs.erase(it);
+                words.release(w);
             }
-        }
-        return false;//Did not read a word
+        };
+
+        if (wn.w)
+            release(wn.w);
+
+        for (const FrecLink *fl : {&wn.get_prev_links(),&wn.get_next_links()})
+            for (int k=0;k<fl->get_size();++k)
+                release(fl->word_at(k));
     }
 
     /*
-        OTextStream
+        LatencyHistogram
     */
 
     /* Constructors, copy control */
 
     /*Constructors*/
 
-    //Complete constructor
-    OTextStream::OTextStream(std::ostream &nos)
-    :os(nos),state(WordType::START)
+    //Default constructor, empty
+    LatencyHistogram::LatencyHistogram()
+    :counts(BUCKETS,0),n(0),sum(0),max(0)
     {}
 
     /* Methods */
 
-    /*Write*/
+    /*Recording*/
 
-    //Write a word to the stream
-    bool OTextStream::write(const Word &w)
+    //Add a value
+    void LatencyHistogram::record(std::uint64_t ns)
     {
-        //Check stream's state
-        if (state==WordType::END)//If the stream's closed
-        {
-            if (!(w.get_type()==WordType::END || w.get_type()==WordType::START))//If we aren't closing, or reopening the stream
-                return false;//Error!
-        }
+        ++counts[bucket(ns)];
+        ++n;
+        sum+=ns;
+        max=std::max(max,ns);
+    }
 
-        std::string s(w.get_text());//Text to be written, if any
+    //Add every value of another histogram
+    void LatencyHistogram::merge(const LatencyHistogram &h)
+    {
+        for (int b=0;b<BUCKETS;++b)
+            counts[b]+=h.counts[b];
+        n+=h.n;
+        sum+=h.sum;
+        max=std::max(max,h.max);
+    }
 
-        //Format will depend on the word to be written
-        switch(w.get_type())//Switch based on word type
+    //Values added since an earlier copy of this histogram
+    LatencyHistogram LatencyHistogram::since(const LatencyHistogram &before) const
+    {
+        LatencyHistogram rv;
+        for (int b=0;b<BUCKETS;++b)
+            rv.counts[b]=counts[b]-before.counts[b];
+        rv.n=n-before.n;
+        rv.sum=sum-before.sum;
+
+        //Only the largest of all is known exactly, the rest is bounded by their buckets
+        for (int b=BUCKETS-1;b>=0;--b)
         {
-            //Start of text
-            case WordType::START:
-            {
-                if (state==WordType::START)//If the stream is also at the start
-                    ;//No need to do a thing
-                else if (state==WordType::END)//If the stream is being reopened
-                    ;//No need to do a thing
-                else//Printing a start without the stream being closed/at the start, error
-                    return false;
-
-                break;
-            }
-
-            //End of text
-            case WordType::END:
+            if (rv.counts[b])
             {
-                //Stream ended, print newline
-                os<<'\n';
-
+                rv.max=std::min(max,highest(b));
                 break;
             }
+        }
 
-            //Content
-            case WordType::WORD:
-            case WordType::SYMBOL:
-            case WordType::INT:
-            case WordType::DECIMAL:
-            {
-                switch(state)//Print based on previous word
-                {
-                    //Upper+Space
-                    case WordType::R_STOP:
-                    {
-                        os<<' ';
-                        if (!s.empty()&&std::islower(s[0]))
-                            s[0]=std::toupper(s[0]);
-                        break;
-                    }
-
-                    //Upper
-                    case WordType::START:
-                    case WordType::L_STOP:
-                    {
-                        if (!s.empty()&&std::islower(s[0]))
-                            s[0]=std::toupper(s[0]);
-                        break;
-                    }
-
-                    //Space
-                    case WordType::WORD:
-                    case WordType::SYMBOL:
-                    case WordType::INT:
-                    case WordType::DECIMAL:
-                    case WordType::R_DELIM:
-                    {
-                        os<<' ';
-                        break;
-                    }
-
-                    //Nothing (or unknown status)
-                    case WordType::L_DELIM:
-                    default:
-                        break;
-                }
+        return rv;
+    }
 
-                //Now that the word is ready, print it
-                os<<s;
+    /*Buckets*/
 
-                break;
-            }
+    //Bucket of a value
+    int LatencyHistogram::bucket(std::uint64_t ns)
+    {
+        const std::uint64_t sub=std::uint64_t(1)<<SUB_BITS;
+
+        //Small values have a bucket each
+        if (ns<2*sub)
+            return static_cast<int>(ns);
+
+        //Position of the highest bit
+#if defined(__GNUC__)
+        int e=63-__builtin_clzll(ns);
+#else
+        int e=0;
+        while (ns>>(e+1))
+            ++e;
+#endif
+
+        //Then the bits below it pick one of the buckets of its power of 2
+        int shift=e-SUB_BITS;
+        return static_cast<int>((shift+1)*sub+(ns>>shift)-sub);
+    }
 
-            //Left delimiter
-            case WordType::L_DELIM:
-            case WordType::L_STOP:
-            {
-                switch (state)//Print based on previous word
-                {
-                    //Space
+    //Largest value of a bucket
+    std::uint64_t LatencyHistogram::highest(int b)
+    {
+        const int sub=1<<SUB_BITS;
 
-                    //After content
-                    case WordType::WORD:
-                    case WordType::SYMBOL:
-                    case WordType::INT:
-                    case WordType::DECIMAL:
-                    //After right delimiter
-                    case WordType::R_DELIM:
-                    case WordType::R_STOP:
-                    {
-                        os<<' ';
-                        break;
-                    }
+        if (b<2*sub)
+            return b;
 
-                    //Nothing
+        int shift=b/sub-1;
+        std::uint64_t lowest=static_cast<std::uint64_t>(b%sub+sub)<<shift;
+        return lowest+((std::uint64_t(1)<<shift)-1);
+    }
 
-                    //Other left delimiters
-                    case WordType::L_DELIM:
-                    case WordType::L_STOP:
-                    //Unknown
-                    default:
-                        break;
-                }
+    /*Queries*/
 
-                //Now that the word is ready, print it
-                os<<s;
+    //Mean of the values, 0 if there are none
+    double LatencyHistogram::get_mean() const
+    {
+        return n?static_cast<double>(sum)/n:0.0;
+    }
 
-                break;
-            }
+    //Value that p percent of the values are at or below, such as 99.9, as the largest value of its bucket. 0 if there are none
+    std::uint64_t LatencyHistogram::percentile(double p) const
+    {
+        if (!n)
+            return 0;
 
-            //Right delimiter
-            case WordType::R_DELIM:
-            case WordType::R_STOP:
-            {
-                //No formatting needed, just print it
-                os<<s;
-                break;
-            }
+        //Rank of the value, from 1
+        std::uint64_t rank=static_cast<std::uint64_t>(std::ceil(p/100.0*n));
+        rank=std::min(std::max<std::uint64_t>(rank,1),n);
 
-            //By default
-            default:
-            {
-                os<<s;//Just print the word
-                break;
-            }
+        std::uint64_t seen=0;
+        for (int b=0;b<BUCKETS;++b)
+        {
+            seen+=counts[b];
+            if (seen>=rank)
+                return std::min(highest(b),max);
         }
 
-        //Update the stream's status
-        state=w.get_type();
+        return max;
+    }
 
-        //No error, return true
-        return true;
+    //Write the count, mean, p50, p90, p99, p999 and max on a line, as name=value pairs in microseconds
+    void LatencyHistogram::write(std::ostream &o) const
+    {
+        //Formatted on its own stream, so the one given keeps its flags
+        std::ostringstream ss;
+        ss.setf(std::ios::fixed);
+        ss.precision(1);
+
+        ss<<"count="<<n
+          <<" mean="<<get_mean()/1e3
+          <<" p50="<<percentile(50)/1e3
+          <<" p90="<<percentile(90)/1e3
+          <<" p99="<<percentile(99)/1e3
+          <<" p999="<<percentile(99.9)/1e3
+          <<" max="<<get_max()/1e3;
+
+        o<<ss.str();
     }
 
     /*
-        WordModel
+        Stats
     */
 
     /* Constructors, copy control */
 
     /*Constructors*/
 
-    //Default constructor
-    WordModel::WordModel()
-    :graph()
+    //Default constructor, every counter at 0, and no latencies
+    Stats::Stats()
+    :totals(),latencies()
     {}
 
+    //Register them, starting at 0
+    Stats::Local::Local()
+    :buckets(static_cast<int>(Op::COUNT)*LatencyHistogram::BUCKETS)
+    {
+        for (std::atomic<std::uint64_t> &x : v)
+            x.store(0,std::memory_order_relaxed);
+        for (std::atomic<std::uint64_t> &x : buckets)
+            x.store(0,std::memory_order_relaxed);
+        for (std::atomic<std::uint64_t> &x : sums)
+            x.store(0,std::memory_order_relaxed);
+        for (std::atomic<std::uint64_t> &x : maxes)
+            x.store(0,std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(threads_lock);
+        threads.push_back(this);
+    }
+
+    //Keep them on the totals of finished threads, and unregister them
+    Stats::Local::~Local()
+    {
+        std::lock_guard<std::mutex> guard(threads_lock);
+
+        finished.gather(*this);
+        threads.erase(std::find(threads.begin(),threads.end(),this));
+    }
+
     /* Methods */
 
-    /*Learn*/
+    /*Counting*/
 
-    //Learn from a text stream
-    void WordModel::learn(ITextStream &ts)
+    //Check if the library counts, that is, if it was built with TEXTGUN_STATS
+    bool Stats::enabled()
     {
-        //Load the first word
-        if (ts.has_words())
-        {
-            Word w=ts.read();//Word to be processed
-            graph.add_word(w);//Add it to the graph
+#ifdef TEXTGUN_STATS
+        return true;
+#else
+        return false;
+#endif
+    }
 
-            //Read the rest on a loop
-            Word prev=w;//Previous word to be processed
+    /*Latencies*/
 
-            //While the stream has words
-            while (ts.has_words())
-            {
-                //Read the word
-                w=ts.read();
+    //Record a latency of an operation on this thread
+    void Stats::record(Op op,std::uint64_t ns)
+    {
+        Local &l=local();
 
-                //Add the word
-                graph.add_word(w);
+        //Only this thread writes them, so a plain load and store are enough
+        std::atomic<std::uint64_t> &b=l.buckets[static_cast<int>(op)*LatencyHistogram::BUCKETS+LatencyHistogram::bucket(ns)];
+        b.store(b.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
 
-                //Add the links
-                graph.add_link(prev,w);
+        std::atomic<std::uint64_t> &s=l.sums[static_cast<int>(op)];
+        s.store(s.load(std::memory_order_relaxed)+ns,std::memory_order_relaxed);
 
-                //Store the current word on previous
-                prev=w;
-            }
-        }
+        std::atomic<std::uint64_t> &m=l.maxes[static_cast<int>(op)];
+        if (ns>m.load(std::memory_order_relaxed))
+            m.store(ns,std::memory_order_relaxed);
     }
 
-    /*Speak*/
+    /*Totals*/
 
-    //Generate a line using the model
-    void WordModel::think(OTextStream &ots)
+    //Add up the counters and latencies of every thread since the last reset, finished threads included
+    Stats Stats::collect()
     {
-        //Make sure the start and end node exist
+        std::lock_guard<std::mutex> guard(threads_lock);
 
-        if (!graph.check_word(Word(WordType::START)))
-            graph.add_word(Word(WordType::START));
+        return total().since(base);
+    }
 
-        if (!graph.check_word(Word(WordType::END)))
-            graph.add_word(Word(WordType::END));
+    //Start again from 0: later collects leave out everything recorded until now
+    void Stats::reset()
+    {
+        std::lock_guard<std::mutex> guard(threads_lock);
 
-        WordNode *node=graph.get_node(Word(WordType::START));//The first node to be processed is the start node
+        base=total();
+    }
 
-        const Word end_word(WordType::END);
+    //Get the value of a counter
+    std::uint64_t Stats::get(Counter c) const
+    {
+        return totals[static_cast<int>(c)];
+    }
 
+    //Get the latencies of an operation
+    const LatencyHistogram& Stats::get(Op op) const
+    {
+        return latencies[static_cast<int>(op)];
+    }
 
-        while(node&&node->get_word()!=end_word)//Until the end node is reached
+    //Counts and latencies since an earlier collect
+    Stats Stats::since(const Stats &before) const
+    {
+        Stats rv;
+        for (int k=0;k<static_cast<int>(Counter::COUNT);++k)
+            rv.totals[k]=totals[k]-before.totals[k];
+        for (int k=0;k<static_cast<int>(Op::COUNT);++k)
+            rv.latencies[k]=latencies[k].since(before.latencies[k]);
+        return rv;
+    }
+
+    //Write every counter on a line, as name=value pairs separated by spaces
+    void Stats::write(std::ostream &o) const
+    {
+        for (int k=0;k<static_cast<int>(Counter::COUNT);++k)
         {
-            ots.write(node->get_word());//Print this node
+            if (k)
+                o<<' ';
+            o<<name(static_cast<Counter>(k))<<'='<<totals[k];
+        }
+    }
 
-            //Advance to next
-            node=graph.get_node(node->get_next());
+    //Write a line for each operation with any latencies, starting with its name
+    void Stats::write_latencies(std::ostream &o) const
+    {
+        for (int k=0;k<static_cast<int>(Op::COUNT);++k)
+        {
+            if (!latencies[k].get_count())
+                continue;
+
+            o<<name(static_cast<Op>(k))<<": ";
+            latencies[k].write(o);
+            o<<'\n';
         }
+    }
 
-        //Close the stream
-        ots.write(end_word);
+    //Name of a counter, such as "tokens"
+    const char* Stats::name(Counter c)
+    {
+        switch (c)
+        {
+            case Counter::TOKENS: return "tokens";
+            case Counter::TOKENIZE_NS: return "tokenize_ns";
+            case Counter::LOOKUPS: return "lookups";
+            case Counter::LOOKUP_NS: return "lookup_ns";
+            case Counter::NODES_ADDED: return "nodes_added";
+            case Counter::LINKS_ADDED: return "links_added";
+            case Counter::LINKS_INSERTED: return "links_inserted";
+            case Counter::REORDER_SWAPS: return "reorder_swaps";
+            case Counter::REORDER_DISTANCE: return "reorder_distance";
+            case Counter::PICKS: return "picks";
+            case Counter::PICK_DEPTH: return "pick_depth";
+            case Counter::SUM_REBUILDS: return "sum_rebuilds";
+            case Counter::BYTES_READ: return "bytes_read";
+            case Counter::BYTES_WRITTEN: return "bytes_written";
+            case Counter::LINES_LEARNED: return "lines_learned";
+            case Counter::LINES_GENERATED: return "lines_generated";
+            default: return "unknown";
+        }
     }
 
-    /*Read/write to file*/
+    //Name of an operation, such as "think"
+    const char* Stats::name(Op op)
+    {
+        switch (op)
+        {
+            case Op::THINK: return "think";
+            case Op::LEARN: return "learn";
+            case Op::LEARN_BATCH: return "learn_batch";
+            case Op::PUBLISH: return "publish";
+            case Op::READ: return "read";
+            case Op::WRITE: return "write";
+            default: return "unknown";
+        }
+    }
 
-    //Write to file
-    void WordModel::write(std::ostream &o) const
+    //Add the counters and latencies of a thread
+    void Stats::gather(const Local &l)
     {
-        graph.write(o);
+        for (int k=0;k<static_cast<int>(Counter::COUNT);++k)
+            totals[k]+=l.v[k].load(std::memory_order_relaxed);
+
+        for (int k=0;k<static_cast<int>(Op::COUNT);++k)
+        {
+            LatencyHistogram &h=latencies[k];
+            for (int b=0;b<LatencyHistogram::BUCKETS;++b)
+            {
+                std::uint64_t c=l.buckets[k*LatencyHistogram::BUCKETS+b].load(std::memory_order_relaxed);
+                h.counts[b]+=c;
+                h.n+=c;
+            }
+            h.sum+=l.sums[k].load(std::memory_order_relaxed);
+            h.max=std::max(h.max,l.maxes[k].load(std::memory_order_relaxed));
+        }
     }
 
-    //Read from file
-    void WordModel::read(std::istream &i)
+    //Everything recorded by every thread since the start. The lock must be held
+    Stats Stats::total()
     {
-        graph.read(i);
+        Stats rv=finished;
+        for (const Local *l : threads)
+            rv.gather(*l);
+        return rv;
     }
 
 }//End of namespace
@@ -50,6 +50,29 @@
 #include <ostream>//Writing to file
 #include <istream>//Reading from file
 #include <cctype>//Char functions
+#include <mutex>//Locks
+#include <condition_variable>//Waiting for background snapshots
+#include <future>//Background tasks
+#include <memory>//Smart pointers
+#include <fstream>//File streams
+#include <vector>//Vectors
+#include <cstdint>//Fixed width integers
+#include <algorithm>//Algorithms
+#include <thread>//Threads
+#include <atomic>//Atomic counters
+#include <functional>//Hashing
+#include <cstring>//Raw memory copies
+#include <memory_resource>//Arenas
+#include <unordered_set>//Hash sets
+#include <unordered_map>//Hash maps
+#include <queue>//Priority queues
+#include <climits>//Limits of integers
+#include <bitset>//Bit counting
+#if defined(__SSE2__)
+#include <immintrin.h>//Vector instructions
+#endif
+#include <iterator>//Iterator helpers
+#include <cmath>//Square roots
 
 /* Defines */
 
@@ -67,18 +90,64 @@ namespace TextGun
 
     class Word;//Stores a word, indicates if it's special
 
+    struct WordHash;//Hash of a Word, for unordered containers
+
+    struct WordPtrLess;//Orders pointers to words by the words they point to
+
+    class WordPool;//Stores each distinct word once, at a fixed address
+
+    class CounterArray;//Compact counters that widen when a value doesn't fit
+
     class FrecLink;//Array of links to nodes sorted based on their frecuencyclass FrecLink;//Array of links to nodes sorted based on their frecuency
 
     class WordNode;//Node for a word, frecuency and links on both directions
 
+    class PrunePolicy;//Thresholds used to drop rare words and links from a graph
+
+    class CountMinSketch;//Fixed size table of approximate counts for a stream of keys
+
+    class LockedResource;//Memory resource that serializes the calls to another one, so threads can share it
+
+    class WorkerPool;//Threads kept waiting for work, so each job doesn't start new ones
+
     class WordGraph;//Contains the WordNodes, indexed by their Word
 
+    class TokenCache;//Remembers how raw tokens were split into words
+
     class ITextStream;//Provides the Words from a input stream
 
+    class BigramBatch;//Words and links of a block of text, counted before they're learned
+
+    class LineCounter;//Distinct lines of a block of text, and how many times each was seen
+
+    class CorpusGenerator;//Reproducible synthetic text, with words following Zipf's law
+
     class OTextStream;//Outputs words to a output stream
 
     class WordModel;//Model capable of learning and speaking
 
+    class WordWalker;//Generates a line from a model one word at a time, as it's asked for
+
+    class FrozenModel;//Immutable version of a model, generates lines without locks
+
+    class LiveModel;//Learns and generates at once: lines come from the last published version of the model
+
+    template<class T> class SPSCQueue;//Bounded lock-free queue from one producer thread to one consumer thread
+
+    class LearnPipeline;//Learns a stream in stages: a reader thread, tokenizer threads, and the graph updater
+
+    template<class K,class V> class LRUCache;//Bounded cache, evicts the least recently used entries
+
+    class LazyWordModel;//Read-only model that loads its nodes from file as they're needed
+
+    enum class Counter : int;//Events counted on the hot paths
+
+    enum class Op : int;//Operations whose latency is measured
+
+    class LatencyHistogram;//Latencies of an operation, in log-linear buckets
+
+    class Stats;//Counters and latencies of every thread, added up. Counters are only counted when built with TEXTGUN_STATS
+
     /*
         Function prototypes
     */
@@ -93,6 +162,14 @@ namespace TextGun
     //Return a string to another (purely based on size)
     bool return_utf8_string(std::string s,std::string::const_iterator &it,std::string::const_iterator e);
 
+    /* Threads */
+
+    //Number of threads to use when 0 is requested: one per core
+    unsigned default_threads();
+
+    //Call fn(k) for every k in [0,count), spread over the given number of threads (0 for one per core)
+    template<class F> void parallel_for(int count,unsigned threads,F fn);
+
     /*
         Data types
      */
@@ -172,6 +249,12 @@ namespace TextGun
             //Inequality operator
             bool operator!=(const Word &w) const;
 
+        /*Hashing*/
+        public:
+
+            //Hash of the text and type
+            std::size_t hash() const;
+
         /* Methods */
 
         /*Get/set*/
@@ -231,346 +314,2586 @@ namespace TextGun
 
     };
 
-    //List of links to nodes sorted based on their frecuency
-    class FrecLink
+    //Hash of a Word, for unordered containers
+    struct WordHash
+    {
+        std::size_t operator()(const Word &w) const
+        {
+            return w.hash();
+        }
+    };
+
+    //Orders pointers to words by the words they point to
+    struct WordPtrLess
+    {
+        bool operator()(const Word *a,const Word *b) const
+        {
+            return *a<*b;
+        }
+    };
+
+    //Stores each distinct word once, at a fixed address, so links can point to it instead of holding a copy. Each stored word can point to the node that holds it, so following a link needs no lookup
+    class WordPool
     {
         /* Config */
 
-        /*Random*/
+        /*Types*/
         private:
 
-            //Random engine
-            static std::default_random_engine re;
+            //Stored word, and the node that holds it
+            struct Entry : public Word
+            {
+                mutable WordNode *node;//Node of the word, nullptr if it has none
+
+                explicit Entry(const Word &w)
+                :Word(w),node(nullptr)
+                {}
+            };
 
         /* Attributes */
 
-        /*Links*/
+        /*Memory*/
         private:
 
-            //Lists of words and their frecuency
-            std::list< std::pair< int,Word > > words;
-
-            //Dictionary that stores the position of each word on the list
-            std::map< Word,std::list< std::pair< int,Word > >::iterator > dict;
+            std::pmr::monotonic_buffer_resource arena;//Grows in blocks, which are only returned all at once
+            std::pmr::unsynchronized_pool_resource pool;//Reuses the entries of released words, taken from the arena
 
-            //Total number of words (sum of frec)
-            int f;
+        /*Words*/
+        private:
 
-            //Total number of links
-            int n;
+            std::pmr::unordered_set< Entry,WordHash > words;//Every word, once
+            mutable std::mutex lock;//Words can be added from several threads while reading
 
         /* Constructors, copy control */
 
         /*Constructors*/
         public:
 
-            //Default constructors
-            FrecLink();
+            //Default constructor
+            WordPool();
+
+        /*Copy control*/
+        public:
+
+            //Pointers to the words would be lost
+            WordPool(const WordPool &wp)=delete;
+            WordPool& operator=(const WordPool &wp)=delete;
 
         /* Methods */
 
-        /*Add/delete*/
+        /*Words*/
         public:
 
-            //Add a word to the list
-            void add_word(const Word &w);
+            //Get the stored copy of a word, adding it if needed. Can be called from several threads
+            const Word* intern(const Word &w);
 
-        private:
+            //Get the stored copy of a word, nullptr if it isn't stored
+            const Word* find(const Word &w) const;
 
-            //Take an iterator to a word on the list, and return another word to swap them so that the list is still sorted. Return the same iterator if no swap is needed
-             std::list< std::pair< int,Word > >::iterator keep_sorted_swap(const std::list< std::pair< int,Word > >::iterator &it) const;
+            //Drop a word. Nothing can point to it anymore
+            void release(const Word *w);
 
-        /*Links*/
-        public:
+            //Number of words
+            int size() const;
 
-            //Get a random word based on frecuency
-            Word get_rand() const;
+            //Drop every word, returning all the memory at once. Nothing can point to them anymore
+            void clear();
 
-        /*Read/write to file*/
+        /*Nodes*/
         public:
 
-            //Write word to stream
-            void write(std::ostream &o) const;
+            //Get the node of a stored word, nullptr if it has none. The word must be stored on a pool
+            static WordNode* get_node(const Word *w)
+            {
+                return static_cast<const Entry*>(w)->node;
+            }
 
-            //Read word to stream
-            void read(std::istream &i);
+            //Set the node of a stored word, nullptr if it has none. The word must be stored on a pool
+            static void set_node(const Word *w,WordNode *node)
+            {
+                static_cast<const Entry*>(w)->node=node;
+            }
     };
 
-    //Node for a word, frecuency and links on both directions
-    class WordNode
+    //Array of counters of 1, 2 or 4 bytes each, all of the same size, widened when a value doesn't fit
+    class CounterArray
     {
-        /* Attributes */
+        /* Config */
 
-        /*Links*/
-        private:
+        /*Values*/
+        public:
 
-            FrecLink prev,next;//Links to the wordnodes found before this one, and after this one
+            //Largest value held exactly by a 2 byte counter. Past it, 2 byte counters hold values with 12 significant bits
+            static const int EXACT_16;
 
-        /*Data*/
-        public:
+        /* Attributes */
 
-            //Data of this node
+        /*Counters*/
+        private:
 
-            Word w;//Word stored on this node
-            int f;//Frecuency of this word
+            std::pmr::vector<std::uint8_t> data;//Encoded counters, one after another
+            int width;//Bytes per counter
 
         /* Constructors, copy control */
 
         /*Constructors*/
         public:
 
-            //Complete constructor
-            WordNode(const Word &nw);
-
-        /* Methods */
-
-        /*Links*/
-        public:
-
-            //Add a link
-
-            //Add a link to a previous word
-            void add_prev(const Word &w);
-
-            //Add a link to a next word
-            void add_next(const Word &w);
-
-            //Get a random word
+            //Default constructor, 1 byte counters allocated from the given memory
+            CounterArray(std::pmr::memory_resource *mr=std::pmr::get_default_resource());
 
-            //Get a random previous word
-            Word get_prev() const;
+            //Copy constructor, allocating from the given memory
+            CounterArray(const CounterArray &ca,std::pmr::memory_resource *mr);
 
-            //Get a random next word
-            Word get_next() const;
+        /* Methods */
 
-        /*Word*/
+        /*Get/set*/
         public:
 
-            //Increase frecuency
-            void inc_frec();
+            //Number of counters
+            int size() const
+            {
+                return static_cast<int>(data.size())/width;
+            }
 
-            //Get word
-            const Word& get_word() const
+            //Bytes per counter
+            int get_width() const
             {
-                return w;
+                return width;
             }
 
-        /*Read/write to file*/
-        public:
+            //Get the value of a counter
+            int get(int k) const;
 
-            //Write to file
-            void write(std::ostream &o) const;
+            //Set the value of a counter, widening every counter if it doesn't fit
+            void set(int k,int v);
 
-            //Read from file
-            void read(std::istream &i);
+        /*Add/delete*/
+        public:
 
-    };
+            //Add a counter at the end
+            void push_back(int v);
 
+            //Remove the last counter
+            void pop_back();
 
-    //Contains the WordNodes, indexed by their Word
-    class WordGraph
-    {
-        /* Attributes */
+            //Add count counters of another array at the end, starting from its counter from
+            void append(const CounterArray &ca,int from,int count);
 
-        /*Nodes*/
-        private:
+            //Swap two counters
+            void swap(int a,int b);
 
-            std::map< Word,WordNode > nodes;//Nodes indexed by their word
-            int n;//Number of nodes
+            //Remove every counter
+            void clear();
 
-        /* Constructors, copy control */
+            //Use the narrowest counters that hold every value
+            void shrink();
 
-        /*Constructors*/
+        /*Values*/
         public:
 
-            //Default constructor
-            WordGraph();
+            //Gap between a value and the next one a 2 byte counter holds. Counting by this gap with a probability of 1/gap (Morris counting) keeps hot links on 2 bytes
+            static int step(int v);
 
-        /* Methods */
+        private:
 
-        /*Nodes*/
-        public:
+            //Narrowest counter that holds a value
+            static int width_for(int v);
 
-            //Check if a word exists (as a node in the graph)
-            bool check_word(const Word &w);
+            //Encode a value for a counter of width bytes. It must fit
+            static std::uint32_t encode(int v,int w);
 
-            //Add a word to the node, increase its frecuency if it exists
-            void add_word(const Word &w);
+            //Decode a counter of width bytes
+            static int decode(std::uint32_t c,int w);
 
-            //Get a node by pointer, nullptr if not found
-            WordNode* get_node(const Word &w);
+            //Re-encode every counter with a new width
+            void rewiden(int w);
+    };
 
-        /*Links*/
-        public:
+    //List of links to nodes sorted based on their frecuency
+    class FrecLink
+    {
+        /* Config */
 
-            //Add a link between two nodes
-            void add_link(const Word &prev, const Word &next);
+        /*Random*/
+        private:
 
-        /*Read/write to file*/
-        public:
+            //Random engine
+            static std::default_random_engine re;
 
-            //Write to file
-            void write(std::ostream &o) const;
+        /*Lookup*/
+        private:
 
-            //Read from file
-            void read(std::istream &i);
-    };
+            //Lists with more words than this keep a dictionary with their positions. Shorter ones are searched
+            static const int DICT_MIN;
 
-    //Provides the Words from a input stream
-    class ITextStream
-    {
-        /* Config */
+        /*Sampling*/
+        private:
+
+            //Lists with up to this many words are sampled by counting the cumulative frecuencies below the drawn number, all at once. Longer ones are searched
+            static const int SMALL_DEGREE;
 
         /*Types*/
         private:
 
-            enum class StreamState
+            //Cumulative frecuencies, as if they had been divided by 2^shift
+            struct Sums
             {
-                START,//Feed start word
-                TEXT,//Feed text words from the stream
-                END,//Feed end word
-                EMPTY//Stream is empty, will not provide more words
+                std::pmr::vector<int> cum;//Sum of the frecuencies up to each word, padded to a multiple of 8 with the largest int
+                unsigned int shift;//Shift they were computed with
+
+                Sums(std::pmr::memory_resource *mr)
+                :cum(mr),shift(0)
+                {}
             };
 
-        /*Defaults*/
+        /*Special words*/
         private:
 
-            //Word to be returned if an error arises during reading
-            static const Word DEF_ERR_WORD;
+            //Word returned when there's nothing to pick
+            static const Word END_WORD;
 
         /* Attributes */
 
-        /*Stream*/
+        /*Links*/
         private:
 
-            //Input stream
-            std::istream &is;
+            //Words, sorted by their frecuency, most frecuent first. They point to the words stored by a WordPool, so they're compared by address
+            std::pmr::vector<const Word*> words;
 
-            //Status of the stream
-            StreamState status;
+            //Frecuency of each word
+            CounterArray frecs;
 
-            //Next word to be fed
-            std::list<Word> nw;
+            //Dictionary that stores the position of each word on the list, only for long lists
+            std::unique_ptr< std::pmr::map< const Word*,int > > dict;
+
+            //Total number of words (sum of frec)
+            int f;
+
+            //Cumulative frecuencies, computed on the first pick after the list changes
+            mutable std::unique_ptr<Sums> sums;
 
         /* Constructors, copy control */
 
         /*Constructors*/
         public:
 
-            //Complete constructor
-            ITextStream(std::istream &nis);
-
-        /* Methods */
+            //Default constructors, allocating from the given memory
+            FrecLink(std::pmr::memory_resource *mr=std::pmr::get_default_resource());
 
-        /*Stream*/
+        /*Copy control*/
         public:
 
-            //Loads the next words from the stream, returns if the stream is ready. Must be called after every read
-            bool has_words();
+            //Copy constructor
+            FrecLink(const FrecLink &fl);
 
-            //Return the last word read from the stream
-            Word read();
+            //Copy constructor, allocating from the given memory
+            FrecLink(const FrecLink &fl,std::pmr::memory_resource *mr);
 
-        /*Parsing*/
-        private:
+            //Copy assignment
+            FrecLink& operator=(const FrecLink &fl);
 
-            /*Read a word, or a part of it. Return true if you read what expected, false otherwise. Return the readen word*/
+            //Move constructor
+            FrecLink(FrecLink &&fl)=default;
 
-            //Fill the queue with words from a text separated by whitespàce
-            bool read_word(std::string s);
+            //Move assignment
+            FrecLink& operator=(FrecLink &&fl)=default;
 
-            //Read whitespace
-            bool read_WS(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+        /* Methods */
 
-            //Read a left stop
-            bool read_L_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+        /*Add/delete*/
+        public:
 
-            //Read a left delimiter
-            bool read_L_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+            //Add a word to the list, count times
+            void add_word(const Word *w,int count=1);
 
-            //Read content
-            bool read_CONTENT(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+            //Remove a word from the list. Return false if it wasn't on it
+            bool remove_word(const Word *w);
 
-            //Read a right delimiter
-            bool read_R_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+            //Remove the words seen fewer than min_count times, and those past the top_k most frecuent (0 for no limit). Store the removed words
+            void prune(int min_count,int top_k,std::vector<const Word*> &removed);
 
-            //Read a right stop
-            bool read_R_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
-    };
+            //Check if prune would remove any word, without changing the list
+            bool would_prune(int min_count,int top_k) const;
 
-    //Outputs words to a output stream
-    class OTextStream
-    {
+            //Remove every word, storing them
+            void clear(std::vector<const Word*> &removed);
 
-        /* Attributes */
+            //Add count words of another list at the end, starting from its position from, with their frecuencies. The copy takes the total of the other list and has no dictionary: it's only meant to be written, like the copies snapshots take
+            void append(const FrecLink &fl,int from,int count);
 
-        /*Stream*/
-        private:
+        /*Decay*/
+        public:
 
-            //Output stream
-            std::ostream &os;
+            //Divide every frecuency by 2^shift, removing the words that reach zero. Store the removed words
+            void decay(unsigned int shift,std::vector<const Word*> &removed);
 
-            //Status of the stream, previously printed word
-            WordType state;
+            //Value of a frecuency after dividing it by 2^shift
+            static int decayed(int c,unsigned int shift)
+            {
+                return shift<31?(c>>shift):0;
+            }
 
-        /* Constructors, copy control */
+        private:
 
-        /*Constructors*/
-        public:
+            //Position of a word on the list, -1 if it isn't on it
+            int find(const Word *w) const;
 
-            //Complete constructor
-            OTextStream(std::ostream &nos);
+            //End of the run of words with the same frecuency as the one at k
+            int run_end(int k) const;
 
-        /* Methods */
+            //Update the dictionary with the position of a word
+            void place(int k);
 
-        /*Write*/
-        public:
+            //Increase the frecuency of a word, moving it up so that the list is still sorted
+            void raise(int k,int count);
 
-            //Write a word to the stream
-            bool write(const Word &w);
-    };
+            //Remove the last word, storing it
+            void pop_back(std::vector<const Word*> &removed);
 
-    //Model capable of learning and speaking
-    class WordModel
-    {
-        /* Attributes */
+            //Create or drop the dictionary, depending on the length of the list
+            void update_dict();
 
-        /*Nodes*/
+        /*Sampling*/
         private:
 
-            WordGraph graph;//Graph to be trained and to generate sentences
+            //Cumulative frecuencies, as if they had been divided by 2^shift, computing them if needed
+            const Sums& get_sums(unsigned int shift) const;
 
-        /* Constructors, copy control */
+            //Number of cumulative frecuencies not above x, from a list padded to a multiple of 8. Compares several at once where the CPU can
+            static int count_not_above(const int *cum,int size,int x);
 
-        /*Constructors*/
+        /*Links*/
         public:
 
-            //Default constructor
-            WordModel();
+            //Get a random word based on frecuency, as if they had been divided by 2^shift. END if there's nothing to pick
+            const Word& get_rand(unsigned int shift=0) const;
 
-        /* Methods */
+            //Get a random word based on frecuency, as if they had been divided by 2^shift, as stored on its pool. nullptr if there's nothing to pick. Not thread safe: the first pick after a change computes the cumulative frecuencies
+            const Word* pick(unsigned int shift=0) const;
 
-        /*Learn*/
-        public:
+            //Get a random word based on frecuency, as if they had been divided by 2^shift, drawn with the given engine. nullptr if there's nothing to pick
+            const Word* pick(unsigned int shift,std::default_random_engine &eng) const;
 
-            //Learn from a text stream
-            void learn(ITextStream &ts);
+            //Check if there are no links
+            bool empty() const
+            {
+                return words.empty();
+            }
 
-        /*Speak*/
-        public:
+            //Check if a word is on the list
+            bool has_word(const Word *w) const
+            {
+                return find(w)>=0;
+            }
 
-            //Generate a line using the model
-            void think(OTextStream &ots);
+            //Frecuency of a word, 0 if it isn't on the list
+            int get_frec(const Word *w) const;
 
-        /*Read/write to file*/
-        public:
+            //Number of words on the list
+            int get_size() const
+            {
+                return static_cast<int>(words.size());
+            }
 
-            //Write to file
-            void write(std::ostream &o) const;
+            //Word at position k, the most frecuent first
+            const Word* word_at(int k) const
+            {
+                return words[k];
+            }
 
-            //Read from file
-            void read(std::istream &i);
-    };
+            //Frecuency of the word at position k
+            int frec_at(int k) const
+            {
+                return frecs.get(k);
+            }
+
+            //Least frecuent word. The list can't be empty
+            const Word* least_word() const
+            {
+                return words.back();
+            }
+
+            //Frecuency of the least frecuent word. The list can't be empty
+            int least_frec() const
+            {
+                return frecs.get(frecs.size()-1);
+            }
+
+        /*Read/write to file*/
+        public:
+
+            //Write word to stream, as if the frecuencies had been divided by 2^shift
+            void write(std::ostream &o,unsigned int shift=0) const;
+
+            //Read word to stream, storing the words on a pool
+            void read(std::istream &i,WordPool &pool);
+    };
+
+    //Node for a word, frecuency and links on both directions
+    class WordNode
+    {
+        /* Attributes */
+
+        /*Links*/
+        private:
+
+            FrecLink prev,next;//Links to the wordnodes found before this one, and after this one
+
+        /*Data*/
+        public:
+
+            //Data of this node
+
+            const Word *w;//Word stored on this node, on the WordPool of its graph
+            int f;//Frecuency of this word
+
+        /*Snapshot*/
+        public:
+
+            //Stamps used by WordGraph to build consistent snapshots. Not stored on file
+
+            unsigned int born;//Snapshot epoch in which this node was created
+            unsigned int saved;//Last snapshot epoch for which the old version of this node was preserved
+
+        /*Decay*/
+        public:
+
+            unsigned int stamp;//Decay epoch the frecuencies of this node are up to date with. Set by WordGraph
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, the links allocate from the given memory
+            WordNode(const Word *nw,std::pmr::memory_resource *mr=std::pmr::get_default_resource());
+
+            //Copy constructor, the links allocate from the given memory. The next words are allocated first, they're the ones walked
+            WordNode(const WordNode &wn,std::pmr::memory_resource *mr);
+
+        /* Methods */
+
+        /*Links*/
+        public:
+
+            //Add a link
+
+            //Add a link to a previous word, count times
+            void add_prev(const Word *w,int count=1);
+
+            //Add a link to a next word, count times
+            void add_next(const Word *w,int count=1);
+
+            //Get the links to next words
+            const FrecLink& get_next_links() const
+            {
+                return next;
+            }
+
+            //Get the links to previous words
+            const FrecLink& get_prev_links() const
+            {
+                return prev;
+            }
+
+            //Get a random word
+
+            //Get a random previous word, as if the frecuencies had been divided by 2^shift
+            const Word& get_prev(unsigned int shift=0) const;
+
+            //Get a random next word, as if the frecuencies had been divided by 2^shift
+            const Word& get_next(unsigned int shift=0) const;
+
+            //Get the node of a random next word, as if the frecuencies had been divided by 2^shift. Follows the link, no lookup needed. nullptr if there's nothing to pick or the word has no node
+            WordNode* get_next_node(unsigned int shift=0) const;
+
+            //Get the node of a random next word, as if the frecuencies had been divided by 2^shift, drawn with the given engine
+            WordNode* get_next_node(unsigned int shift,std::default_random_engine &eng) const;
+
+            //Check if the node has no links
+            bool empty() const
+            {
+                return prev.empty()&&next.empty();
+            }
+
+            //Remove a link
+
+            //Remove the link to a previous word
+            void remove_prev(const Word *w);
+
+            //Remove the link to a next word
+            void remove_next(const Word *w);
+
+            //Drop the links to next words seen fewer than min_count times, or past the top_k most frecuent (0 for no limit). Store the words dropped
+            void prune_next(int min_count,int top_k,std::vector<const Word*> &dropped);
+
+            //Check if prune_next would drop any link, without changing the node
+            bool would_prune_next(int min_count,int top_k) const;
+
+            //Drop every link, storing the previous and next words that were linked
+            void clear_links(std::vector<const Word*> &prev_words,std::vector<const Word*> &next_words);
+
+            //Copy up to count links of another node, continuing after the first done ones, previous words first. Return the number copied. Large nodes can be copied a piece at a time, as long as they don't change in between
+            int copy_links(const WordNode &wn,int done,int count);
+
+            //Number of links, on both directions
+            int get_links() const
+            {
+                return prev.get_size()+next.get_size();
+            }
+
+        /*Word*/
+        public:
+
+            //Increase frecuency
+            void inc_frec(int count=1);
+
+            //Divide the frecuency of the word and its links by 2^shift. Store the previous and next words whose links reached zero
+            void decay(unsigned int shift,std::vector<const Word*> &prev_words,std::vector<const Word*> &next_words);
+
+            //Get word
+            const Word& get_word() const
+            {
+                return *w;
+            }
+
+        /*Read/write to file*/
+        public:
+
+            //Write to file, as if the frecuencies had been divided by 2^shift
+            void write(std::ostream &o,unsigned int shift=0) const;
+
+            //Read from file, storing the words on a pool
+            void read(std::istream &i,WordPool &pool);
+
+    };
+
+
+    //Thresholds used to drop rare words and links from a graph. A zero disables each of them
+    class PrunePolicy
+    {
+        /* Attributes */
+
+        /*Thresholds*/
+        public:
+
+            int min_link;//Links seen fewer times are dropped
+            int min_node;//Words seen fewer times are dropped, with all their links
+            int top_k;//Maximum number of next words kept on each node, the most frecuent ones
+            int max_nodes;//Maximum number of words, the least frecuent ones are dropped when it's exceeded
+
+        /*Learning*/
+        public:
+
+            int interval;//Lines learned between automatic prunes, 0 to prune only on demand or when max_nodes is exceeded
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, prunes nothing
+            PrunePolicy();
+    };
+
+    //Fixed size table of approximate counts for a stream of keys (count-min sketch). Estimates are never below the real count
+    class CountMinSketch
+    {
+        /* Attributes */
+
+        /*Counters*/
+        private:
+
+            std::vector<std::uint32_t> counts;//One row of counters after another
+            int width;//Counters on each row, a power of 2
+            int depth;//Number of rows, each one hashing the keys differently
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, counts nothing
+            CountMinSketch();
+
+            //Complete constructor. The width is rounded up to a power of 2
+            CountMinSketch(int nwidth,int ndepth);
+
+        /* Methods */
+
+        /*Counting*/
+        public:
+
+            //Count a key, count times. Return its estimated frecuency afterwards
+            int add(std::uint64_t key,int count=1);
+
+            //Estimated frecuency of a key
+            int estimate(std::uint64_t key) const;
+
+            //Divide every counter by 2^shift
+            void decay(unsigned int shift);
+
+            //Check if the sketch has no counters
+            bool empty() const
+            {
+                return counts.empty();
+            }
+
+        private:
+
+            //Position of the counter of a key on a row
+            std::size_t slot(std::uint64_t key,int row) const;
+    };
+
+    //Memory resource that serializes the calls to another one, so threads can share it. Uncontended, it costs a lock per allocation, and the containers it serves only allocate when they grow
+    class LockedResource : public std::pmr::memory_resource
+    {
+        /* Attributes */
+
+        /*Memory*/
+        private:
+
+            std::pmr::memory_resource *up;//Resource that does the work
+            std::mutex lock;//Guards every call to it
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, serialize the calls to a resource
+            LockedResource(std::pmr::memory_resource *nup)
+            :up(nup),lock()
+            {}
+
+        /* Methods */
+
+        /*Memory*/
+        private:
+
+            //Allocate from the resource
+            void* do_allocate(std::size_t bytes,std::size_t align) override
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                return up->allocate(bytes,align);
+            }
+
+            //Return memory to the resource
+            void do_deallocate(void *p,std::size_t bytes,std::size_t align) override
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                up->deallocate(p,bytes,align);
+            }
+
+            //Memory can only be returned to the same resource
+            bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override
+            {
+                return this==&o;
+            }
+    };
+
+    //Threads kept waiting for work, so each job doesn't start new ones. The thread that runs a job works on it too
+    class WorkerPool
+    {
+        /* Attributes */
+
+        /*Threads*/
+        private:
+
+            std::vector<std::thread> threads;//Workers, besides the thread running the job
+            std::mutex lock;//Guards the job and the counts
+            std::condition_variable wake;//Workers wait here for a job
+            std::condition_variable done;//The thread running a job waits here for the workers
+            bool stop;//The workers must end
+
+        /*Job*/
+        private:
+
+            const std::function<void(int)> *job;//Job running, nullptr between jobs
+            int count;//Parts of the job
+            std::atomic<int> next;//Next part to be done, shared by all threads
+            std::uint64_t round;//Jobs started, so each worker joins each job once
+            unsigned int running;//Workers not done with the job yet
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, run jobs on the given number of threads (0 for one per core), counting the one running them
+            explicit WorkerPool(unsigned int nthreads);
+
+        /*Copy control*/
+        public:
+
+            //Workers point to the pool
+            WorkerPool(const WorkerPool &wp)=delete;
+            WorkerPool& operator=(const WorkerPool &wp)=delete;
+
+            //Stop the workers and wait for them
+            ~WorkerPool();
+
+        /* Methods */
+
+        /*Jobs*/
+        public:
+
+            //Call fn(k) for every k in [0,count), spread over the threads, and wait for it. One job at a time
+            void run(int ncount,const std::function<void(int)> &fn);
+
+            //Get the number of threads, counting the one running the jobs
+            unsigned int get_threads() const
+            {
+                return static_cast<unsigned int>(threads.size())+1;
+            }
+
+        private:
+
+            //Loop of a worker, joining each job as it starts
+            void work();
+
+            //Do parts of the running job until there are none left
+            void take_parts();
+    };
+
+    //Contains the WordNodes, indexed by their Word
+    class WordGraph
+    {
+        /* Config */
+
+        /*Random*/
+        private:
+
+            //Random engine, for approximate counting
+            static std::default_random_engine re;
+
+        /*File*/
+        private:
+
+            //Number of nodes on each chunk of a model file. Chunks are encoded and decoded in parallel
+            static const int CHUNK_NODES;
+
+        /*Batch threads*/
+        private:
+
+            //Fewest links in a batch for it to be added by several threads
+            static const std::size_t PARALLEL_LINKS;
+
+        /*Types*/
+        private:
+
+            //Range of nodes on a model file
+            struct Chunk
+            {
+                std::uint64_t off;//Position from the start of the graph
+                std::uint64_t size;//Bytes
+                int n;//Number of nodes
+            };
+
+            //Nodes indexed by their word, which is stored on the pool
+            typedef std::pmr::map< const Word*,WordNode,WordPtrLess > NodeMap;
+
+            //Memory of the links of the nodes of a chunk read from file
+            struct ReadPool
+            {
+                std::pmr::unsynchronized_pool_resource pool;//Holds the memory
+                LockedResource shared;//What the links allocate from, so they can grow on several threads
+
+                ReadPool()
+                :pool(),shared(&pool)
+                {}
+            };
+
+        /* Attributes */
+
+        /*Memory*/
+        private:
+
+            std::pmr::monotonic_buffer_resource arena;//Memory of the nodes and their links. Grows in blocks, which are only returned all at once
+            LockedResource shared_arena;//The only way to the arena: what the pool refills from, and what links placed by relayout allocate from, so they can grow on several threads
+            std::pmr::unsynchronized_pool_resource pool;//Reuses the memory freed by nodes and links, taken from the arena
+            LockedResource shared_pool;//What the links of new nodes allocate from, so they can grow on several threads
+            std::vector< std::unique_ptr<ReadPool> > read_pools;//Memory of the links of nodes read from file, one per chunk, so chunks can be decoded in parallel
+            WordPool words;//Text of every word, once
+
+        /*Nodes*/
+        private:
+
+            NodeMap nodes;//Nodes indexed by their word
+            int n;//Number of nodes
+            std::uint64_t drops;//Times nodes have been dropped or moved, so pointers to them can be checked
+
+        /*Decay*/
+        private:
+
+            unsigned int age;//Decay epoch, every frecuency is halved each time it advances
+            bool reclaim_started;//The reclaim cursor is valid
+            Word reclaim_cursor;//Last node checked by reclaim
+
+        /*Streaming*/
+        private:
+
+            int stream_k;//Maximum number of next words kept on each node, 0 to keep them all
+            CountMinSketch sketch;//Approximate count of every link seen while streaming
+
+        /*Counting*/
+        private:
+
+            bool approx;//Count the links past the exact range of 2 byte counters approximately
+
+        /*Batch threads*/
+        private:
+
+            unsigned int batch_threads;//Threads that add the links of a batch
+            std::unique_ptr<WorkerPool> batch_pool;//Threads adding the links of batches, started by the first batch large enough
+
+        /*Versions*/
+        private:
+
+            friend class FrozenModel;//Copies the nodes and links into an immutable version
+
+        /*Snapshot*/
+        private:
+
+            unsigned int epoch;//Epoch of the last snapshot, increased every time a new one starts
+            bool snap_active;//A snapshot is being taken
+            bool snap_started;//The snapshot has gone past at least one node, the cursor is valid
+            Word snap_cursor;//Last node taken by the snapshot
+            std::map< Word,WordNode > snap_saved;//Nodes modified ahead of the cursor, copied as they were when the snapshot started
+            std::unique_ptr<WordNode> snap_part;//Copy of the next node while it's taken a piece at a time, dropped if the node is modified meanwhile
+            int snap_part_links;//Links of the next node copied so far
+            int snap_size;//Number of nodes when the snapshot started
+            unsigned int snap_age;//Decay epoch when the snapshot started
+            std::vector<const Word*> snap_released;//Words of the nodes dropped while the snapshot runs. Its copies may still point to them, so they're released once it ends
+
+        /*Snapshot file*/
+        private:
+
+            std::uint64_t snap_off;//Bytes written by the snapshot so far. Only used by the thread writing it
+            std::vector< std::pair< Word,std::uint64_t > > snap_index;//Offsets of the nodes written by the snapshot. Only used by the thread writing it
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor
+            WordGraph();
+
+        /*Copy control*/
+        public:
+
+            //Nodes point to the memory of the graph
+            WordGraph(const WordGraph &wg)=delete;
+            WordGraph& operator=(const WordGraph &wg)=delete;
+
+        /* Methods */
+
+        /*Nodes*/
+        public:
+
+            //Check if a word exists (as a node in the graph)
+            bool check_word(const Word &w);
+
+            //Add a word to the node, increase its frecuency if it exists. Count times at once
+            void add_word(const Word &w,int count=1);
+
+            //Get a node by pointer, nullptr if not found
+            WordNode* get_node(const Word &w);
+
+            //Number of nodes
+            int get_size() const
+            {
+                return n;
+            }
+
+            //Get the times nodes have been dropped or moved. Pointers to nodes taken before it changed may be invalid
+            std::uint64_t get_drops() const
+            {
+                return drops;
+            }
+
+            //Drop every node, returning all their memory at once. Return false if a snapshot is running
+            bool clear();
+
+        private:
+
+            //Add a word to the node, increase its frecuency if it exists. Count times at once. Return its node
+            NodeMap::iterator add_node(const Word &w,int count);
+
+        /*Layout*/
+        public:
+
+            //Place the nodes in memory in the order a walk from START is most likely to reach them, so the most used part of the graph is contiguous. The nodes go in that order on the pool's chunks and their links in the same order on the arena, so a node isn't next to its own links. Meant for models that are done learning: the memory freed by their links isn't reused until clear. Return false if a snapshot is running
+            bool relayout();
+
+        private:
+
+            //Nodes in the order relayout places them: the most likely to be reached from START first, then the rest by frecuency
+            std::vector<const WordNode*> layout_order() const;
+
+        /*Pruning*/
+        public:
+
+            //Drop the words and links below the policy's thresholds, keeping both directions of every link consistent. START and END are never dropped. Return the number of nodes dropped
+            int prune(const PrunePolicy &p);
+
+        /*Decay*/
+        public:
+
+            //Advance the decay epoch, halving every frecuency. Nothing is touched now: each node catches up the next time it's modified
+            void advance_age();
+
+            //Get the decay epoch
+            unsigned int get_age() const
+            {
+                return age;
+            }
+
+            //Shift to apply to the stored frecuencies of a node to get their current value
+            unsigned int get_shift(const WordNode &node) const
+            {
+                return age-node.stamp;
+            }
+
+            //Bring up to date up to max_nodes nodes, continuing from the last call, and drop the ones that decayed to nothing. Return the number dropped
+            int reclaim(int max_nodes);
+
+        private:
+
+            //Bring the frecuencies of a node up to date with the decay epoch, removing the other direction of every link that reaches zero
+            void refresh(NodeMap::iterator it);
+
+        /*Links*/
+        public:
+
+            //Add a link between two nodes. Count times at once
+            void add_link(const Word &prev, const Word &next,int count=1);
+
+        private:
+
+            //Add a link between two nodes, by their position. Count times at once
+            void link(NodeMap::iterator p,NodeMap::iterator nx,int count);
+
+        /*Batch*/
+        public:
+
+            //Add every word and link counted by a batch. Each distinct one is added once, with all its occurrences
+            void add_batch(const BigramBatch &b);
+
+        /*Batch threads*/
+        public:
+
+            //Add the links of large batches on the given number of threads (0 for one per core). Nodes are sharded by word, and each thread adds both directions of the links that land on its shards, so no node is ever touched by two of them. Batches are still added one at a time, and by one thread while streaming, counting approximately or writing a snapshot
+            void set_batch_threads(unsigned int t);
+
+            //Get the number of threads that add the links of a batch
+            unsigned int get_batch_threads() const
+            {
+                return batch_threads;
+            }
+
+        private:
+
+            //Shard of a node, for the given number of shards
+            static unsigned int shard(const Word *w,unsigned int shards)
+            {
+                return static_cast<unsigned int>(((reinterpret_cast<std::uintptr_t>(w)>>4)*0x9E3779B97F4A7C15ULL)>>40)%shards;
+            }
+
+        /*Streaming*/
+        public:
+
+            //Keep at most max_next next words on each node (0 to keep them all), the most frecuent ones. Links that don't fit are counted by a sketch of depth rows of width counters, and replace the least frecuent link once they're estimated to be more frecuent
+            void set_streaming(int max_next,int width,int depth);
+
+            //Get the maximum number of next words kept on each node, 0 if there's no limit
+            int get_streaming() const
+            {
+                return stream_k;
+            }
+
+        private:
+
+            //Key of a link on the sketch
+            static std::uint64_t link_key(const Word &prev,const Word &next);
+
+        /*Counting*/
+        public:
+
+            //Count the links past the exact range of 2 byte counters approximately (Morris counting), so their counters don't need to widen. Frecuencies stay right on average
+            void set_approx(bool a)
+            {
+                approx=a;
+            }
+
+        /*Snapshot*/
+        public:
+
+            //Start a point-in-time snapshot. Does not depend on the size of the graph. Return false if a snapshot is alredy running
+            bool begin_snapshot();
+
+            //Take copies of the next nodes of the running snapshot, as they were when it started, until about max_links links have been copied. Larger nodes are copied over several calls, and only added once complete. Return false once every node has been taken
+            bool take_snapshot(std::vector<WordNode> &batch,int max_links);
+
+            //Close the running snapshot, once every node has been taken
+            void end_snapshot();
+
+            //Check if a snapshot is being taken
+            bool in_snapshot() const
+            {
+                return snap_active;
+            }
+
+            //Get the number of nodes of the running snapshot
+            int get_snapshot_size() const
+            {
+                return snap_size;
+            }
+
+            //Get the decay shift of a node taken by the running snapshot
+            unsigned int get_snapshot_shift(const WordNode &wn) const
+            {
+                return snap_age-wn.stamp;
+            }
+
+        private:
+
+            //Preserve the current version of a node that's about to be modified, if the running snapshot still needs it
+            void preserve(NodeMap::iterator it);
+
+            //Drop a word whose node was removed. Held until the running snapshot ends, if there's one
+            void release_word(const Word *w);
+
+        /*Snapshot file*/
+        public:
+
+            //Write the header of the running snapshot's file. Only touches what the thread writing the snapshot owns, so it runs without the lock of the graph
+            void write_snapshot_header(std::ostream &o);
+
+            //Write nodes taken from the running snapshot to its file. Runs without the lock of the graph
+            void write_snapshot(std::ostream &o,const std::vector<WordNode> &batch);
+
+            //Write the index and the chunk table after every node of the running snapshot. Runs without the lock of the graph, before closing it
+            void write_snapshot_index(std::ostream &o);
+
+        /*Read/write to file*/
+        public:
+
+            //Write to file, encoding the chunks on the given number of threads (0 for one per core)
+            void write(std::ostream &o,unsigned threads=0) const;
+
+            //Read from file, decoding the chunks on the given number of threads (0 for one per core)
+            void read(std::istream &i,unsigned threads=0);
+
+        /*Index*/
+        public:
+
+            //Magic number closing the index of a model file
+            static const char INDEX_MAGIC[8];
+
+            //Read the index of a model file: the hash of each word, and the offset of its node from the start of the graph, sorted by hash. The stream must start at the graph. Return false if the file has no index
+            static bool read_index(std::istream &i,std::vector< std::pair< std::size_t,std::uint64_t > > &index);
+
+        private:
+
+            //Encode a node, as it's written to file, as if its frecuencies had been divided by 2^shift
+            static std::string encode(const WordNode &node,unsigned int shift);
+
+            //Write the index and the chunk table after the nodes, off being the position of the index from the start of the graph
+            static void write_index(std::ostream &o,const std::vector< std::pair< Word,std::uint64_t > > &index,std::uint64_t off);
+
+            //Read the chunk table of a model file, and the position where the nodes end. The stream must start at the graph, and is left there. Return false if the file has no table
+            static bool read_chunks(std::istream &i,std::vector<Chunk> &chunks,std::uint64_t &end);
+
+            //Read the trailer of a model file: positions of the index and the chunk table. The stream must start at the graph, and is left there. Return false if the file has no trailer
+            static bool read_trailer(std::istream &i,std::uint64_t &index_off,std::uint64_t &chunk_off);
+    };
+
+    //Remembers how raw tokens were split into words, so common tokens skip the parser. Bounded: each token has a single slot, and replaces whatever was there. Not thread safe, use one per thread
+    class TokenCache
+    {
+        /* Config */
+
+        /*Size*/
+        private:
+
+            //Default number of slots
+            static const int DEF_SLOTS;
+
+        /*Types*/
+        private:
+
+            //Cached token
+            struct Slot
+            {
+                std::string raw;//Token, as read from the stream
+                std::vector<Word> words;//Words it was split into
+                bool ok;//It was parsed without turning into a symbol
+                bool used;//The slot holds a token
+            };
+
+        /* Attributes */
+
+        /*Slots*/
+        private:
+
+            std::vector<Slot> slots;//Slots, a power of 2
+
+        /*Stats*/
+        private:
+
+            std::uint64_t hits;//Lookups that found their token
+            std::uint64_t misses;//Lookups that didn't
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, set the number of slots. Rounded up to a power of 2
+            TokenCache(int nslots=DEF_SLOTS);
+
+        /* Methods */
+
+        /*Lookup*/
+        public:
+
+            //Get the words a token was split into, nullptr if it isn't cached. Set ok to the result of parsing it
+            const std::vector<Word>* find(const std::string &raw,bool &ok);
+
+            //Store the words a token was split into
+            void store(const std::string &raw,std::vector<Word> words,bool ok);
+
+            //Forget every token
+            void clear();
+
+        /*Stats*/
+        public:
+
+            //Get the number of lookups that found their token
+            std::uint64_t get_hits() const
+            {
+                return hits;
+            }
+
+            //Get the number of lookups that didn't find their token
+            std::uint64_t get_misses() const
+            {
+                return misses;
+            }
+
+        private:
+
+            //Slot of a token
+            Slot& slot(const std::string &raw);
+    };
+
+    //Provides the Words from a input stream
+    class ITextStream
+    {
+        /* Config */
+
+        /*Types*/
+        private:
+
+            enum class StreamState
+            {
+                START,//Feed start word
+                TEXT,//Feed text words from the stream
+                END,//Feed end word
+                EMPTY//Stream is empty, will not provide more words
+            };
+
+        /*Defaults*/
+        private:
+
+            //Word to be returned if an error arises during reading
+            static const Word DEF_ERR_WORD;
+
+        /* Attributes */
+
+        /*Stream*/
+        private:
+
+            //Input stream
+            std::istream &is;
+
+            //Status of the stream
+            StreamState status;
+
+            //Next word to be fed
+            std::list<Word> nw;
+
+            //Tokens parsed before, nullptr to always parse them
+            TokenCache *cache;
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, optionally with a cache of parsed tokens that can be shared by many streams
+            ITextStream(std::istream &nis,TokenCache *ncache=nullptr);
+
+        /* Methods */
+
+        /*Stream*/
+        public:
+
+            //Loads the next words from the stream, returns if the stream is ready. Must be called after every read
+            bool has_words();
+
+            //Return the last word read from the stream
+            Word read();
+
+        /*Parsing*/
+        private:
+
+            /*Read a word, or a part of it. Return true if you read what expected, false otherwise. Return the readen word*/
+
+            //Fill the queue with words from a text separated by whitespàce, from the cache if it's there
+            bool read_word(std::string s);
+
+            //Fill the queue with words from a text separated by whitespace, always parsing it
+            bool parse_word(const std::string &s);
+
+            //Read whitespace
+            bool read_WS(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+
+            //Read a left stop
+            bool read_L_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+
+            //Read a left delimiter
+            bool read_L_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+
+            //Read content
+            bool read_CONTENT(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+
+            //Read a right delimiter
+            bool read_R_DELIM(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+
+            //Read a right stop
+            bool read_R_STOP(std::string::const_iterator &it,std::string::const_iterator e,Word &w);
+    };
+
+    //Words and links of a block of text, counted before they're learned, so the graph gets each distinct one once instead of once per occurrence
+    class BigramBatch
+    {
+        /* Config */
+
+        /*Size*/
+        private:
+
+            //Default number of links held before the batch is full
+            static const int DEF_MAX_LINKS;
+
+        /* Attributes */
+
+        /*Words*/
+        private:
+
+            std::unordered_map< Word,std::uint32_t,WordHash > ids;//Id of each word, its position on vocab
+            std::vector<Word> vocab;//Every word seen, by id
+            std::vector<int> frecs;//Times each word was seen, by id
+
+        /*Links*/
+        private:
+
+            std::vector< std::pair< std::uint64_t,int > > links;//Links seen (previous word id on the high half of the key, next on the low half) and their frecuency. Only distinct and sorted once counted
+            bool counted;//Links are distinct and sorted
+            int max_links;//Links held before the batch is full
+
+        /*Lines*/
+        private:
+
+            int lines;//Lines added
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, set the number of links held before the batch is full
+            BigramBatch(int nmax_links=DEF_MAX_LINKS);
+
+        /* Methods */
+
+        /*Fill*/
+        public:
+
+            //Add the words and links of a text stream, as a line seen count times
+            void add(ITextStream &ts,int count=1);
+
+            //Merge the repeated links, adding up their frecuencies, and sort them. Done before learning
+            void count();
+
+            //Check if the batch should be learned before adding more lines. Counting may make room
+            bool full() const
+            {
+                return static_cast<int>(links.size())>=max_links;
+            }
+
+            //Drop every word and link
+            void clear();
+
+        /*Get*/
+        public:
+
+            //Get every word seen, by id
+            const std::vector<Word>& get_words() const
+            {
+                return vocab;
+            }
+
+            //Get the times each word was seen, by id
+            const std::vector<int>& get_frecs() const
+            {
+                return frecs;
+            }
+
+            //Get the links seen and their frecuencies. The key holds the id of the previous word on the high half and the id of the next word on the low half
+            const std::vector< std::pair< std::uint64_t,int > >& get_links() const
+            {
+                return links;
+            }
+
+            //Get the number of lines added
+            int get_lines() const
+            {
+                return lines;
+            }
+
+        private:
+
+            //Id of a word, adding it if needed, and count it
+            std::uint32_t id(const Word &w,int count);
+    };
+
+    //Distinct lines of a block of text, and how many times each was seen, so repeated lines are only split into words and learned once
+    class LineCounter
+    {
+        /* Config */
+
+        /*Size*/
+        private:
+
+            //Default number of distinct lines held before the counter is full
+            static const int DEF_MAX_LINES;
+
+        /* Attributes */
+
+        /*Lines*/
+        private:
+
+            std::unordered_map< std::string,int > counts;//Times each line was seen
+            int max_lines;//Distinct lines held before the counter is full
+            int total;//Lines seen, repeated ones included
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, set the number of distinct lines held before the counter is full
+            LineCounter(int nmax_lines=DEF_MAX_LINES);
+
+        /* Methods */
+
+        /*Lines*/
+        public:
+
+            //Count a line
+            void add(const std::string &line);
+
+            //Add every distinct line to a batch, once, with the times it was seen. Optionally, split it using a cache of parsed tokens
+            void fill(BigramBatch &b,TokenCache *cache=nullptr) const;
+
+            //Check if the lines should be learned before counting more
+            bool full() const
+            {
+                return static_cast<int>(counts.size())>=max_lines;
+            }
+
+            //Drop every line
+            void clear();
+
+        /*Get*/
+        public:
+
+            //Get the number of distinct lines
+            int get_size() const
+            {
+                return static_cast<int>(counts.size());
+            }
+
+            //Get the number of lines seen, repeated ones included
+            int get_total() const
+            {
+                return total;
+            }
+    };
+
+    //Reproducible synthetic text, with words following Zipf's law. The same seed always gives the same lines on any platform with IEEE 754 doubles, so load tests can be repeated at any size
+    //Lines mix the token classes ITextStream recognizes: words, INT and DECIMAL numbers, delimiters and stops, including the opening ¡ and ¿
+    class CorpusGenerator
+    {
+        /* Config */
+
+        /*Vocabulary*/
+        private:
+
+            //Default number of distinct words
+            static const int DEF_VOCAB;
+
+            //Default exponent of the distribution. The k-th most common word is seen 1/k^s times as often as the first
+            static const double DEF_EXPONENT;
+
+            //Binary digits of the exponent kept after the point
+            static const int EXPONENT_BITS;
+
+        /*Lines*/
+        private:
+
+            //Minimum and maximum number of words in a sentence
+            static const int MIN_WORDS;
+            static const int MAX_WORDS;
+
+        /* Attributes */
+
+        /*Random numbers*/
+        private:
+
+            std::uint64_t seed;//First state, to restart from
+            std::uint64_t state;//State of the splitmix64 generator
+
+        /*Vocabulary*/
+        private:
+
+            std::vector<std::string> vocab;//Words, most common first
+            std::vector<double> cum;//Cumulative weight of the words, up to each of them
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, set the seed, the number of distinct words and the exponent of their distribution
+            CorpusGenerator(std::uint64_t nseed=0,int nvocab=DEF_VOCAB,double nexponent=DEF_EXPONENT);
+
+        /* Methods */
+
+        /*Lines*/
+        public:
+
+            //Get the next line
+            std::string line();
+
+            //Append the next line to a string, without the new line character
+            void line(std::string &s);
+
+            //Write a number of lines. Return the number of bytes written
+            std::uint64_t write(std::ostream &o,std::uint64_t lines);
+
+            //Write lines until a number of bytes is reached. Return the number of lines written
+            std::uint64_t write_size(std::ostream &o,std::uint64_t bytes);
+
+            //Go back to the first line
+            void restart()
+            {
+                state=seed;
+            }
+
+        /*Get*/
+        public:
+
+            //Get the number of distinct words
+            int get_vocab_size() const
+            {
+                return static_cast<int>(vocab.size());
+            }
+
+        /*Generation*/
+        private:
+
+            //Next random number, splitmix64
+            std::uint64_t next();
+
+            //Next random number in [0,1)
+            double uniform();
+
+            //Append a sentence
+            void sentence(std::string &s);
+
+            //Append a word or number. The first one of a sentence is capitalized
+            void token(std::string &s,bool first);
+
+            //Word of a rank. Common ranks give short words, and no two ranks give the same word
+            static std::string make_word(int rank);
+
+            //Weight of a rank, 1/rank^exponent
+            static double weight(int rank,double exponent);
+    };
+
+    //Outputs words to a output stream
+    class OTextStream
+    {
+
+        /* Attributes */
+
+        /*Stream*/
+        private:
+
+            //Output stream
+            std::ostream &os;
+
+            //Status of the stream, previously printed word
+            WordType state;
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor
+            OTextStream(std::ostream &nos);
+
+        /* Methods */
+
+        /*Write*/
+        public:
+
+            //Write a word to the stream
+            bool write(const Word &w);
+    };
+
+    //Model capable of learning and speaking
+    class WordModel
+    {
+        /* Config */
+
+        /*Snapshot*/
+        private:
+
+            //Links a background snapshot copies while holding the lock, about. Bounds how long learning waits for it, whatever the size of the nodes
+            static const int SNAPSHOT_LINKS;
+
+        /*Pruning*/
+        private:
+
+            //Fraction of the vocabulary cap freed when it's hit, so learning doesn't prune on every new word
+            static const double PRUNE_SLACK;
+
+        /*Decay*/
+        private:
+
+            //Nodes checked for reclaiming after each line learned, once frecuencies decay
+            static const int RECLAIM_STEP;
+
+        /*Streaming*/
+        private:
+
+            //Counters on each row of the sketch used while streaming
+            static const int SKETCH_WIDTH;
+
+            //Rows of the sketch used while streaming
+            static const int SKETCH_DEPTH;
+
+        /* Attributes */
+
+        /*Nodes*/
+        private:
+
+            WordGraph graph;//Graph to be trained and to generate sentences
+
+        /*Concurrency*/
+        private:
+
+            mutable std::mutex lock;//Guards the graph, so background snapshots can be written while the model's used
+            std::condition_variable snap_done;//Signals the end of a background snapshot, which the destructor waits for
+
+            friend class WordWalker;//Walks the graph one step at a time, holding the lock for each
+            friend class LiveModel;//Copies the graph into immutable versions, holding the lock
+
+        /*Pruning*/
+        private:
+
+            PrunePolicy policy;//Applied while learning
+            int lines;//Lines learned since the last prune
+
+        /*Decay*/
+        private:
+
+            int decay_period;//Lines learned per decay epoch, 0 if it only advances on demand
+            int decay_lines;//Lines learned on this decay epoch
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor
+            WordModel();
+
+        /*Copy control*/
+        public:
+
+            //Wait for a background snapshot to end
+            ~WordModel();
+
+        /* Methods */
+
+        /*Learn*/
+        public:
+
+            //Learn from a text stream, as a line seen count times
+            void learn(ITextStream &ts,int count=1);
+
+            //Learn every line of a batch, adding each distinct word and link once. Lines are aged and pruned as if learned one by one, but only after the whole batch
+            void learn(BigramBatch &b);
+
+            //Forget everything learned, returning the memory at once. Return false if a snapshot is being written
+            bool clear();
+
+        /*Layout*/
+        public:
+
+            //Place the nodes in memory by how likely they're to be reached while thinking, so the most used ones are contiguous. Meant for models that are done learning. Return false if a snapshot is being written
+            bool relayout();
+
+        /*Pruning*/
+        public:
+
+            //Set the policy applied while learning
+            void set_prune_policy(const PrunePolicy &p);
+
+            //Prune the model now, with the given policy. Return the number of words dropped
+            int prune(const PrunePolicy &p);
+
+        private:
+
+            //Prune if the policy asks for it, after learning some lines. The lock must be held
+            void auto_prune(int count);
+
+        /*Lines*/
+        private:
+
+            //Age, reclaim and prune after learning some lines. The lock must be held
+            void end_lines(int count);
+
+        /*Decay*/
+        public:
+
+            //Halve every frecuency each time the given number of lines is learned, so recent text dominates. 0 to only do it on demand
+            void set_decay(int period);
+
+            //Start a new decay epoch now, halving every frecuency
+            void age();
+
+            //Check up to max_nodes words, dropping the ones that decayed to nothing. Can be called from a maintenance thread. Return the number of words dropped
+            int reclaim(int max_nodes);
+
+        /*Streaming*/
+        public:
+
+            //Keep at most max_next next words on each node (0 to keep them all), so memory doesn't grow with the number of distinct links. The rest are counted approximately, and take the place of a kept one when they become more frecuent
+            void set_streaming(int max_next);
+
+        /*Counting*/
+        public:
+
+            //Count very frecuent links approximately, so they fit on 2 byte counters
+            void set_approx(bool a);
+
+        /*Batch threads*/
+        public:
+
+            //Add the links of large batches on the given number of threads (0 for one per core), each owning a shard of the nodes. Learning stays one batch at a time, under the lock, but each one is added in parallel
+            void set_batch_threads(unsigned int t);
+
+        /*Speak*/
+        public:
+
+            //Generate a line using the model
+            void think(OTextStream &ots);
+
+            //Copy the model as it is now into an immutable version, that generates lines on any number of threads without locks
+            std::shared_ptr<const FrozenModel> freeze();
+
+        /*Read/write to file*/
+        public:
+
+            //Write to file, using the given number of threads (0 for one per core)
+            void write(std::ostream &o,unsigned threads=0) const;
+
+            //Read from file, using the given number of threads (0 for one per core)
+            void read(std::istream &i,unsigned threads=0);
+
+            //Write a snapshot of the model as it is now on a background thread, while learning goes on. The stream must outlive the returned future, which reports if the snapshot could be written. The model waits for it before being destroyed, and can't be cleared or laid out while it runs
+            std::future<bool> write_async(std::ostream &o);
+    };
+
+    //Generates a line from a model one word at a time, as it's asked for, so it can be stopped at any point. Many can be in progress at once on the same model, each with its own random engine. The model must outlive it
+    class WordWalker
+    {
+        /* Attributes */
+
+        /*Model*/
+        private:
+
+            WordModel &model;//Model walked
+
+        /*Walk*/
+        private:
+
+            std::default_random_engine re;//Picks the next words
+            Word current;//Last word generated
+            WordNode *node;//Node of the last word. Only valid while the graph hasn't dropped any node
+            std::uint64_t drops;//Nodes dropped by the graph when the node was found
+            bool started;//START has been generated
+            bool finished;//END has been generated
+            std::chrono::steady_clock::duration spent;//Time spent in next on this line, to time it without the time the caller takes between words
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, walk a model with a random engine seeded with the given value
+            WordWalker(WordModel &m,unsigned int seed=std::random_device()());
+
+        /* Methods */
+
+        /*Walk*/
+        public:
+
+            //Get the next word of the line, START first and END last. Return false once END has been generated
+            bool next(Word &w);
+
+            //Check if END has been generated
+            bool done() const
+            {
+                return finished;
+            }
+
+            //Start a new line
+            void restart();
+    };
+
+    //Immutable version of a model, generates lines without locks. Nodes are numbered, and each one's next words stored with their cumulative frecuencies, so any number of threads can walk it at once
+    class FrozenModel
+    {
+        /* Attributes */
+
+        /*Nodes*/
+        private:
+
+            std::vector<Word> words;//Word of each node
+            std::vector<std::uint32_t> first;//First link of each node, and one past the last of the last node
+            std::uint32_t start;//Node of START, or the number of nodes if it doesn't exist
+
+        /*Links*/
+        private:
+
+            std::vector<std::uint32_t> next;//Node reached by each link
+            std::vector<std::uint64_t> cum;//Frecuency of the links of a node, up to each one
+
+        /*Version*/
+        private:
+
+            std::uint64_t version;//Times the model had been published
+
+        /*Building*/
+        private:
+
+            std::vector<const Word*> keys;//Word of each node on the graph it's copied from, until finish
+            std::vector<const Word*> targets;//Word reached by each link, until finish numbers them
+
+            friend class LiveModel;//Builds versions from the copies taken by snapshots
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, an empty model
+            FrozenModel();
+
+            //Complete constructor, copy the current frecuencies of a graph
+            FrozenModel(const WordGraph &g,std::uint64_t nversion);
+
+        private:
+
+            //Empty version, to be built with add_node and finish
+            explicit FrozenModel(std::uint64_t nversion);
+
+        /* Methods */
+
+        /*Speak*/
+        public:
+
+            //Generate a line, picking the words with the given random engine
+            void think(OTextStream &ots,std::default_random_engine &eng) const;
+
+        /*Get*/
+        public:
+
+            //Get the number of nodes
+            int get_size() const
+            {
+                return static_cast<int>(words.size());
+            }
+
+            //Get the times the model had been published when this version was made
+            std::uint64_t get_version() const
+            {
+                return version;
+            }
+
+        /*Building*/
+        private:
+
+            //Add a node copied from a graph, its frecuencies divided by 2^shift. The words its links reach are numbered by finish
+            void add_node(const WordNode &wn,unsigned int shift);
+
+            //Number the words the links reach, once every node is added. Links to words without a node are dropped
+            void finish();
+    };
+
+    //Learns and generates at once. Lines are generated from the last published version of the model, which is immutable, so they never wait for learning. One writer at a time learns into the model, and every so many lines a new version is built in the background from a snapshot, while learning goes on. Versions are freed once the last thread using them lets them go
+    class LiveModel
+    {
+        /* Config */
+
+        /*Versions*/
+        public:
+
+            //Default number of lines learned between versions
+            static const int DEF_PUBLISH_LINES;
+
+            //A version doesn't start until this many times as long as the last one took to build has passed, so building them takes a bounded share of the time, whatever the size of the model
+            static const int PUBLISH_SPACING;
+
+        /* Attributes */
+
+        /*Model*/
+        private:
+
+            WordModel model;//Model learning, only used by the writer
+            std::mutex writer;//Only one thread learns or publishes at a time
+
+        /*Versions*/
+        private:
+
+            std::shared_ptr<const FrozenModel> current;//Last version published. Only accessed atomically
+            std::uint64_t versions;//Versions published
+            int publish_lines;//Lines learned between versions, 0 to only publish on demand
+            int pending;//Lines learned since the last version
+            std::chrono::steady_clock::time_point next_start;//When the next version may start building
+            std::future<std::chrono::steady_clock::duration> building;//Version being built in the background, and how long it took. Destroyed first, waiting for it
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, publish a new version every given number of lines (0 to only publish on demand)
+            LiveModel(int npublish_lines=DEF_PUBLISH_LINES);
+
+        /* Methods */
+
+        /*Learn*/
+        public:
+
+            //Learn from a text stream, as a line seen count times
+            void learn(ITextStream &ts,int count=1);
+
+            //Learn every line of a batch
+            void learn(BigramBatch &b);
+
+        /*Versions*/
+        public:
+
+            //Publish the model as it is now, waiting for it. Generation goes on with the last version while it's copied
+            void publish();
+
+            //Get the last version published. It stays valid while it's held, whatever is learned or published meanwhile
+            std::shared_ptr<const FrozenModel> get() const
+            {
+                return std::atomic_load(&current);
+            }
+
+        /*Speak*/
+        public:
+
+            //Generate a line from the last version published, with the given random engine
+            void think(OTextStream &ots,std::default_random_engine &eng) const
+            {
+                get()->think(ots,eng);
+            }
+
+        /*Read/write to file*/
+        public:
+
+            //Read from file into an empty model, and publish it
+            void read(std::istream &i,unsigned threads=0);
+
+            //Write the model as it is now to file
+            void write(std::ostream &o,unsigned threads=0);
+
+        /*Model*/
+        public:
+
+            //Run a function on the model while nothing else learns or publishes, such as to configure it. A version being built is waited for first
+            template<class F> void with_model(F fn)
+            {
+                std::lock_guard<std::mutex> guard(writer);
+                wait_version();
+                fn(model);
+            }
+
+        private:
+
+            //Copy the model into a new version at once, and make it the current one. The writer lock must be held
+            void make_version();
+
+            //Start building a new version in the background from a snapshot of the model. Return false if another snapshot is running. The writer lock must be held
+            bool start_version();
+
+            //Wait for the version being built, if there's one. The writer lock must be held
+            void wait_version();
+
+            //Build a new version from the running snapshot of the model, and make it the current one. Holds the lock of the model only while copying a batch of nodes. Return how long it took
+            std::chrono::steady_clock::duration build_version(std::uint64_t v);
+
+            //Start a new version if enough lines were learned, and the last one is done and far enough behind. The writer lock must be held
+            void end_lines(int count);
+    };
+
+    //Bounded lock-free queue from one producer thread to one consumer thread. A full queue makes the producer wait, so a fast stage can't run ahead of a slow one
+    template<class T> class SPSCQueue
+    {
+        /* Attributes */
+
+        /*Slots*/
+        private:
+
+            std::vector<T> slots;//Ring of items, its size a power of 2
+            std::size_t mask;//Size of the ring minus one
+
+        /*Positions*/
+        private:
+
+            alignas(64) std::atomic<std::size_t> head;//Next item to pop, only written by the consumer
+            alignas(64) std::atomic<std::size_t> tail;//Next item to push, only written by the producer
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, holds at least the given number of items
+            SPSCQueue(std::size_t capacity)
+            :slots(),mask(0),head(0),tail(0)
+            {
+                std::size_t size=1;
+                while (size<capacity)
+                    size<<=1;
+                slots.resize(size);
+                mask=size-1;
+            }
+
+        /* Methods */
+
+        /*Items*/
+        public:
+
+            //Add an item if there's room. Return false if the queue is full
+            bool try_push(T &v)
+            {
+                std::size_t t=tail.load(std::memory_order_relaxed);
+                if (t-head.load(std::memory_order_acquire)>mask)
+                    return false;
+
+                slots[t&mask]=std::move(v);
+                tail.store(t+1,std::memory_order_release);
+                return true;
+            }
+
+            //Take the oldest item if there's one. Return false if the queue is empty
+            bool try_pop(T &v)
+            {
+                std::size_t h=head.load(std::memory_order_relaxed);
+                if (h==tail.load(std::memory_order_acquire))
+                    return false;
+
+                v=std::move(slots[h&mask]);
+                head.store(h+1,std::memory_order_release);
+                return true;
+            }
+
+            //Add an item, waiting for room
+            void push(T v)
+            {
+                for (int spins=0;!try_push(v);++spins)
+                    backoff(spins);
+            }
+
+            //Take the oldest item, waiting for one
+            T pop()
+            {
+                T v;
+                for (int spins=0;!try_pop(v);++spins)
+                    backoff(spins);
+                return v;
+            }
+
+        private:
+
+            //Wait a bit longer the longer a stage has been stalled
+            static void backoff(int spins)
+            {
+                if (spins<64)
+                    return;
+                else if (spins<128)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+    };
+
+    //Learns a stream in stages that run at once: a reader thread cuts it into blocks of whole lines, tokenizer threads count each block into a BigramBatch, and the calling thread learns the batches, in the order of the stream
+    class LearnPipeline
+    {
+        /* Config */
+
+        /*Stages*/
+        private:
+
+            //Default size of the blocks read, in bytes
+            static const std::size_t DEF_BLOCK;
+
+            //Default number of bytes read but not learned yet before the reader waits
+            static const std::size_t DEF_IN_FLIGHT;
+
+        /* Attributes */
+
+        /*Model*/
+        private:
+
+            WordModel &model;//Model learning
+
+        /*Stages*/
+        private:
+
+            unsigned tokenizers;//Number of tokenizer threads
+            std::size_t block;//Size of the blocks read, in bytes
+            std::size_t in_flight;//Bytes read but not learned yet before the reader waits, whatever stage holds them
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, learn into a model with the given number of tokenizer threads (0 for one per core)
+            LearnPipeline(WordModel &m,unsigned ntokenizers=0,std::size_t nblock=DEF_BLOCK,std::size_t nin_flight=DEF_IN_FLIGHT);
+
+        /* Methods */
+
+        /*Learn*/
+        public:
+
+            //Learn every non blank line of a stream. Return the number of lines learned, and add the bytes read
+            std::uint64_t learn(std::istream &i,std::uint64_t &bytes);
+    };
+
+    //Bounded cache, evicts the least recently used entries
+    template<class K,class V> class LRUCache
+    {
+        /* Attributes */
+
+        /*Entries*/
+        private:
+
+            //Entries, the most recently used first
+            std::list< std::pair< K,V > > items;
+
+            //Dictionary that stores the position of each key on the list
+            std::map< K,typename std::list< std::pair< K,V > >::iterator > dict;
+
+            //Maximum number of entries
+            std::size_t cap;
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor. The capacity is at least one
+            LRUCache(std::size_t ncap)
+            :items(),dict(),cap(ncap?ncap:1)
+            {}
+
+        /* Methods */
+
+        /*Entries*/
+        public:
+
+            //Get an entry, marking it as the most recently used. nullptr if not found
+            V* get(const K &k)
+            {
+                auto it=dict.find(k);
+                if (it==dict.end())
+                    return nullptr;
+
+                //Move it to the front
+                items.splice(items.begin(),items,it->second);
+                return &(it->second->second);
+            }
+
+            //Add an entry as the most recently used, evicting the least recently used one if full. Return the stored value
+            V* put(const K &k,V v)
+            {
+                //Replace it if alredy cached
+                auto it=dict.find(k);
+                if (it!=dict.end())
+                {
+                    it->second->second=std::move(v);
+                    return get(k);
+                }
+
+                //Make room
+                if (items.size()>=cap)
+                {
+                    dict.erase(items.back().first);
+                    items.pop_back();
+                }
+
+                items.emplace_front(k,std::move(v));
+                dict[k]=items.begin();
+                return &(items.front().second);
+            }
+
+            //Number of cached entries
+            std::size_t size() const
+            {
+                return items.size();
+            }
+
+            //Maximum number of entries
+            std::size_t capacity() const
+            {
+                return cap;
+            }
+
+            //Get the least recently used entry, the next one evicted. nullptr if there are none
+            const V* last() const
+            {
+                return items.empty()?nullptr:&items.back().second;
+            }
+
+            //Remove the least recently used entry, if any
+            void pop()
+            {
+                if (items.empty())
+                    return;
+
+                dict.erase(items.back().first);
+                items.pop_back();
+            }
+
+            //Remove all entries
+            void clear()
+            {
+                items.clear();
+                dict.clear();
+            }
+    };
+
+    //Read-only model that loads its nodes from file as they're needed
+    class LazyWordModel
+    {
+        /* Config */
+
+        /*Cache*/
+        private:
+
+            //Default number of decoded nodes kept in memory
+            static const std::size_t DEF_CACHE;
+
+        /* Attributes */
+
+        /*File*/
+        private:
+
+            std::ifstream file;//Model file, kept open
+            std::vector< std::pair< std::size_t,std::uint64_t > > index;//Hash of each word, and the offset of its node on the file, sorted by hash. Words with the same hash are told apart once decoded
+
+        /*Nodes*/
+        private:
+
+            WordPool words;//Text of the words of the cached nodes and their links
+            std::unordered_map< const Word*,int > refs;//Cached nodes holding each word of the pool, so it's released with the last one
+            LRUCache< Word,WordNode > cache;//Nodes decoded so far
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, set the number of decoded nodes kept in memory
+            LazyWordModel(std::size_t cache_size=DEF_CACHE);
+
+        /* Methods */
+
+        /*File*/
+        public:
+
+            //Open a model file, reading only its index. Return false if it couldn't be opened
+            bool open(const std::string &path);
+
+        /*Speak*/
+        public:
+
+            //Generate a line using the model
+            void think(OTextStream &ots);
+
+        /*Nodes*/
+        private:
+
+            //Get a node, decoding it from file if not cached. nullptr if not found. Valid until the next call
+            WordNode* get_node(const Word &w);
+
+            //Count the words of a node, and those it links to, as held by it
+            void hold(const WordNode &wn);
+
+            //Stop counting the words of a node as held by it, releasing those no other cached node holds
+            void drop(const WordNode &wn);
+    };
+
+    //Events counted on the hot paths
+    enum class Counter : int
+    {
+        TOKENS=0,//Raw tokens split into words
+        TOKENIZE_NS,//Time splitting them, in nanoseconds
+        LOOKUPS,//Words looked up on a graph
+        LOOKUP_NS,//Time looking them up, in nanoseconds
+        NODES_ADDED,//Words new to a graph
+        LINKS_ADDED,//Links added to a list, new or not
+        LINKS_INSERTED,//Links new to a list
+        REORDER_SWAPS,//Swaps made to keep the lists sorted
+        REORDER_DISTANCE,//Positions the links moved up, in total
+        PICKS,//Words picked at random
+        PICK_DEPTH,//Words a linear scan goes through to reach the ones picked, in total
+        SUM_REBUILDS,//Cumulative frecuencies computed again after a change
+        BYTES_READ,//Bytes of models read
+        BYTES_WRITTEN,//Bytes of models written
+        LINES_LEARNED,//Lines learned
+        LINES_GENERATED,//Lines generated
+        COUNT//Number of counters
+    };
+
+    //Operations whose latency is measured
+    enum class Op : int
+    {
+        THINK=0,//Generating a line
+        LEARN,//Learning a line
+        LEARN_BATCH,//Learning a batch of lines
+        PUBLISH,//Publishing a version of a live model
+        READ,//Reading a model
+        WRITE,//Writing a model
+        COUNT//Number of operations
+    };
+
+    //Latencies of an operation, in nanoseconds. Values are kept in buckets, exact below 32 and 16 per power of 2 above it, so any value is reported at most 1/16 above what it was, and recording one is a single increment
+    class LatencyHistogram
+    {
+        /* Config */
+
+        /*Buckets*/
+        public:
+
+            //Bits kept after the highest one. Each power of 2 is split in 2^SUB_BITS buckets
+            static const int SUB_BITS;
+
+            //Number of buckets, enough for any 64 bit value
+            static const int BUCKETS;
+
+        /* Attributes */
+
+        /*Values*/
+        private:
+
+            std::vector<std::uint64_t> counts;//Values on each bucket
+            std::uint64_t n;//Number of values
+            std::uint64_t sum;//Sum of the values
+            std::uint64_t max;//Largest value
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, empty
+            LatencyHistogram();
+
+        /* Methods */
+
+        /*Recording*/
+        public:
+
+            //Add a value
+            void record(std::uint64_t ns);
+
+            //Add every value of another histogram
+            void merge(const LatencyHistogram &h);
+
+            //Values added since an earlier copy of this histogram. Their largest one is exact if it's also the largest of all, otherwise it's the largest value of its bucket
+            LatencyHistogram since(const LatencyHistogram &before) const;
+
+        /*Buckets*/
+        public:
+
+            //Bucket of a value
+            static int bucket(std::uint64_t ns);
+
+            //Largest value of a bucket
+            static std::uint64_t highest(int b);
+
+        /*Queries*/
+        public:
+
+            //Get the number of values
+            std::uint64_t get_count() const
+            {
+                return n;
+            }
+
+            //Mean of the values, 0 if there are none
+            double get_mean() const;
+
+            //Value that p percent of the values are at or below, such as 99.9, as the largest value of its bucket, but never above the largest value. 0 if there are none
+            std::uint64_t percentile(double p) const;
+
+            //Largest value. 0 if there are none
+            std::uint64_t get_max() const
+            {
+                return max;
+            }
+
+            //Write the count, mean, p50, p90, p99, p999 and max on a line, as name=value pairs in microseconds
+            void write(std::ostream &o) const;
+
+        friend class Stats;
+    };
+
+    //Counters and latencies of every thread, added up. Each thread records on its own counters, so recording takes no locks or atomic additions. Latencies are always recorded. Counters are only counted when built with TEXTGUN_STATS, otherwise counting does nothing and every counter stays at 0
+    class Stats
+    {
+        /* Attributes */
+
+        /*Totals*/
+        private:
+
+            std::uint64_t totals[static_cast<int>(Counter::COUNT)];//Value of each counter
+            LatencyHistogram latencies[static_cast<int>(Op::COUNT)];//Latencies of each operation
+
+        /*Threads*/
+        private:
+
+            //Counters and latencies of one thread. Only that thread changes them, others read them while adding them up
+            struct Local
+            {
+                std::atomic<std::uint64_t> v[static_cast<int>(Counter::COUNT)];//Value of each counter
+                std::vector< std::atomic<std::uint64_t> > buckets;//Latencies of each operation, LatencyHistogram::BUCKETS per operation
+                std::atomic<std::uint64_t> sums[static_cast<int>(Op::COUNT)];//Sum of the latencies of each operation
+                std::atomic<std::uint64_t> maxes[static_cast<int>(Op::COUNT)];//Largest latency of each operation
+
+                //Register them, starting at 0
+                Local();
+
+                //Keep them on the totals of finished threads, and unregister them
+                ~Local();
+            };
+
+            static std::mutex threads_lock;//Guards the list and the totals
+            static std::vector<Local*> threads;//Counters of the running threads
+            static Stats finished;//Totals of the finished threads
+            static Stats base;//Totals on the last reset
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, every counter at 0, and no latencies
+            Stats();
+
+        /* Methods */
+
+        /*Counting*/
+        public:
+
+            //Add to a counter of this thread
+            static void add(Counter c,std::uint64_t n=1)
+            {
+#ifdef TEXTGUN_STATS
+                //Only this thread writes it, so a plain load and store are enough
+                std::atomic<std::uint64_t> &x=local().v[static_cast<int>(c)];
+                x.store(x.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+#else
+                (void)c;
+                (void)n;
+#endif
+            }
+
+            //Adds the time spent on a scope to a counter of this thread, in nanoseconds
+            class Timer
+            {
+#ifdef TEXTGUN_STATS
+                private:
+
+                    Counter c;//Counter to add to
+                    std::chrono::steady_clock::time_point t;//Start
+#endif
+
+                public:
+
+                    //Start timing
+                    explicit Timer(Counter nc)
+#ifdef TEXTGUN_STATS
+                    :c(nc),t(std::chrono::steady_clock::now())
+                    {}
+#else
+                    {
+                        (void)nc;
+                    }
+#endif
+
+                    //Stop timing, and add the time
+                    ~Timer()
+                    {
+#ifdef TEXTGUN_STATS
+                        add(c,std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t).count());
+#endif
+                    }
+
+                    Timer(const Timer&)=delete;
+                    Timer& operator=(const Timer&)=delete;
+            };
+
+            //Check if the library counts, that is, if it was built with TEXTGUN_STATS
+            static bool enabled();
+
+        /*Latencies*/
+        public:
+
+            //Record a latency of an operation on this thread
+            static void record(Op op,std::uint64_t ns);
+
+            //Records the time spent on a scope as a latency of an operation
+            class Latency
+            {
+                private:
+
+                    Op op;//Operation timed
+                    std::chrono::steady_clock::time_point t;//Start
+
+                public:
+
+                    //Start timing
+                    explicit Latency(Op nop)
+                    :op(nop),t(std::chrono::steady_clock::now())
+                    {}
+
+                    //Stop timing, and record the time
+                    ~Latency()
+                    {
+                        record(op,std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t).count());
+                    }
+
+                    Latency(const Latency&)=delete;
+                    Latency& operator=(const Latency&)=delete;
+            };
+
+        /*Totals*/
+        public:
+
+            //Add up the counters and latencies of every thread since the last reset, finished threads included
+            static Stats collect();
+
+            //Start again from 0: later collects leave out everything recorded until now
+            static void reset();
+
+            //Get the value of a counter
+            std::uint64_t get(Counter c) const;
+
+            //Get the latencies of an operation
+            const LatencyHistogram& get(Op op) const;
+
+            //Counts and latencies since an earlier collect
+            Stats since(const Stats &before) const;
+
+            //Write every counter on a line, as name=value pairs separated by spaces
+            void write(std::ostream &o) const;
+
+            //Write a line for each operation with any latencies, starting with its name
+            void write_latencies(std::ostream &o) const;
+
+            //Name of a counter, such as "tokens"
+            static const char* name(Counter c);
+
+            //Name of an operation, such as "think"
+            static const char* name(Op op);
+
+        private:
+
+            //Add the counters and latencies of a thread
+            void gather(const Local &l);
+
+            //Everything recorded by every thread since the start. The lock must be held
+            static Stats total();
+
+            //Counters and latencies of this thread
+            static Local& local()
+            {
+                thread_local Local l;
+                return l;
+            }
+    };
+
+    /*
+        Template definitions
+    */
+
+    /* Threads */
+
+    //Call fn(k) for every k in [0,count), spread over the given number of threads (0 for one per core)
+    template<class F> void parallel_for(int count,unsigned threads,F fn)
+    {
+        if (!threads)
+            threads=default_threads();
+        if (threads>static_cast<unsigned>(count))
+            threads=count;
+
+        //Next k to be processed, shared by all threads
+        std::atomic<int> next(0);
+        auto work=[&]
+        {
+            for (int k=next++;k<count;k=next++)
+                fn(k);
+        };
+
+        //This thread works too
+        std::vector<std::thread> pool;
+        for (unsigned t=1;t<threads;++t)
+            pool.emplace_back(work);
+        work();
+
+        for (std::thread &t : pool)
+            t.join();
+    }
 
 }//End of namespace
 
@@ -0,0 +1,708 @@
+/*
+ * TextGunServer.cpp
+ *
+ * Copyright 2016 Joaquín Monteagudo Gómez <kindos7@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+    C++ library (source file)
+    TextGun
+    Local server that keeps a model loaded and answers requests over a Unix domain socket (Linux only)
+*/
+
+/*
+    Preprocessor
+*/
+
+/* Includes */
+
+//Header file
+#include "TextGunServer.hpp"
+
+//System calls
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace TextGun
+{
+    /*
+        Init
+    */
+
+    /* Server */
+
+    /*Limits*/
+
+    //Largest frame accepted, in bytes
+    const std::uint32_t Server::MAX_FRAME=16<<20;
+
+    //Most lines generated by one request
+    const std::uint32_t Server::MAX_LINES=1<<16;
+
+    //Most events handled per wait
+    const int Server::MAX_EVENTS=64;
+
+    /*
+        Functions
+    */
+
+    /* Frames */
+
+    //Append a 4 byte little endian number
+    static void put_u32(std::string &s,std::uint32_t x)
+    {
+        for (int k=0;k<4;++k)
+            s+=static_cast<char>((x>>(8*k))&0xFF);
+    }
+
+    //Append a 8 byte little endian number
+    static void put_u64(std::string &s,std::uint64_t x)
+    {
+        for (int k=0;k<8;++k)
+            s+=static_cast<char>((x>>(8*k))&0xFF);
+    }
+
+    //Read a 4 byte little endian number
+    static std::uint32_t get_u32(const char *p)
+    {
+        std::uint32_t x=0;
+        for (int k=0;k<4;++k)
+            x|=static_cast<std::uint32_t>(static_cast<unsigned char>(p[k]))<<(8*k);
+        return x;
+    }
+
+    //Read a 8 byte little endian number
+    static std::uint64_t get_u64(const char *p)
+    {
+        std::uint64_t x=0;
+        for (int k=0;k<8;++k)
+            x|=static_cast<std::uint64_t>(static_cast<unsigned char>(p[k]))<<(8*k);
+        return x;
+    }
+
+    //Build a response frame
+    static std::string response(Status st,const std::string &body=std::string())
+    {
+        std::string s;
+        s.reserve(5+body.size());
+        put_u32(s,static_cast<std::uint32_t>(1+body.size()));
+        s+=static_cast<char>(st);
+        s+=body;
+        return s;
+    }
+
+    //Write a whole buffer to a blocking socket. Return false on errors
+    static bool send_all(int fd,const char *p,std::size_t n)
+    {
+        while (n)
+        {
+            ssize_t w=::send(fd,p,n,MSG_NOSIGNAL);
+            if (w<0)
+            {
+                if (errno==EINTR)
+                    continue;
+                return false;
+            }
+            p+=w;
+            n-=w;
+        }
+        return true;
+    }
+
+    //Read a whole buffer from a blocking socket. Return false on errors or if it's closed
+    static bool recv_all(int fd,char *p,std::size_t n)
+    {
+        while (n)
+        {
+            ssize_t r=::recv(fd,p,n,0);
+            if (r<0&&errno==EINTR)
+                continue;
+            if (r<=0)
+                return false;
+            p+=r;
+            n-=r;
+        }
+        return true;
+    }
+
+    //Fill the address of a socket path. Return false if it's too long
+    static bool make_address(const std::string &path,sockaddr_un &addr)
+    {
+        addr=sockaddr_un();
+        addr.sun_family=AF_UNIX;
+        if (path.empty()||path.size()>=sizeof(addr.sun_path))
+            return false;
+        path.copy(addr.sun_path,path.size());
+        return true;
+    }
+
+    /*
+        Server
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Complete constructor, serve a model with the given number of workers (0 for one per core), optionally allowing learn requests
+    Server::Server(LiveModel &m,unsigned nthreads,bool nlearning)
+    :model(m),learning(nlearning),path(),listen_fd(-1),epoll_fd(-1),wake_fd(-1),conns(),next_id(0),
+     threads(nthreads?nthreads:default_threads()),workers(),jobs_lock(),jobs_ready(),pending(),done(),stopping(false),
+     seeds(std::random_device()())
+    {}
+
+    /*Copy control*/
+
+    //Close every socket, and remove the socket file
+    Server::~Server()
+    {
+        for (auto &c : conns)
+            ::close(c.first);
+
+        if (listen_fd>=0)
+        {
+            ::close(listen_fd);
+            ::unlink(path.c_str());
+        }
+        if (epoll_fd>=0)
+            ::close(epoll_fd);
+        if (wake_fd>=0)
+            ::close(wake_fd);
+    }
+
+    /* Methods */
+
+    /*Run*/
+
+    //Start listening on a socket path, replacing a stale socket file. Return false on errors
+    bool Server::listen(const std::string &npath)
+    {
+        sockaddr_un addr;
+        if (listen_fd>=0||!make_address(npath,addr))
+            return false;
+
+        //Only remove sockets, never regular files
+        struct stat st;
+        if (::stat(npath.c_str(),&st)==0&&S_ISSOCK(st.st_mode))
+            ::unlink(npath.c_str());
+
+        listen_fd=::socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+        if (listen_fd<0)
+            return false;
+
+        if (::bind(listen_fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0||::listen(listen_fd,SOMAXCONN)<0)
+        {
+            ::close(listen_fd);
+            listen_fd=-1;
+            return false;
+        }
+        path=npath;
+
+        epoll_fd=::epoll_create1(EPOLL_CLOEXEC);
+        wake_fd=::eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        if (epoll_fd<0||wake_fd<0)
+            return false;
+
+        epoll_event ev=epoll_event();
+        ev.events=EPOLLIN;
+        ev.data.fd=listen_fd;
+        if (::epoll_ctl(epoll_fd,EPOLL_CTL_ADD,listen_fd,&ev)<0)
+            return false;
+        ev.data.fd=wake_fd;
+        return ::epoll_ctl(epoll_fd,EPOLL_CTL_ADD,wake_fd,&ev)==0;
+    }
+
+    //Serve requests until stop is called. Return false if the server isn't listening
+    bool Server::run()
+    {
+        if (listen_fd<0||epoll_fd<0||wake_fd<0)
+            return false;
+
+        for (unsigned t=0;t<threads;++t)
+            workers.emplace_back(&Server::work,this);
+
+        std::vector<epoll_event> events(MAX_EVENTS);
+        while (!stopping)
+        {
+            int n=::epoll_wait(epoll_fd,events.data(),MAX_EVENTS,-1);
+            if (n<0)
+            {
+                if (errno==EINTR)
+                    continue;
+                break;
+            }
+
+            for (int k=0;k<n;++k)
+            {
+                int fd=events[k].data.fd;
+
+                if (fd==listen_fd)
+                    accept_all();
+                else if (fd==wake_fd)
+                {
+                    std::uint64_t x;
+                    while (::read(wake_fd,&x,sizeof(x))>0);
+                    deliver();
+                }
+                else
+                {
+                    auto it=conns.find(fd);
+                    if (it==conns.end())
+                        continue;
+                    Connection &c=it->second;
+
+                    bool ok=true;
+                    if (events[k].events&(EPOLLIN|EPOLLHUP|EPOLLERR))
+                        ok=receive(fd,c);
+                    if (ok&&(events[k].events&EPOLLOUT))
+                        ok=flush(fd,c);
+                    if (ok)
+                        dispatch(fd,c);
+                    if (!ok)
+                        close(fd);
+                }
+            }
+        }
+
+        //Let the workers finish what they're running, and drop the rest
+        {
+            std::lock_guard<std::mutex> guard(jobs_lock);
+            stopping=true;
+            pending.clear();
+        }
+        jobs_ready.notify_all();
+        for (std::thread &t : workers)
+            t.join();
+        workers.clear();
+
+        return true;
+    }
+
+    //Make run return. Can be called from any thread, or from a signal handler
+    void Server::stop()
+    {
+        stopping=true;
+
+        std::uint64_t one=1;
+        if (wake_fd>=0&&::write(wake_fd,&one,sizeof(one))<0)
+        {
+            //Nothing to do, the loop is already being woken
+        }
+    }
+
+    /*Loop*/
+
+    //Accept every pending connection
+    void Server::accept_all()
+    {
+        for (;;)
+        {
+            int fd=::accept4(listen_fd,nullptr,nullptr,SOCK_NONBLOCK|SOCK_CLOEXEC);
+            if (fd<0)
+                return;//No more, or out of descriptors until some are closed
+
+            epoll_event ev=epoll_event();
+            ev.events=EPOLLIN|EPOLLRDHUP;
+            ev.data.fd=fd;
+            if (::epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev)<0)
+            {
+                ::close(fd);
+                continue;
+            }
+
+            conns[fd]=Connection{next_id++,std::string(),std::string(),false,ev.events,false,false};
+        }
+    }
+
+    //Read everything available on a connection. Return false if it must be closed
+    bool Server::receive(int fd,Connection &c)
+    {
+        //Input isn't watched after the end of it, so the client hung up or failed
+        if (c.eof)
+            return false;
+
+        char buf[1<<16];
+        for (;;)
+        {
+            //A whole frame is alredy waiting, leave the rest on the socket until it's handled
+            if (c.in.size()>4+static_cast<std::size_t>(MAX_FRAME))
+                return watch(fd,c);
+
+            ssize_t r=::recv(fd,buf,sizeof(buf),0);
+            if (r>0)
+            {
+                if (!c.closing)
+                    c.in.append(buf,r);
+            }
+            else if (r==0)
+            {
+                //The client may only have shut down its side, and still wait for the responses
+                c.eof=true;
+                return watch(fd,c);
+            }
+            else if (errno==EINTR)
+                continue;
+            else
+                return errno==EAGAIN||errno==EWOULDBLOCK;
+        }
+    }
+
+    //Send what's possible of the output of a connection. Return false if it must be closed
+    bool Server::flush(int fd,Connection &c)
+    {
+        std::size_t sent=0;
+        while (sent<c.out.size())
+        {
+            ssize_t w=::send(fd,c.out.data()+sent,c.out.size()-sent,MSG_NOSIGNAL);
+            if (w>=0)
+                sent+=w;
+            else if (errno==EINTR)
+                continue;
+            else if (errno==EAGAIN||errno==EWOULDBLOCK)
+                break;
+            else
+                return false;
+        }
+        c.out.erase(0,sent);
+
+        if (c.out.empty()&&c.closing)
+            return false;
+
+        return watch(fd,c);
+    }
+
+    //Hand the next complete request of a connection to the workers, once the last response is sent
+    void Server::dispatch(int fd,Connection &c)
+    {
+        //A client that doesn't read its responses gets no more work done
+        if (c.busy||c.closing||!c.out.empty())
+            return;
+
+        std::uint32_t len=(c.in.size()<4)?0:get_u32(c.in.data());
+        if (c.in.size()<4||(len<=MAX_FRAME&&c.in.size()-4<len))
+        {
+            //Not complete yet. Every request of a client that sent all it will is answered by now, a partial one never completes
+            if (c.eof)
+                close(fd);
+            return;
+        }
+
+        if (len>MAX_FRAME)
+        {
+            //The rest of the stream can't be trusted, answer and close
+            c.out+=response(Status::TOO_LARGE);
+            c.closing=true;
+            c.in.clear();
+            if (!flush(fd,c))
+                close(fd);
+            return;
+        }
+
+        Job j{fd,c.id,c.in.substr(4,len),std::string()};
+        c.in.erase(0,4+static_cast<std::size_t>(len));
+        c.busy=true;
+
+        //There may be room for input again
+        if (!watch(fd,c))
+        {
+            close(fd);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(jobs_lock);
+            pending.push_back(std::move(j));
+        }
+        jobs_ready.notify_one();
+    }
+
+    //Wait for input only while the connection has room for it and the client may send more, and for output only while there's something to send. Return false on errors
+    bool Server::watch(int fd,Connection &c)
+    {
+        std::uint32_t want=0;
+        if (!c.eof)
+            want|=EPOLLRDHUP;
+        if (!c.eof&&c.in.size()<=4+static_cast<std::size_t>(MAX_FRAME))
+            want|=EPOLLIN;
+        if (!c.out.empty())
+            want|=EPOLLOUT;
+
+        if (want==c.events)
+            return true;
+
+        epoll_event ev=epoll_event();
+        ev.events=want;
+        ev.data.fd=fd;
+        if (::epoll_ctl(epoll_fd,EPOLL_CTL_MOD,fd,&ev)<0)
+            return false;
+        c.events=want;
+
+        return true;
+    }
+
+    //Send the responses of the finished jobs
+    void Server::deliver()
+    {
+        std::deque<Job> ready;
+        {
+            std::lock_guard<std::mutex> guard(jobs_lock);
+            ready.swap(done);
+        }
+
+        for (Job &j : ready)
+        {
+            //The connection may have been closed, and its fd reused
+            auto it=conns.find(j.fd);
+            if (it==conns.end()||it->second.id!=j.id)
+                continue;
+            Connection &c=it->second;
+
+            c.out+=j.response;
+            c.busy=false;
+            if (!flush(j.fd,c))
+                close(j.fd);
+            else
+                dispatch(j.fd,c);
+        }
+    }
+
+    //Close a connection
+    void Server::close(int fd)
+    {
+        ::epoll_ctl(epoll_fd,EPOLL_CTL_DEL,fd,nullptr);
+        ::close(fd);
+        conns.erase(fd);
+    }
+
+    /*Workers*/
+
+    //Run jobs until the server stops
+    void Server::work()
+    {
+        for (;;)
+        {
+            Job j;
+            {
+                std::unique_lock<std::mutex> guard(jobs_lock);
+                jobs_ready.wait(guard,[this]{return stopping||!pending.empty();});
+                if (stopping)
+                    return;
+                j=std::move(pending.front());
+                pending.pop_front();
+            }
+
+            j.response=answer(j.request);
+            j.request.clear();
+
+            {
+                std::lock_guard<std::mutex> guard(jobs_lock);
+                done.push_back(std::move(j));
+            }
+
+            std::uint64_t one=1;
+            if (::write(wake_fd,&one,sizeof(one))<0)
+            {
+                //The counter is already set, the loop will be woken anyway
+            }
+        }
+    }
+
+    //Run a request, and build its response frame
+    std::string Server::answer(const std::string &request)
+    {
+        if (request.empty())
+            return response(Status::BAD_REQUEST);
+
+        switch (static_cast<RequestType>(request[0]))
+        {
+            case RequestType::GENERATE:
+            {
+                if (request.size()!=13)
+                    return response(Status::BAD_REQUEST);
+
+                std::uint32_t lines=get_u32(request.data()+1);
+                std::uint64_t seed=get_u64(request.data()+5);
+                if (lines>MAX_LINES)
+                    return response(Status::TOO_LARGE);
+
+                //Each request has its own engine, so the same seed always gives the same lines on the same version
+                if (!seed)
+                    seed=seeds.fetch_add(0x9E3779B97F4A7C15ULL);
+                std::default_random_engine eng(static_cast<unsigned int>(seed^(seed>>32)));
+
+                //Every line of a request comes from the same version
+                std::shared_ptr<const FrozenModel> version=model.get();
+
+                std::ostringstream o;
+                OTextStream ots(o);
+                for (std::uint32_t k=0;k<lines;++k)
+                    version->think(ots,eng);
+
+                return response(Status::OK,o.str());
+            }
+
+            case RequestType::LEARN:
+            {
+                if (!learning)
+                    return response(Status::REFUSED);
+
+                //Learn line by line, so other requests can run between them
+                std::uint32_t lines=0;
+                std::istringstream text(request.substr(1));
+                for (std::string s;std::getline(text,s);)
+                {
+                    if (s.empty())//Don't learn blank lines
+                        continue;
+
+                    std::stringstream ss(s);
+                    ITextStream ts(ss);
+                    model.learn(ts);
+                    ++lines;
+                }
+
+                std::string body;
+                put_u32(body,lines);
+                return response(Status::OK,body);
+            }
+
+            default:
+                return response(Status::BAD_REQUEST);
+        }
+    }
+
+    /*
+        Client
+    */
+
+    /* Constructors, copy control */
+
+    /*Constructors*/
+
+    //Default constructor, not connected
+    Client::Client()
+    :fd(-1)
+    {}
+
+    /*Copy control*/
+
+    //Close the connection
+    Client::~Client()
+    {
+        close();
+    }
+
+    /* Methods */
+
+    /*Connection*/
+
+    //Connect to a server. Return false on errors
+    bool Client::connect(const std::string &path)
+    {
+        close();
+
+        sockaddr_un addr;
+        if (!make_address(path,addr))
+            return false;
+
+        fd=::socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+        if (fd<0)
+            return false;
+
+        if (::connect(fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    //Close the connection
+    void Client::close()
+    {
+        if (fd>=0)
+            ::close(fd);
+        fd=-1;
+    }
+
+    /*Requests*/
+
+    //Generate lines, with a seed (0 to let the server pick one). Return the status, BAD_REQUEST if the connection failed
+    Status Client::generate(std::uint32_t lines,std::uint64_t seed,std::string &text)
+    {
+        std::string req(1,static_cast<char>(RequestType::GENERATE));
+        put_u32(req,lines);
+        put_u64(req,seed);
+
+        std::string res;
+        if (!call(req,res))
+            return Status::BAD_REQUEST;
+
+        text.assign(res,1,std::string::npos);
+        return static_cast<Status>(res[0]);
+    }
+
+    //Learn every line of a text. Return the status, BAD_REQUEST if the connection failed
+    Status Client::learn(const std::string &text,std::uint32_t &lines)
+    {
+        std::string req(1,static_cast<char>(RequestType::LEARN));
+        req+=text;
+
+        std::string res;
+        if (!call(req,res))
+            return Status::BAD_REQUEST;
+
+        Status st=static_cast<Status>(res[0]);
+        if (st==Status::OK&&res.size()==5)
+            lines=get_u32(res.data()+1);
+        return st;
+    }
+
+    //Send a request frame and read the response frame, without the length
+    bool Client::call(const std::string &request,std::string &response)
+    {
+        if (fd<0)
+            return false;
+
+        std::string frame;
+        put_u32(frame,static_cast<std::uint32_t>(request.size()));
+        frame+=request;
+
+        char len[4];
+        if (!send_all(fd,frame.data(),frame.size())||!recv_all(fd,len,4))
+        {
+            close();
+            return false;
+        }
+
+        response.resize(get_u32(len));
+        if (response.empty()||!recv_all(fd,&response[0],response.size()))
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+}//End of namespace
@@ -0,0 +1,296 @@
+/*
+ * TextGunServer.hpp
+ *
+ * Copyright 2016 Joaquín Monteagudo Gómez <kindos7@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+    C++ library (header file)
+    TextGun
+    Local server that keeps a model loaded and answers requests over a Unix domain socket (Linux only)
+*/
+
+/*
+    Preprocessor
+*/
+
+/*Header guard*/
+#ifndef _TEXT_GUN_SERVER_H_
+#define _TEXT_GUN_SERVER_H_
+
+
+/* Includes */
+
+#include "TextGun.hpp"//Models
+
+#include <string>//Strings
+#include <vector>//Vectors
+#include <deque>//Job queues
+#include <unordered_map>//Connections
+#include <thread>//Workers
+#include <mutex>//Locks
+#include <condition_variable>//Waking workers
+#include <atomic>//Stop flag, seeds
+#include <cstdint>//Fixed width integers
+
+/*
+    Protocol
+
+    Every message is a frame: a 4 byte little endian length, followed by that many bytes
+    Requests start with their type:
+        'G' lines(4 bytes) seed(8 bytes)    generate lines, with a seed (0 for one picked by the server)
+        'L' text                            learn every line of the text, if the server allows it
+    Responses start with a Status, followed by the generated text, or the number of lines learned (4 bytes)
+    Requests on the same connection are answered in order
+*/
+
+namespace TextGun
+{
+    /*
+        Class definitions
+    */
+
+    enum class RequestType : char;//Type of a request
+
+    enum class Status : char;//Result of a request
+
+    class Server;//Keeps a model loaded, and answers requests over a Unix domain socket
+
+    class Client;//Connection to a server
+
+    /*
+        Data types
+     */
+
+    /* Classes */
+
+    //Type of a request
+    enum class RequestType : char
+    {
+        GENERATE='G',//Generate lines
+        LEARN='L'//Learn lines
+    };
+
+    //Result of a request
+    enum class Status : char
+    {
+        OK=0,//Done
+        BAD_REQUEST,//Malformed or unknown request
+        TOO_LARGE,//Frame or number of lines over the limits. The connection is closed
+        REFUSED//Valid, but not allowed, such as learning on a read-only server
+    };
+
+    //Keeps a model loaded, and answers requests over a Unix domain socket. One thread runs an epoll loop doing all the socket I/O, and a pool of workers runs the requests. Lines are generated from the last published version of the model, so they never wait for learn requests
+    class Server
+    {
+        /* Config */
+
+        /*Limits*/
+        public:
+
+            //Largest frame accepted, in bytes
+            static const std::uint32_t MAX_FRAME;
+
+            //Most lines generated by one request
+            static const std::uint32_t MAX_LINES;
+
+        private:
+
+            //Most events handled per wait
+            static const int MAX_EVENTS;
+
+        /* Attributes */
+
+        /*Model*/
+        private:
+
+            LiveModel &model;//Model served
+            bool learning;//Learn requests are allowed
+
+        /*Sockets*/
+        private:
+
+            std::string path;//Path of the socket
+            int listen_fd;//Listening socket
+            int epoll_fd;//Event loop
+            int wake_fd;//Wakes the loop when a request is done, or the server stops
+
+        /*Connections*/
+        private:
+
+            //A client connection. Only the loop thread touches them
+            struct Connection
+            {
+                std::uint64_t id;//Unique, as fds are reused
+                std::string in;//Bytes received, not yet handled
+                std::string out;//Bytes to send
+                bool busy;//A request is running. The next one waits for it, so responses are in order
+                std::uint32_t events;//Events the loop waits for
+                bool closing;//Close once everything's sent
+                bool eof;//The client sent all it will. Close once every request received is answered
+            };
+
+            std::unordered_map< int,Connection > conns;//Connections, by fd
+            std::uint64_t next_id;//Id of the next connection
+
+        /*Workers*/
+        private:
+
+            //A request, and its response once it's done
+            struct Job
+            {
+                int fd;//Connection
+                std::uint64_t id;//Id of the connection, to tell if it's still the same
+                std::string request;//Frame received, without the length
+                std::string response;//Frame to send, length included
+            };
+
+            unsigned threads;//Number of workers
+            std::vector<std::thread> workers;//Run the requests
+            std::mutex jobs_lock;//Guards both queues
+            std::condition_variable jobs_ready;//Signals the workers
+            std::deque<Job> pending;//Requests to run
+            std::deque<Job> done;//Responses to send
+            std::atomic<bool> stopping;//The server must stop
+            std::atomic<std::uint64_t> seeds;//Source of seeds for requests that don't bring one
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Complete constructor, serve a model with the given number of workers (0 for one per core), optionally allowing learn requests
+            Server(LiveModel &m,unsigned nthreads=0,bool nlearning=false);
+
+        /*Copy control*/
+        public:
+
+            //Not copyable
+            Server(const Server&)=delete;
+            Server& operator=(const Server&)=delete;
+
+            //Close every socket, and remove the socket file
+            ~Server();
+
+        /* Methods */
+
+        /*Run*/
+        public:
+
+            //Start listening on a socket path, replacing a stale socket file. Return false on errors
+            bool listen(const std::string &npath);
+
+            //Serve requests until stop is called. Return false if the server isn't listening
+            bool run();
+
+            //Make run return. Can be called from any thread, or from a signal handler
+            void stop();
+
+        /*Loop*/
+        private:
+
+            //Accept every pending connection
+            void accept_all();
+
+            //Read everything available on a connection. Return false if it must be closed
+            bool receive(int fd,Connection &c);
+
+            //Send what's possible of the output of a connection. Return false if it must be closed
+            bool flush(int fd,Connection &c);
+
+            //Hand the next complete request of a connection to the workers, once the last response is sent
+            void dispatch(int fd,Connection &c);
+
+            //Wait for input only while the connection has room for it, and for output only while there's something to send. Return false on errors
+            bool watch(int fd,Connection &c);
+
+            //Send the responses of the finished jobs
+            void deliver();
+
+            //Close a connection
+            void close(int fd);
+
+        /*Workers*/
+        private:
+
+            //Run jobs until the server stops
+            void work();
+
+            //Run a request, and build its response frame
+            std::string answer(const std::string &request);
+    };
+
+    //Connection to a server, making one request at a time
+    class Client
+    {
+        /* Attributes */
+
+        /*Socket*/
+        private:
+
+            int fd;//Connected socket, -1 if not connected
+
+        /* Constructors, copy control */
+
+        /*Constructors*/
+        public:
+
+            //Default constructor, not connected
+            Client();
+
+        /*Copy control*/
+        public:
+
+            //Not copyable
+            Client(const Client&)=delete;
+            Client& operator=(const Client&)=delete;
+
+            //Close the connection
+            ~Client();
+
+        /* Methods */
+
+        /*Connection*/
+        public:
+
+            //Connect to a server. Return false on errors
+            bool connect(const std::string &path);
+
+            //Close the connection
+            void close();
+
+        /*Requests*/
+        public:
+
+            //Generate lines, with a seed (0 to let the server pick one). Return the status, BAD_REQUEST if the connection failed
+            Status generate(std::uint32_t lines,std::uint64_t seed,std::string &text);
+
+            //Learn every line of a text. Return the status, BAD_REQUEST if the connection failed
+            Status learn(const std::string &text,std::uint32_t &lines);
+
+        private:
+
+            //Send a request frame and read the response frame, without the length
+            bool call(const std::string &request,std::string &response);
+    };
+}//End of namespace
+
+//End of library
+#endif // _TEXT_GUN_SERVER_H_
@@ -0,0 +1,576 @@
+//TextGun benchmarks
+#include "TextGun.hpp"
+
+#include <string>//Strings
+
+#include <sstream>//String stream
+
+#include <fstream>//File stream
+
+#include <iostream>//Print to console
+
+#include <iomanip>//Output formatting
+
+#include <chrono>//Timing
+
+#include <random>//Synthetic text
+
+#include <cmath>//Word distribution
+
+#include <cstdlib>//Argument parsing
+
+#include <vector>//Results
+
+#include <map>//Baseline values
+
+#include <functional>//Benchmark table
+
+#include <algorithm>//Sorting latencies
+
+#include <future>//Background snapshots
+
+//A measured value
+struct Result
+{
+    std::string name;//Name of the benchmark
+    double value;//Measured value
+    std::string unit;//Unit of the value
+    bool higher_better;//Higher values are better
+};
+
+//Settings of a run
+struct Settings
+{
+    double scale=1;//Multiplies the size of every benchmark
+    int reps=3;//Repetitions, the best one is reported
+    std::string filter;//Only run the benchmarks whose name contains it
+    std::string json;//File to write the results to as JSON, "-" for standard output
+    std::string baseline;//JSON file of a previous run to compare with
+    double threshold=0.05;//Fraction a value can get worse before it's a regression
+};
+
+/* Helpers */
+
+//Seconds since a point in time
+double seconds_since(std::chrono::steady_clock::time_point t);
+
+//Best time of several repetitions of a function, in seconds
+double best_of(int reps,const std::function<void()> &fn);
+
+//Synthetic corpus, a number of lines
+std::vector<std::string> make_corpus(int lines,int vocab,std::uint64_t seed);
+
+//Number of words a text stream gives for a line
+int count_words(const std::string &line);
+
+/* Benchmarks */
+
+//read_utf8_character throughput
+void bench_utf8(const Settings &s,std::vector<Result> &out);
+
+//ITextStream throughput, with and without a token cache
+void bench_tokenize(const Settings &s,std::vector<Result> &out);
+
+//WordModel::learn throughput, line by line and in batches
+void bench_learn(const Settings &s,std::vector<Result> &out);
+
+//FrecLink::add_word and pick at several fan-outs
+void bench_freclink(const Settings &s,std::vector<Result> &out);
+
+//WordModel::think latency
+void bench_think(const Settings &s,std::vector<Result> &out);
+
+//WordModel::write and read time per MB
+void bench_io(const Settings &s,std::vector<Result> &out);
+
+//WordModel::learn latency while a snapshot is written in the background
+void bench_snapshot(const Settings &s,std::vector<Result> &out);
+
+/* Output */
+
+//Write the results as JSON
+void write_json(std::ostream &o,const std::vector<Result> &results);
+
+//Read the values of a JSON file written by write_json. Return false if it couldn't be read
+bool read_json(const std::string &path,std::map<std::string,double> &values);
+
+//Print the results, compared with a baseline if there's one. Return the number of regressions
+int print_results(const std::vector<Result> &results,const std::map<std::string,double> &baseline,double threshold);
+
+int main(int argc,char **argv)
+{
+    Settings s;
+
+    //Read the arguments
+    for (int k=1;k<argc;++k)
+    {
+        std::string arg=argv[k];
+        bool has_value=k+1<argc;
+
+        if (arg=="--scale"&&has_value)
+            s.scale=std::atof(argv[++k]);
+        else if (arg=="--reps"&&has_value)
+            s.reps=std::max(1,std::atoi(argv[++k]));
+        else if (arg=="--filter"&&has_value)
+            s.filter=argv[++k];
+        else if (arg=="--json"&&has_value)
+            s.json=argv[++k];
+        else if (arg=="--baseline"&&has_value)
+            s.baseline=argv[++k];
+        else if (arg=="--threshold"&&has_value)
+            s.threshold=std::atof(argv[++k]);
+        else
+        {
+            std::cerr<<"Usage: "<<argv[0]<<" [--scale X] [--reps N] [--filter NAME] [--json FILE|-] [--baseline FILE] [--threshold FRACTION]\n";
+            return 2;
+        }
+    }
+
+    //Previous results
+    std::map<std::string,double> baseline;
+    if (!s.baseline.empty()&&!read_json(s.baseline,baseline))
+    {
+        std::cerr<<"ERROR! Reading baseline "<<s.baseline<<'\n';
+        return 2;
+    }
+
+    //Benchmarks, by name
+    const std::vector< std::pair< std::string,std::function<void(const Settings&,std::vector<Result>&)> > > benchmarks=
+    {
+        {"utf8",bench_utf8},
+        {"tokenize",bench_tokenize},
+        {"learn",bench_learn},
+        {"freclink",bench_freclink},
+        {"think",bench_think},
+        {"io",bench_io},
+        {"snapshot",bench_snapshot}
+    };
+
+    std::vector<Result> results;
+    for (const auto &b : benchmarks)
+    {
+        if (!s.filter.empty()&&b.first.find(s.filter)==std::string::npos)
+            continue;
+
+        std::cerr<<"Running "<<b.first<<"...\n";
+        b.second(s,results);
+    }
+
+    int regressions=print_results(results,baseline,s.threshold);
+
+    //Machine readable output
+    if (s.json=="-")
+        write_json(std::cout,results);
+    else if (!s.json.empty())
+    {
+        std::ofstream o(s.json);
+        write_json(o,results);
+        if (!o)
+        {
+            std::cerr<<"ERROR! Writing "<<s.json<<'\n';
+            return 2;
+        }
+    }
+
+    return regressions?1:0;
+}
+
+/* Helpers */
+
+//Seconds since a point in time
+double seconds_since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-t).count();
+}
+
+//Best time of several repetitions of a function, in seconds
+double best_of(int reps,const std::function<void()> &fn)
+{
+    double best=0;
+    for (int k=0;k<reps;++k)
+    {
+        auto t=std::chrono::steady_clock::now();
+        fn();
+        double el=seconds_since(t);
+        if (!k||el<best)
+            best=el;
+    }
+    return best;
+}
+
+//Synthetic corpus, a number of lines
+std::vector<std::string> make_corpus(int lines,int vocab,std::uint64_t seed)
+{
+    TextGun::CorpusGenerator gen(seed,vocab);
+    std::vector<std::string> corpus;
+    corpus.reserve(lines);
+    for (int k=0;k<lines;++k)
+        corpus.push_back(gen.line());
+    return corpus;
+}
+
+//Number of words a text stream gives for a line
+int count_words(const std::string &line)
+{
+    std::stringstream ss(line);
+    TextGun::ITextStream ts(ss);
+    int n=0;
+    while (ts.has_words())
+    {
+        ts.read();
+        ++n;
+    }
+    return n;
+}
+
+/* Benchmarks */
+
+//read_utf8_character throughput
+void bench_utf8(const Settings &s,std::vector<Result> &out)
+{
+    //Mixed one, two and three byte characters
+    const std::string piece="el ni\xC3\xB1o \xC2\xBFqu\xC3\xA9? \xE2\x82\xAC 27.5 ";
+    std::string text;
+    while (text.size()<static_cast<std::size_t>(8e6*s.scale))
+        text+=piece;
+
+    std::size_t chars=0;
+    double t=best_of(s.reps,[&]
+    {
+        chars=0;
+        auto e=text.cend();
+        for (auto it=text.cbegin();it!=e;++chars)
+            if (TextGun::read_utf8_character(it,e).empty())
+                ++it;
+    });
+
+    out.push_back({"utf8.read_character",text.size()/1e6/t,"MB/s",true});
+}
+
+//ITextStream throughput, with and without a token cache
+void bench_tokenize(const Settings &s,std::vector<Result> &out)
+{
+    std::vector<std::string> corpus=make_corpus(static_cast<int>(100000*s.scale),5000,1);
+
+    double bytes=0;
+    for (const std::string &line : corpus)
+        bytes+=line.size();
+
+    //Read every word of every line
+    auto run=[&](TextGun::TokenCache *cache)
+    {
+        for (const std::string &line : corpus)
+        {
+            std::stringstream ss(line);
+            TextGun::ITextStream ts(ss,cache);
+            while (ts.has_words())
+                ts.read();
+        }
+    };
+
+    double t=best_of(s.reps,[&]{run(nullptr);});
+    out.push_back({"tokenize.read_word",bytes/1e6/t,"MB/s",true});
+
+    TextGun::TokenCache cache;
+    t=best_of(s.reps,[&]{run(&cache);});
+    out.push_back({"tokenize.read_word_cached",bytes/1e6/t,"MB/s",true});
+}
+
+//WordModel::learn throughput, line by line and in batches
+void bench_learn(const Settings &s,std::vector<Result> &out)
+{
+    std::vector<std::string> corpus=make_corpus(static_cast<int>(100000*s.scale),5000,2);
+
+    double tokens=0;
+    for (const std::string &line : corpus)
+        tokens+=count_words(line);
+
+    //Line by line
+    double t=best_of(s.reps,[&]
+    {
+        TextGun::WordModel model;
+        for (const std::string &line : corpus)
+        {
+            std::stringstream ss(line);
+            TextGun::ITextStream ts(ss);
+            model.learn(ts);
+        }
+    });
+    out.push_back({"learn.line",tokens/t,"tokens/s",true});
+
+    //Batched, the way the CLI learns files
+    t=best_of(s.reps,[&]
+    {
+        TextGun::WordModel model;
+        TextGun::TokenCache cache;
+        TextGun::BigramBatch batch;
+        TextGun::LineCounter counter;
+        for (const std::string &line : corpus)
+        {
+            counter.add(line);
+            if (counter.full())
+            {
+                counter.fill(batch,&cache);
+                counter.clear();
+
+                if (batch.full())
+                {
+                    model.learn(batch);
+                    batch.clear();
+                }
+            }
+        }
+        counter.fill(batch,&cache);
+        model.learn(batch);
+    });
+    out.push_back({"learn.batch",tokens/t,"tokens/s",true});
+}
+
+//FrecLink::add_word and pick at several fan-outs
+void bench_freclink(const Settings &s,std::vector<Result> &out)
+{
+    TextGun::WordPool pool;
+    std::vector<const TextGun::Word*> words;
+    for (int k=0;k<16384;++k)
+        words.push_back(pool.intern(TextGun::Word("w"+std::to_string(k))));
+
+    const int ops=static_cast<int>(1000000*s.scale);
+
+    for (int fanout : {4,64,1024,16384})
+    {
+        //Words added, following a power law over the fan-out
+        std::mt19937 r(fanout);
+        std::vector<const TextGun::Word*> seq;
+        seq.reserve(ops);
+        for (int k=0;k<ops;++k)
+        {
+            double u=std::uniform_real_distribution<double>(0,1)(r);
+            seq.push_back(words[static_cast<int>(std::pow(fanout,u))-1]);
+        }
+
+        TextGun::FrecLink links;
+        double t=best_of(s.reps,[&]
+        {
+            TextGun::FrecLink fl;
+            for (const TextGun::Word *w : seq)
+                fl.add_word(w);
+            links=std::move(fl);
+        });
+        out.push_back({"freclink.add_word."+std::to_string(fanout),ops/t/1e6,"Mops/s",true});
+
+        std::size_t sink=0;
+        t=best_of(s.reps,[&]
+        {
+            for (int k=0;k<ops;++k)
+                sink+=reinterpret_cast<std::size_t>(links.pick());
+        });
+        out.push_back({"freclink.pick."+std::to_string(fanout),ops/t/1e6,"Mops/s",true});
+
+        if (sink==1)//Keep the picks from being optimized away
+            std::cerr<<"";
+    }
+}
+
+//WordModel::think latency
+void bench_think(const Settings &s,std::vector<Result> &out)
+{
+    std::vector<std::string> corpus=make_corpus(static_cast<int>(100000*s.scale),5000,3);
+
+    TextGun::WordModel model;
+    for (const std::string &line : corpus)
+    {
+        std::stringstream ss(line);
+        TextGun::ITextStream ts(ss);
+        model.learn(ts);
+    }
+
+    //Time every line on its own. The mean and the p99 both come from the repetition with the best mean
+    const int lines=static_cast<int>(50000*s.scale);
+    std::vector<double> lat(lines),best_lat;
+    double best_mean=0;
+    for (int rep=0;rep<s.reps;++rep)
+    {
+        std::ostringstream o;
+        TextGun::OTextStream os(o);
+        double sum=0;
+        for (int k=0;k<lines;++k)
+        {
+            auto t=std::chrono::steady_clock::now();
+            model.think(os);
+            lat[k]=seconds_since(t)*1e6;
+            sum+=lat[k];
+        }
+
+        if (!rep||sum/lines<best_mean)
+        {
+            best_mean=sum/lines;
+            best_lat=lat;
+        }
+    }
+
+    std::sort(best_lat.begin(),best_lat.end());
+    out.push_back({"think.mean",best_mean,"us/line",false});
+    out.push_back({"think.p99",best_lat[static_cast<std::size_t>(lines*0.99)],"us/line",false});
+}
+
+//WordModel::write and read time per MB
+void bench_io(const Settings &s,std::vector<Result> &out)
+{
+    std::vector<std::string> corpus=make_corpus(static_cast<int>(200000*s.scale),50000,4);
+
+    TextGun::WordModel model;
+    for (const std::string &line : corpus)
+    {
+        std::stringstream ss(line);
+        TextGun::ITextStream ts(ss);
+        model.learn(ts);
+    }
+
+    std::string file;
+    double t=best_of(s.reps,[&]
+    {
+        std::ostringstream o;
+        model.write(o);
+        file=o.str();
+    });
+    double mb=file.size()/1e6;
+    out.push_back({"io.write",t*1e3/mb,"ms/MB",false});
+
+    t=best_of(s.reps,[&]
+    {
+        std::istringstream i(file);
+        TextGun::WordModel m;
+        m.read(i);
+    });
+    out.push_back({"io.read",t*1e3/mb,"ms/MB",false});
+}
+
+//WordModel::learn latency while a snapshot is written in the background
+void bench_snapshot(const Settings &s,std::vector<Result> &out)
+{
+    //Longest a line may take to learn while a snapshot runs, in ms, unless lines take that long without one too
+    const double bound=5;
+
+    std::vector<std::string> corpus=make_corpus(static_cast<int>(200000*s.scale),50000,5);
+    std::vector<std::string> more=make_corpus(static_cast<int>(50000*s.scale)+1,50000,6);
+
+    TextGun::WordModel model;
+    for (const std::string &line : corpus)
+    {
+        std::stringstream ss(line);
+        TextGun::ITextStream ts(ss);
+        model.learn(ts);
+    }
+
+    //Time a line learned, in ms
+    std::size_t next=0;
+    auto learn=[&]
+    {
+        std::stringstream ss(more[next++%more.size()]);
+        TextGun::ITextStream ts(ss);
+        auto t=std::chrono::steady_clock::now();
+        model.learn(ts);
+        return seconds_since(t)*1e3;
+    };
+
+    //Lines learned before each snapshot, and while it runs
+    std::vector<double> idle,busy;
+    for (int rep=0;rep<s.reps;++rep)
+    {
+        for (int k=0;k<2000;++k)
+            idle.push_back(learn());
+
+        std::ostringstream o;
+        std::future<bool> done=model.write_async(o);
+        while (done.wait_for(std::chrono::seconds(0))!=std::future_status::ready)
+            busy.push_back(learn());
+        done.get();
+    }
+
+    std::sort(idle.begin(),idle.end());
+    std::sort(busy.begin(),busy.end());
+    if (busy.empty())
+        busy.push_back(0);
+
+    out.push_back({"snapshot.learn_p99",busy[static_cast<std::size_t>(busy.size()*0.99)],"ms/line",false});
+    out.push_back({"snapshot.learn_max",busy.back(),"ms/line",false});
+
+    if (busy.back()>bound&&busy.back()>2*idle.back())
+        std::cerr<<"WARNING! A line took "<<busy.back()<<" ms to learn while a snapshot ran, "<<idle.back()<<" ms without one\n";
+}
+
+/* Output */
+
+//Write the results as JSON
+void write_json(std::ostream &o,const std::vector<Result> &results)
+{
+    o<<"{\n  \"benchmarks\": [\n";
+    for (std::size_t k=0;k<results.size();++k)
+    {
+        const Result &r=results[k];
+        o<<"    {\"name\": \""<<r.name<<"\", \"value\": "<<std::setprecision(9)<<r.value
+         <<", \"unit\": \""<<r.unit<<"\", \"higher_is_better\": "<<(r.higher_better?"true":"false")<<"}"
+         <<(k+1<results.size()?",":"")<<"\n";
+    }
+    o<<"  ]\n}\n";
+}
+
+//Read the values of a JSON file written by write_json. Return false if it couldn't be read
+bool read_json(const std::string &path,std::map<std::string,double> &values)
+{
+    std::ifstream i(path);
+    if (!i.is_open())
+        return false;
+
+    std::stringstream ss;
+    ss<<i.rdbuf();
+    const std::string text=ss.str();
+
+    //Every entry has a name followed by its value
+    const std::string name_key="\"name\": \"",value_key="\"value\": ";
+    for (std::size_t p=text.find(name_key);p!=std::string::npos;p=text.find(name_key,p))
+    {
+        p+=name_key.size();
+        std::size_t e=text.find('"',p);
+        std::size_t v=text.find(value_key,e);
+        if (e==std::string::npos||v==std::string::npos)
+            return false;
+
+        values[text.substr(p,e-p)]=std::atof(text.c_str()+v+value_key.size());
+        p=v;
+    }
+
+    return !values.empty();
+}
+
+//Print the results, compared with a baseline if there's one. Return the number of regressions
+int print_results(const std::vector<Result> &results,const std::map<std::string,double> &baseline,double threshold)
+{
+    int regressions=0;
+
+    for (const Result &r : results)
+    {
+        std::cerr<<std::left<<std::setw(32)<<r.name<<std::right<<std::setw(14)<<std::fixed<<std::setprecision(3)<<r.value<<' '<<std::left<<std::setw(9)<<r.unit;
+
+        auto it=baseline.find(r.name);
+        if (it!=baseline.end()&&it->second>0)
+        {
+            //Positive when it got better
+            double change=(r.value-it->second)/it->second;
+            if (!r.higher_better)
+                change=-change;
+
+            std::cerr<<std::right<<std::setw(9)<<std::showpos<<std::setprecision(1)<<change*100<<'%'<<std::noshowpos;
+            if (change<-threshold)
+            {
+                std::cerr<<"  REGRESSION";
+                ++regressions;
+            }
+        }
+
+        std::cerr<<'\n';
+    }
+
+    std::cerr.unsetf(std::ios::floatfield);
+    return regressions;
+}
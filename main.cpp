@@ -11,6 +11,35 @@
 
 #include <exception>//Exception handling
 
+#include <vector>//Arguments, generated blocks
+
+#include <chrono>//Timing
+
+#include <random>//Seeds
+
+#include <cstdint>//Fixed width integers
+
+#include <cstdlib>//Parsing numbers
+
+#include <climits>//Limits of options
+
+#include <algorithm>//Sorting latencies
+
+#include <thread>//Load test connections, periodic stats
+
+#include <mutex>//Stopping the stats thread
+#include <condition_variable>//Waking the stats thread
+
+#include <cstdio>//Printing stats from another thread
+
+#include <filesystem>//Size of the models read
+
+#ifdef TEXTGUN_SERVER
+#include "TextGunServer.hpp"//Socket server
+
+#include <csignal>//Stopping the server
+#endif
+
 //Number of options
 enum Options: int
 {
@@ -37,8 +66,73 @@ std::string read_filename();
 //Read a complete line, except the new line character
 std::string read_line();
 
-int main()
+/* Batch mode */
+
+//Print the usage of the batch mode
+void usage(const char *prog);
+
+//Run a batch command, such as learn or generate. Return the exit status
+int run_command(const std::vector<std::string> &args);
+
+//Learn files into a model, optionally starting from a saved one, and save it
+int cmd_learn(const std::vector<std::string> &args);
+
+//Generate lines from a saved model
+int cmd_generate(const std::vector<std::string> &args);
+
+//Write a synthetic corpus
+int cmd_corpus(const std::vector<std::string> &args);
+
+#ifdef TEXTGUN_SERVER
+//Serve a saved model over a Unix domain socket until interrupted
+int cmd_serve(const std::vector<std::string> &args);
+
+//Make a single request to a server
+int cmd_query(const std::vector<std::string> &args);
+
+//Make many requests to a server over several connections, and print their latency
+int cmd_loadtest(const std::vector<std::string> &args);
+
+//Stop the running server on SIGINT or SIGTERM
+void stop_server(int);
+#endif
+
+//Run a batch command, printing the latencies and counters every given number of seconds (0 for none), and their totals at the end. Return the exit status
+int run_with_stats(std::uint64_t seconds,const std::vector<std::string> &args);
+
+//Print latencies and counters gathered over some time
+void print_counters(const char *what,const TextGun::Stats &stats,double seconds);
+
+//Learn every line of a stream, the way files are learned, with a number of tokenizer threads (0 for one per core). Return the number of lines learned, and add the bytes read
+std::uint64_t learn_stream(TextGun::WordModel &model,std::istream &input,std::uint64_t &bytes,unsigned threads=0);
+
+//Parse a count, such as a number of lines. Return false if it isn't a number
+bool parse_count(const std::string &s,std::uint64_t &n);
+
+//Get the size of a file, 0 if it can't be known
+std::uint64_t file_size(const std::string &path);
+
+//Print the time and throughput of a command
+void print_stats(const char *what,std::uint64_t lines,std::uint64_t bytes,std::chrono::steady_clock::time_point t);
+
+int main(int argc,char **argv)
 {
+    //Any argument runs a single command, without the menu
+    if (argc>1)
+    {
+        std::vector<std::string> args(argv+1,argv+argc);
+        if (args[0]=="-h"||args[0]=="--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+
+        int rv=run_command(args);
+        if (rv==2)
+            usage(argv[0]);
+        return rv;
+    }
+
     //Flags to control program flow
     bool in=true;//Stay in the program loop
 
@@ -144,19 +238,12 @@ int main()
                     std::ifstream input(file,std::ios::in|std::ios::binary);
                     if(input.is_open())//If the file is open, read it
                     {
-                        //Read the file, line by line
-                        for(std::string s;std::getline(input,s);)
+                        std::uint64_t bytes=0;
+                        if (learn_stream(model,input,bytes))
                         {
-                            if (!s.empty())//Don't read blank lines
-                            {
-                                std::stringstream ss(s);
-                                TextGun::ITextStream ts(ss);
-                                model.learn(ts);
-
-                                //Modify flags
-                                unsaved_changes=true;
-                                empty_model=false;
-                            }
+                            //Modify flags
+                            unsaved_changes=true;
+                            empty_model=false;
                         }
                     }
                     else
@@ -251,3 +338,626 @@ std::string read_line()
 
     return std::move(s);
 }
+
+/* Batch mode */
+
+//Print the usage of the batch mode
+void usage(const char *prog)
+{
+    std::cerr<<"Usage:\n"
+             <<"  "<<prog<<"\t\t\t\tinteractive menu\n"
+             <<"  "<<prog<<" learn FILE... [-i MODEL] [-o MODEL] [-t THREADS]\n"
+             <<"\t\t\t\tlearn text files (- for standard input), one entry per line, starting from MODEL if given, and save the model\n"
+             <<"  "<<prog<<" generate MODEL [-n LINES] [-t THREADS] [-s SEED] [-o FILE]\n"
+             <<"\t\t\t\tgenerate lines from a saved model\n"
+             <<"  "<<prog<<" corpus [-n LINES|--size BYTES] [--vocab WORDS] [-s SEED] [-o FILE]\n"
+             <<"\t\t\t\twrite reproducible synthetic text\n"
+#ifdef TEXTGUN_SERVER
+             <<"  "<<prog<<" serve MODEL SOCKET [-t THREADS] [--learn [--publish LINES]]\n"
+             <<"\t\t\t\tkeep a model loaded and answer requests on a Unix domain socket, until interrupted\n"
+             <<"  "<<prog<<" query SOCKET [-n LINES] [-s SEED] [--learn FILE]\n"
+             <<"\t\t\t\tgenerate lines, or learn a text file (- for standard input), on a server\n"
+             <<"  "<<prog<<" loadtest SOCKET [-c CONNECTIONS] [-r REQUESTS] [-n LINES]\n"
+             <<"\t\t\t\tmake generate requests over several connections, and print their latency\n"
+#endif
+             <<"  "<<prog<<" --stats SECONDS COMMAND...\n"
+             <<"\t\t\t\trun a command, printing the latencies of each operation every SECONDS (0 for only the totals), and the counters of the hot paths if built with TEXTGUN_STATS\n"
+             <<"Output goes to standard output when no file (or -) is given. Timing is printed to standard error\n";
+}
+
+//Run a batch command, such as learn or generate. Return the exit status
+int run_command(const std::vector<std::string> &args)
+{
+    //Output is only written by this thread, and never mixed with C streams
+    std::ios::sync_with_stdio(false);
+
+    if (args[0]=="--stats")
+    {
+        std::uint64_t seconds;
+        if (args.size()<3||!parse_count(args[1],seconds))
+            return 2;
+        return run_with_stats(seconds,std::vector<std::string>(args.begin()+2,args.end()));
+    }
+
+    std::vector<std::string> rest(args.begin()+1,args.end());
+
+    if (args[0]=="learn")
+        return cmd_learn(rest);
+    if (args[0]=="generate")
+        return cmd_generate(rest);
+    if (args[0]=="corpus")
+        return cmd_corpus(rest);
+#ifdef TEXTGUN_SERVER
+    if (args[0]=="serve")
+        return cmd_serve(rest);
+    if (args[0]=="query")
+        return cmd_query(rest);
+    if (args[0]=="loadtest")
+        return cmd_loadtest(rest);
+#endif
+
+    std::cerr<<"ERROR! Unknown command "<<args[0]<<'\n';
+    return 2;
+}
+
+//Learn files into a model, optionally starting from a saved one, and save it
+int cmd_learn(const std::vector<std::string> &args)
+{
+    std::vector<std::string> files;
+    std::string in_model,out_model;
+    std::uint64_t threads=0;
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-i"||args[k]=="--model")&&has_value)
+            in_model=args[++k];
+        else if ((args[k]=="-o"||args[k]=="--output")&&has_value)
+            out_model=args[++k];
+        else if ((args[k]=="-t"||args[k]=="--threads")&&has_value&&parse_count(args[k+1],threads))
+            ++k;
+        else if (args[k]=="-"||args[k][0]!='-')
+            files.push_back(args[k]);
+        else
+            return 2;
+    }
+
+    if (files.empty())
+        return 2;
+
+    TextGun::WordModel model;
+
+    //Start from a saved model
+    if (!in_model.empty())
+    {
+        auto t=std::chrono::steady_clock::now();
+        std::ifstream input(in_model,std::ios::in|std::ios::binary);
+        if (!input.is_open())
+        {
+            std::cerr<<"ERROR! Reading from file "<<in_model<<'\n';
+            return 1;
+        }
+        model.read(input,static_cast<unsigned>(threads));
+        print_stats("read",0,file_size(in_model),t);
+    }
+
+    //Batches are added to the graph by as many threads as they're counted by
+    model.set_batch_threads(static_cast<unsigned>(threads));
+
+    //Learn every file in order
+    auto t=std::chrono::steady_clock::now();
+    std::uint64_t lines=0,bytes=0;
+    for (const std::string &file : files)
+    {
+        if (file=="-")
+            lines+=learn_stream(model,std::cin,bytes,static_cast<unsigned>(threads));
+        else
+        {
+            std::ifstream input(file,std::ios::in|std::ios::binary);
+            if (!input.is_open())
+            {
+                std::cerr<<"ERROR! Reading from file "<<file<<'\n';
+                return 1;
+            }
+            lines+=learn_stream(model,input,bytes,static_cast<unsigned>(threads));
+        }
+    }
+    print_stats("learn",lines,bytes,t);
+
+    //Save it
+    if (!out_model.empty())
+    {
+        t=std::chrono::steady_clock::now();
+        std::ofstream output(out_model,std::ios::out|std::ios::binary|std::ios::trunc);
+        if (output.is_open())
+            model.write(output,static_cast<unsigned>(threads));
+        if (!output)
+        {
+            std::cerr<<"ERROR: saving to file "<<out_model<<'\n';
+            return 1;
+        }
+        print_stats("write",0,static_cast<std::uint64_t>(output.tellp()),t);
+    }
+
+    return 0;
+}
+
+//Generate lines from a saved model
+int cmd_generate(const std::vector<std::string> &args)
+{
+    std::string in_model,out_file="-";
+    std::uint64_t lines=1,threads=1,seed=std::random_device()();
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-n"||args[k]=="--lines")&&has_value&&parse_count(args[k+1],lines))
+            ++k;
+        else if ((args[k]=="-t"||args[k]=="--threads")&&has_value&&parse_count(args[k+1],threads))
+            ++k;
+        else if ((args[k]=="-s"||args[k]=="--seed")&&has_value&&parse_count(args[k+1],seed))
+            ++k;
+        else if ((args[k]=="-o"||args[k]=="--output")&&has_value)
+            out_file=args[++k];
+        else if (args[k][0]!='-'&&in_model.empty())
+            in_model=args[k];
+        else
+            return 2;
+    }
+
+    if (in_model.empty())
+        return 2;
+
+    if (!threads)
+        threads=TextGun::default_threads();
+
+    //Read the model, and keep only an immutable copy, which every thread generates from without locks
+    std::shared_ptr<const TextGun::FrozenModel> version;
+    {
+        auto t=std::chrono::steady_clock::now();
+        std::ifstream input(in_model,std::ios::in|std::ios::binary);
+        if (!input.is_open())
+        {
+            std::cerr<<"ERROR! Reading from file "<<in_model<<'\n';
+            return 1;
+        }
+        TextGun::WordModel model;
+        model.read(input,static_cast<unsigned>(threads));
+        version=model.freeze();
+        print_stats("read",0,file_size(in_model),t);
+    }
+
+    std::ofstream file;
+    if (out_file!="-")
+    {
+        file.open(out_file,std::ios::out|std::ios::binary|std::ios::trunc);
+        if (!file.is_open())
+        {
+            std::cerr<<"ERROR: saving to file "<<out_file<<'\n';
+            return 1;
+        }
+    }
+    std::ostream &output=(out_file=="-")?std::cout:file;
+
+    //Lines are generated in blocks, each by its own engine seeded from its position, so a seed always gives the same output whatever the number of threads
+    const std::uint64_t block_lines=1024;
+    const std::uint64_t blocks=(lines+block_lines-1)/block_lines;
+    const std::uint64_t round=threads*4;//Blocks generated before they're written, in order
+
+    auto t=std::chrono::steady_clock::now();
+    std::uint64_t bytes=0;
+    std::vector<std::string> text(round);
+    for (std::uint64_t first=0;first<blocks&&output;first+=round)
+    {
+        int count=static_cast<int>(std::min(round,blocks-first));
+        TextGun::parallel_for(count,static_cast<unsigned>(threads),[&](int k)
+        {
+            std::uint64_t b=first+k;
+            std::default_random_engine eng(static_cast<unsigned int>(seed^(b*0x9E3779B97F4A7C15ULL)^((b*0x9E3779B97F4A7C15ULL)>>32)));
+
+            std::ostringstream o;
+            TextGun::OTextStream ots(o);
+            std::uint64_t n=std::min(block_lines,lines-b*block_lines);
+            for (std::uint64_t l=0;l<n;++l)
+                version->think(ots,eng);
+            text[k]=o.str();
+        });
+
+        for (int k=0;k<count;++k)
+        {
+            output.write(text[k].data(),text[k].size());
+            bytes+=text[k].size();
+        }
+    }
+    output.flush();
+
+    if (!output)
+    {
+        std::cerr<<"ERROR: writing to "<<out_file<<'\n';
+        return 1;
+    }
+    print_stats("generate",lines,bytes,t);
+
+    return 0;
+}
+
+//Write a synthetic corpus
+int cmd_corpus(const std::vector<std::string> &args)
+{
+    std::string out_file="-";
+    std::uint64_t lines=0,size=0,vocab=50000,seed=0;
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-n"||args[k]=="--lines")&&has_value&&parse_count(args[k+1],lines))
+            ++k;
+        else if (args[k]=="--size"&&has_value&&parse_count(args[k+1],size))
+            ++k;
+        else if (args[k]=="--vocab"&&has_value&&parse_count(args[k+1],vocab)&&vocab)
+            ++k;
+        else if ((args[k]=="-s"||args[k]=="--seed")&&has_value&&parse_count(args[k+1],seed))
+            ++k;
+        else if ((args[k]=="-o"||args[k]=="--output")&&has_value)
+            out_file=args[++k];
+        else
+            return 2;
+    }
+
+    //Exactly one of the sizes
+    if (!lines==!size)
+        return 2;
+
+    std::ofstream file;
+    if (out_file!="-")
+    {
+        file.open(out_file,std::ios::out|std::ios::binary|std::ios::trunc);
+        if (!file.is_open())
+        {
+            std::cerr<<"ERROR: saving to file "<<out_file<<'\n';
+            return 1;
+        }
+    }
+    std::ostream &output=(out_file=="-")?std::cout:file;
+
+    auto t=std::chrono::steady_clock::now();
+    TextGun::CorpusGenerator gen(seed,static_cast<int>(std::min<std::uint64_t>(vocab,1<<30)));
+    std::uint64_t bytes=size;
+    if (lines)
+        bytes=gen.write(output,lines);
+    else
+        lines=gen.write_size(output,size);
+    output.flush();
+
+    if (!output)
+    {
+        std::cerr<<"ERROR: writing to "<<out_file<<'\n';
+        return 1;
+    }
+    print_stats("corpus",lines,bytes,t);
+
+    return 0;
+}
+
+#ifdef TEXTGUN_SERVER
+//Server stopped by the signal handlers
+TextGun::Server *server=nullptr;
+
+//Serve a saved model over a Unix domain socket until interrupted
+int cmd_serve(const std::vector<std::string> &args)
+{
+    std::string in_model,socket_path;
+    std::uint64_t threads=0,publish=TextGun::LiveModel::DEF_PUBLISH_LINES;
+    bool learning=false;
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-t"||args[k]=="--threads")&&has_value&&parse_count(args[k+1],threads))
+            ++k;
+        else if (args[k]=="--publish"&&has_value&&parse_count(args[k+1],publish)&&publish>0&&publish<=INT_MAX)
+            ++k;
+        else if (args[k]=="--learn")
+            learning=true;
+        else if (args[k][0]!='-'&&in_model.empty())
+            in_model=args[k];
+        else if (args[k][0]!='-'&&socket_path.empty())
+            socket_path=args[k];
+        else
+            return 2;
+    }
+
+    if (socket_path.empty())
+        return 2;
+
+    //Read the model, once. Learned lines are published every so many lines
+    TextGun::LiveModel model(static_cast<int>(publish));
+    {
+        auto t=std::chrono::steady_clock::now();
+        std::ifstream input(in_model,std::ios::in|std::ios::binary);
+        if (!input.is_open())
+        {
+            std::cerr<<"ERROR! Reading from file "<<in_model<<'\n';
+            return 1;
+        }
+        model.read(input,static_cast<unsigned>(threads));
+        print_stats("read",0,file_size(in_model),t);
+    }
+
+    TextGun::Server srv(model,static_cast<unsigned>(threads),learning);
+    if (!srv.listen(socket_path))
+    {
+        std::cerr<<"ERROR! Listening on "<<socket_path<<'\n';
+        return 1;
+    }
+
+    server=&srv;
+    std::signal(SIGINT,stop_server);
+    std::signal(SIGTERM,stop_server);
+
+    std::cerr<<"Serving on "<<socket_path<<'\n';
+    srv.run();
+
+    std::signal(SIGINT,SIG_DFL);
+    std::signal(SIGTERM,SIG_DFL);
+    server=nullptr;
+
+    return 0;
+}
+
+//Make a single request to a server
+int cmd_query(const std::vector<std::string> &args)
+{
+    std::string socket_path,learn_file;
+    std::uint64_t lines=1,seed=0;
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-n"||args[k]=="--lines")&&has_value&&parse_count(args[k+1],lines))
+            ++k;
+        else if ((args[k]=="-s"||args[k]=="--seed")&&has_value&&parse_count(args[k+1],seed))
+            ++k;
+        else if (args[k]=="--learn"&&has_value)
+            learn_file=args[++k];
+        else if (args[k][0]!='-'&&socket_path.empty())
+            socket_path=args[k];
+        else
+            return 2;
+    }
+
+    if (socket_path.empty()||lines>TextGun::Server::MAX_LINES)
+        return 2;
+
+    TextGun::Client client;
+    if (!client.connect(socket_path))
+    {
+        std::cerr<<"ERROR! Connecting to "<<socket_path<<'\n';
+        return 1;
+    }
+
+    auto t=std::chrono::steady_clock::now();
+    TextGun::Status st;
+    if (learn_file.empty())
+    {
+        std::string text;
+        st=client.generate(static_cast<std::uint32_t>(lines),seed,text);
+        std::cout<<text;
+    }
+    else
+    {
+        //Read the whole text, it's sent as one request
+        std::ifstream file;
+        if (learn_file!="-")
+        {
+            file.open(learn_file,std::ios::in|std::ios::binary);
+            if (!file.is_open())
+            {
+                std::cerr<<"ERROR! Reading from file "<<learn_file<<'\n';
+                return 1;
+            }
+        }
+        std::stringstream text;
+        text<<((learn_file=="-")?std::cin.rdbuf():file.rdbuf());
+
+        std::uint32_t learned=0;
+        st=client.learn(text.str(),learned);
+        lines=learned;
+    }
+
+    if (st!=TextGun::Status::OK)
+    {
+        std::cerr<<"ERROR! Request failed with status "<<static_cast<int>(st)<<'\n';
+        return 1;
+    }
+    print_stats("query",lines,0,t);
+
+    return 0;
+}
+
+//Make many requests to a server over several connections, and print their latency
+int cmd_loadtest(const std::vector<std::string> &args)
+{
+    std::string socket_path;
+    std::uint64_t connections=4,requests=10000,lines=1;
+
+    for (std::size_t k=0;k<args.size();++k)
+    {
+        bool has_value=k+1<args.size();
+
+        if ((args[k]=="-c"||args[k]=="--connections")&&has_value&&parse_count(args[k+1],connections)&&connections)
+            ++k;
+        else if ((args[k]=="-r"||args[k]=="--requests")&&has_value&&parse_count(args[k+1],requests))
+            ++k;
+        else if ((args[k]=="-n"||args[k]=="--lines")&&has_value&&parse_count(args[k+1],lines))
+            ++k;
+        else if (args[k][0]!='-'&&socket_path.empty())
+            socket_path=args[k];
+        else
+            return 2;
+    }
+
+    if (socket_path.empty()||lines>TextGun::Server::MAX_LINES)
+        return 2;
+
+    //Latency of every request, in microseconds, each connection filling its own part
+    std::vector<double> lat(requests);
+    std::atomic<std::uint64_t> failed(0);
+
+    auto t=std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (std::uint64_t c=0;c<connections;++c)
+    {
+        pool.emplace_back([&,c]
+        {
+            TextGun::Client client;
+            bool ok=client.connect(socket_path);
+
+            std::string text;
+            for (std::uint64_t k=c;k<requests;k+=connections)
+            {
+                auto r=std::chrono::steady_clock::now();
+                if (!ok||client.generate(static_cast<std::uint32_t>(lines),k+1,text)!=TextGun::Status::OK)
+                    ++failed;
+                lat[k]=std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now()-r).count();
+            }
+        });
+    }
+    for (std::thread &th : pool)
+        th.join();
+    double s=std::chrono::duration<double>(std::chrono::steady_clock::now()-t).count();
+
+    if (failed)
+    {
+        std::cerr<<"ERROR! "<<failed<<" of "<<requests<<" requests failed\n";
+        return 1;
+    }
+    if (!requests)
+        return 0;
+
+    std::sort(lat.begin(),lat.end());
+    auto pct=[&](double p){return lat[std::min(lat.size()-1,static_cast<std::size_t>(p*lat.size()))];};
+
+    std::cerr<<"loadtest: "<<requests<<" requests over "<<connections<<" connections in "<<s<<" s ("<<static_cast<std::uint64_t>(requests/s)<<" requests/s)\n"
+             <<"latency (us): p50 "<<pct(0.5)<<", p90 "<<pct(0.9)<<", p99 "<<pct(0.99)<<", p999 "<<pct(0.999)<<", max "<<lat.back()<<'\n';
+
+    return 0;
+}
+
+//Stop the running server on SIGINT or SIGTERM
+void stop_server(int)
+{
+    if (server)
+        server->stop();
+}
+#endif
+
+//Run a batch command, printing the latencies and counters every given number of seconds (0 for none), and their totals at the end. Return the exit status
+int run_with_stats(std::uint64_t seconds,const std::vector<std::string> &args)
+{
+    auto start=std::chrono::steady_clock::now();
+
+    std::mutex m;
+    std::condition_variable wake;
+    bool done=false;
+
+    //Print what was counted on each interval, until the command is done
+    std::thread reporter([&]
+    {
+        if (!seconds)
+            return;
+
+        TextGun::Stats last=TextGun::Stats::collect();
+        auto t=std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> guard(m);
+        while (!wake.wait_for(guard,std::chrono::seconds(seconds),[&]{return done;}))
+        {
+            TextGun::Stats now=TextGun::Stats::collect();
+            auto tn=std::chrono::steady_clock::now();
+
+            print_counters("stats",now.since(last),std::chrono::duration<double>(tn-t).count());
+            last=now;
+            t=tn;
+        }
+    });
+
+    int rv=run_command(args);
+
+    {
+        std::lock_guard<std::mutex> guard(m);
+        done=true;
+    }
+    wake.notify_all();
+    reporter.join();
+
+    print_counters("stats total",TextGun::Stats::collect(),std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+    return rv;
+}
+
+//Print latencies and counters gathered over some time
+void print_counters(const char *what,const TextGun::Stats &stats,double seconds)
+{
+    std::ostringstream ss;
+    ss<<what<<" ("<<seconds<<" s), latencies in us:\n";
+
+    //One line per operation
+    stats.write_latencies(ss);
+
+    if (TextGun::Stats::enabled())
+    {
+        ss<<"counters: ";
+        stats.write(ss);
+        ss<<'\n';
+    }
+
+    //The command may be printing on std::cerr from another thread, write it all at once
+    std::fputs(ss.str().c_str(),stderr);
+}
+
+//Learn every line of a stream, the way files are learned, with a number of tokenizer threads (0 for one per core). Return the number of lines learned, and add the bytes read
+std::uint64_t learn_stream(TextGun::WordModel &model,std::istream &input,std::uint64_t &bytes,unsigned threads)
+{
+    //Reading, splitting lines into words and learning them run at once
+    TextGun::LearnPipeline pipeline(model,threads);
+    return pipeline.learn(input,bytes);
+}
+
+//Parse a count, such as a number of lines. Return false if it isn't a number
+bool parse_count(const std::string &s,std::uint64_t &n)
+{
+    if (s.empty()||s[0]<'0'||s[0]>'9')
+        return false;
+
+    char *end;
+    n=std::strtoull(s.c_str(),&end,10);
+    return *end=='\0';
+}
+
+//Get the size of a file, 0 if it can't be known
+std::uint64_t file_size(const std::string &path)
+{
+    //The read position isn't the size, models are read out of order
+    std::error_code ec;
+    std::uintmax_t size=std::filesystem::file_size(path,ec);
+    return ec?0:static_cast<std::uint64_t>(size);
+}
+
+//Print the time and throughput of a command
+void print_stats(const char *what,std::uint64_t lines,std::uint64_t bytes,std::chrono::steady_clock::time_point t)
+{
+    double s=std::chrono::duration<double>(std::chrono::steady_clock::now()-t).count();
+    double div=s>0?s:1e-9;
+
+    std::cerr<<what<<": "<<s<<" s";
+    if (lines)
+        std::cerr<<", "<<lines<<" lines ("<<static_cast<std::uint64_t>(lines/div)<<" lines/s)";
+    if (bytes)
+        std::cerr<<", "<<bytes/1e6<<" MB ("<<bytes/1e6/div<<" MB/s)";
+    std::cerr<<'\n';
+}